@@ -0,0 +1,323 @@
+// Terrain micro-benchmark: runs the CPU terrain code of the game (GroundMesh, HeightfieldRing and the
+// height queries of sampleHeight) along a flight path, without any window or Vulkan device.
+// Every pass replays the whole path on freshly initialized objects, with the parameters of the game
+// (TerrainParameters.hpp), and reports time per vertex / per sample / per query, noise evaluations per
+// second and heap allocations per frame (the first frame, that fills the caches, is excluded from the allocations).
+//
+//   TerrainBench [--frames=N] [--threads=N] [--repeat=N] [--compact] [--path=file]
+//                [--out=file] [--baseline=file] [--tolerance=T]
+//
+// Every pass is run --repeat times (5 by default) and the fastest run is reported.
+// --threads is the size of the job system, 1 by default so that the results do not depend on the cores of the machine.
+// --path replays a recorded flight, one "x z" line per frame, instead of the built-in one.
+// --out writes the results as JSON; --baseline compares them with a previous output and exits with 1 when the
+// allocations per frame grow, or a time gets worse by more than the tolerance (0.1 = 10% by default).
+// Times are compared relative to the one of the heightfield pass, a plain noise evaluation loop, so that
+// a baseline recorded on a faster or slower machine can still be used.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <json.hpp>
+
+#define TERRAIN_CACHE_IMPLEMENTATION
+#include "modules/TerrainCache.hpp"
+#define JOB_SYSTEM_IMPLEMENTATION
+#include "modules/JobSystem.hpp"
+#define CLIPMAP_IMPLEMENTATION
+#include "modules/Clipmap.hpp"
+#define GROUND_MESH_IMPLEMENTATION
+#include "modules/GroundMesh.hpp"
+#define HEIGHTFIELD_RING_IMPLEMENTATION
+#include "modules/HeightfieldRing.hpp"
+#include "modules/TerrainParameters.hpp"
+
+// Heap allocations, counted by the replaceable global operators new
+static std::atomic<int64_t> allocationCount{0};
+
+static void *countedAlloc(size_t size) {
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	if(void *p = std::malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+
+void *operator new(size_t size) { return countedAlloc(size); }
+void *operator new[](size_t size) { return countedAlloc(size); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+const float FRAME_TIME = 1.0f / 60.0f;
+// sampleHeight queries per frame: one per tree, as updateTreePositions()
+const int HEIGHT_QUERIES = 400;
+// pass and time the others are divided by before they are compared with the baseline
+const char *REFERENCE_PASS = "heightfield";
+const char *REFERENCE_TIME = "ns_per_sample";
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedNs(Clock::time_point t0) {
+	return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count();
+}
+
+// Built-in flight: cruise speed with boosts, slow turns and a few full loops, at 60 frames per second
+static std::vector<glm::vec2> builtInPath(int frames) {
+	std::vector<glm::vec2> path(frames);
+	glm::vec2 p(0.0f);
+	float heading = 0.0f;
+	for(int f = 0; f < frames; f++) {
+		float t = f * FRAME_TIME;
+		float speed = 20.0f + 15.0f * std::max(0.0f, std::sin(t * 0.7f));
+		heading += FRAME_TIME * 0.6f * std::sin(t * 0.25f);
+		p += glm::vec2(std::sin(heading), std::cos(heading)) * speed * FRAME_TIME;
+		path[f] = p;
+	}
+	return path;
+}
+
+static std::vector<glm::vec2> loadPath(const std::string &file) {
+	std::ifstream in(file);
+	if(!in) throw std::runtime_error("Cannot open " + file);
+	std::vector<glm::vec2> path;
+	float x, z;
+	while(in >> x >> z) path.push_back(glm::vec2(x, z));
+	if(path.empty()) throw std::runtime_error("Empty flight path " + file);
+	return path;
+}
+
+struct Counter {
+	double ns = 0.0;
+	int64_t allocations = 0;
+} ;
+
+// Runs fn(frame) on every frame of the path, timing it and counting its allocations after the first frame
+template <class F>
+static Counter runFrames(size_t frames, F fn) {
+	Counter c;
+	for(size_t f = 0; f < frames; f++) {
+		int64_t a0 = allocationCount.load();
+		auto t0 = Clock::now();
+		fn(f);
+		c.ns += elapsedNs(t0);
+		if(f > 0) c.allocations += allocationCount.load() - a0;
+	}
+	return c;
+}
+
+static nlohmann::json benchMesh(JobSystem &jobs, const std::vector<glm::vec2> &path, bool compact,
+								bool normals, bool gridNormals) {
+	FastNoise noise;
+	initGroundNoise(noise);
+	GroundMesh mesh;
+	mesh.init(&jobs, &noise, CLIPMAP_LEVELS, CLIPMAP_HALF_SIZE, CLIPMAP_SPACING, GROUND_SCALE,
+			  NOISE_SCALE, HEIGHT_SCALE, compact);
+	std::vector<unsigned char> region = mesh.vertices;
+	const float floorY = (WATER_LEVEL - WATER_FLOOR_DEPTH) / GROUND_SCALE;
+	const float blendWidth = WATER_BLEND_WIDTH / GROUND_SCALE;
+
+	Counter c = runFrames(path.size(), [&](size_t f) {
+		mesh.follow(path[f].x, path[f].y);
+		mesh.write(region.data(), f * FRAME_TIME * 0.3f, floorY, blendWidth, normals, gridNormals);
+	});
+
+	double vertices = (double)mesh.getVertexCount() * path.size();
+	nlohmann::json r;
+	r["vertices"] = mesh.getVertexCount();
+	r["ns_per_vertex"] = c.ns / vertices;
+	r["ms_per_frame"] = c.ns / path.size() * 1e-6;
+	r["noise_evaluations"] = mesh.getNoiseEvaluations();
+	r["noise_evaluations_per_s"] = mesh.getNoiseEvaluations() / (c.ns * 1e-9);
+	r["allocations_per_frame"] = (double)c.allocations / std::max<size_t>(1, path.size() - 1);
+	mesh.cleanup();
+	return r;
+}
+
+static nlohmann::json benchHeightfield(const std::vector<glm::vec2> &path) {
+	FastNoise noise;
+	initGroundNoise(noise);
+	HeightfieldRing ring;
+	ring.init(&noise, HF_COLS, HF_ROWS, CELL_SIZE, NOISE_SCALE, HEIGHT_SCALE);
+	ring.recenter(path[0].x, path[0].y, GROUND_SCALE);
+	ring.resetStats();
+
+	volatile float sink = 0.0f;
+	Counter c = runFrames(path.size(), [&](size_t f) {
+		ring.recenter(path[f].x, path[f].y, GROUND_SCALE);
+		sink = ring.at(ring.getOriginX() + HF_COLS / 2, ring.getOriginZ() + HF_ROWS / 2);
+	});
+
+	nlohmann::json r;
+	r["samples"] = ring.samplesFilled;
+	r["ns_per_sample"] = ring.samplesFilled > 0 ? c.ns / ring.samplesFilled : 0.0;
+	r["us_per_frame"] = c.ns / path.size() * 1e-3;
+	r["noise_evaluations_per_s"] = ring.samplesFilled / (c.ns * 1e-9);
+	r["allocations_per_frame"] = (double)c.allocations / std::max<size_t>(1, path.size() - 1);
+	ring.cleanup();
+	return r;
+}
+
+static nlohmann::json benchSampleHeight(JobSystem &jobs, const std::vector<glm::vec2> &path) {
+	FastNoise noise;
+	initGroundNoise(noise);
+	GroundMesh mesh;
+	mesh.init(&jobs, &noise, CLIPMAP_LEVELS, CLIPMAP_HALF_SIZE, CLIPMAP_SPACING, GROUND_SCALE,
+			  NOISE_SCALE, HEIGHT_SCALE, false);
+
+	// fixed offsets around the airplane, like the trees of the game
+	std::vector<glm::vec2> offsets(HEIGHT_QUERIES);
+	uint32_t seed = 12345;
+	auto next = [&]() {
+		seed = seed * 1664525u + 1013904223u;
+		return (float)(seed >> 8) / (float)(1 << 24) * 1000.0f - 500.0f;
+	};
+	for(auto &o : offsets) o = glm::vec2(next(), next());
+
+	volatile float sink = 0.0f;
+	Counter c = runFrames(path.size(), [&](size_t f) {
+		float sum = 0.0f;
+		for(const glm::vec2 &o : offsets) {
+			sum += mesh.sampleNoise(path[f].x + o.x, path[f].y + o.y) * HEIGHT_SCALE * GROUND_SCALE;
+		}
+		sink = sum;
+	});
+
+	double queries = (double)HEIGHT_QUERIES * path.size();
+	nlohmann::json r;
+	r["queries"] = queries;
+	r["ns_per_query"] = c.ns / queries;
+	r["noise_evaluations_per_s"] = mesh.getNoiseEvaluations() / (c.ns * 1e-9);
+	r["allocations_per_frame"] = (double)c.allocations / std::max<size_t>(1, path.size() - 1);
+	mesh.cleanup();
+	return r;
+}
+
+// Runs a pass several times and keeps the fastest run, to filter out the noise of the machine
+template <class F>
+static nlohmann::json bestOf(int repeat, F pass) {
+	nlohmann::json best;
+	double bestNs = 0.0;
+	for(int i = 0; i < repeat; i++) {
+		nlohmann::json r = pass();
+		for(auto m = r.begin(); m != r.end(); ++m) {
+			if(m.key().rfind("ns_per_", 0) != 0) continue;
+			if(best.is_null() || m.value().get<double>() < bestNs) {
+				best = r;
+				bestNs = m.value().get<double>();
+			}
+		}
+	}
+	return best;
+}
+
+// Compares the results with a baseline: returns false on a regression.
+// The times are divided by the reference time of their own run, the allocations are compared as they are
+static bool compare(const nlohmann::json &current, const nlohmann::json &baseline, double tolerance) {
+	if(current["threads"] != baseline["threads"]) {
+		std::cout << "\nThe baseline has been recorded with " << baseline["threads"] << " threads, not " <<
+					 current["threads"] << ": run with --threads=" << baseline["threads"] << "\n";
+		return false;
+	}
+	double curRef = current["passes"][REFERENCE_PASS][REFERENCE_TIME].get<double>();
+	double baseRef = baseline["passes"][REFERENCE_PASS][REFERENCE_TIME].get<double>();
+
+	bool ok = true;
+	std::cout << "\nComparison with the baseline (current / baseline, times relative to " <<
+				 REFERENCE_PASS << "." << REFERENCE_TIME << "):\n";
+	for(auto pass = current["passes"].begin(); pass != current["passes"].end(); ++pass) {
+		if(!baseline["passes"].contains(pass.key())) {
+			std::cout << "  " << pass.key() << ": not in the baseline\n";
+			continue;
+		}
+		const nlohmann::json &base = baseline["passes"][pass.key()];
+		for(auto m = pass.value().begin(); m != pass.value().end(); ++m) {
+			const std::string &name = m.key();
+			bool isTime = (name.rfind("ns_per_", 0) == 0) && (pass.key() != REFERENCE_PASS);
+			bool isAlloc = name == "allocations_per_frame";
+			if((!isTime && !isAlloc) || !base.contains(name)) continue;
+			double cur = m.value().get<double>();
+			double ref = base[name].get<double>();
+			if(isTime) {
+				cur /= curRef;
+				ref /= baseRef;
+			}
+			bool worse = isTime ? (cur > ref * (1.0 + tolerance)) : (cur > ref);
+			std::cout << "  " << pass.key() << "." << name << ": " << cur << " / " << ref;
+			if(isTime && ref > 0.0) std::cout << " = " << cur / ref;
+			std::cout << (worse ? "  REGRESSION\n" : "\n");
+			ok = ok && !worse;
+		}
+	}
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	int frames = 600;
+	int threads = 1;
+	int repeat = 5;
+	bool compact = false;
+	std::string pathFile, outFile, baselineFile;
+	double tolerance = 0.1;
+	for(int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if(arg.rfind("--frames=", 0) == 0) frames = std::max(2, std::atoi(arg.c_str() + 9));
+		else if(arg.rfind("--threads=", 0) == 0) threads = std::max(0, std::atoi(arg.c_str() + 10));
+		else if(arg.rfind("--repeat=", 0) == 0) repeat = std::max(1, std::atoi(arg.c_str() + 9));
+		else if(arg == "--compact") compact = true;
+		else if(arg.rfind("--path=", 0) == 0) pathFile = arg.substr(7);
+		else if(arg.rfind("--out=", 0) == 0) outFile = arg.substr(6);
+		else if(arg.rfind("--baseline=", 0) == 0) baselineFile = arg.substr(11);
+		else if(arg.rfind("--tolerance=", 0) == 0) tolerance = std::atof(arg.c_str() + 12);
+		else {
+			std::cerr << "Unknown option " << arg << "\n";
+			return EXIT_FAILURE;
+		}
+	}
+
+	try {
+		std::vector<glm::vec2> path = pathFile.empty() ? builtInPath(frames) : loadPath(pathFile);
+		JobSystem jobs;
+		jobs.init(threads);
+
+		nlohmann::json results;
+		results["frames"] = path.size();
+		results["threads"] = jobs.getThreadCount();
+		results["vertex_format"] = compact ? "VertexTerrain" : "VertexTan";
+		results["path"] = pathFile.empty() ? "built-in" : pathFile;
+		results["repeat"] = repeat;
+		nlohmann::json &passes = results["passes"];
+		passes["mesh_displacement"] = bestOf(repeat, [&]() { return benchMesh(jobs, path, compact, false, false); });
+		passes["mesh_grid_normals"] = bestOf(repeat, [&]() { return benchMesh(jobs, path, compact, true, true); });
+		passes["mesh_triangle_normals"] = bestOf(repeat, [&]() { return benchMesh(jobs, path, compact, true, false); });
+		passes["heightfield"] = bestOf(repeat, [&]() { return benchHeightfield(path); });
+		passes["sample_height"] = bestOf(repeat, [&]() { return benchSampleHeight(jobs, path); });
+		jobs.cleanup();
+
+		std::cout << results.dump(4) << "\n";
+		if(!outFile.empty()) {
+			std::ofstream(outFile) << results.dump(4) << "\n";
+		}
+		if(!baselineFile.empty()) {
+			std::ifstream in(baselineFile);
+			if(!in) throw std::runtime_error("Cannot open " + baselineFile);
+			nlohmann::json baseline = nlohmann::json::parse(in);
+			if(!compare(results, baseline, tolerance)) return EXIT_FAILURE;
+		}
+	} catch(const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
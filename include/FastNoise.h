@@ -52,6 +52,7 @@ public:
 	enum FractalType { FBM, Billow, RigidMulti };
 	enum CellularDistanceFunction { Euclidean, Manhattan, Natural };
 	enum CellularReturnType { CellValue, NoiseLookup, Distance, Distance2, Distance2Add, Distance2Sub, Distance2Mul, Distance2Div };
+	enum SIMDLevel { SIMD_Scalar, SIMD_SSE2, SIMD_AVX2 };
 
 	// Sets seed used for all noise types
 	// Default: 1337
@@ -60,6 +61,10 @@ public:
 	// Returns seed used for all noise types
 	int GetSeed() const { return m_seed; }
 
+	// Returns the permutation table generated from the seed (512 entries, the second half repeats the first)
+	// Used to reproduce the noise outside of this class, e.g. in a shader
+	const unsigned char* GetPermutationTable() const { return m_perm; }
+
 	// Sets frequency for all noise types
 	// Default: 0.01
 	void SetFrequency(FN_DECIMAL frequency) { m_frequency = frequency; }
@@ -161,6 +166,17 @@ public:
 	// Returns the maximum warp distance from original location when using GradientPerturb{Fractal}(...)
 	FN_DECIMAL GetGradientPerturbAmp() const { return m_gradientPerturbAmp; }
 
+	// Returns the widest instruction set the batch functions can use on this CPU (detected once at runtime)
+	static SIMDLevel GetSupportedSIMDLevel();
+
+	// Caps the instruction set used by the batch functions, SIMD_Scalar forces the scalar path
+	// The level actually used is the lowest between this and GetSupportedSIMDLevel()
+	// Default: SIMD_AVX2
+	void SetMaxSIMDLevel(SIMDLevel simdLevel) { m_maxSIMDLevel = simdLevel; }
+
+	// Returns the maximum instruction set the batch functions are allowed to use
+	SIMDLevel GetMaxSIMDLevel() const { return m_maxSIMDLevel; }
+
 	//2D
 	FN_DECIMAL GetValue(FN_DECIMAL x, FN_DECIMAL y) const;
 	FN_DECIMAL GetValueFractal(FN_DECIMAL x, FN_DECIMAL y) const;
@@ -213,6 +229,25 @@ public:
 	FN_DECIMAL GetWhiteNoise(FN_DECIMAL x, FN_DECIMAL y, FN_DECIMAL z, FN_DECIMAL w) const;
 	FN_DECIMAL GetWhiteNoiseInt(int x, int y, int z, int w) const;
 
+	//Batch
+	// The batch functions return the same values as GetNoise(...) (up to float rounding)
+	// Perlin and PerlinFractal are evaluated 4 (SSE2) or 8 (AVX2) points at a time,
+	// every other noise type falls back to one GetNoise(...) call per point
+
+	// out[i] = GetNoise(x[i], y[i]) for i in [0, count)
+	void GetNoiseSet(const FN_DECIMAL* x, const FN_DECIMAL* y, FN_DECIMAL* out, int count) const;
+	// out[i] = GetNoise(x[i], y[i], z[i]) for i in [0, count)
+	void GetNoiseSet(const FN_DECIMAL* x, const FN_DECIMAL* y, const FN_DECIMAL* z, FN_DECIMAL* out, int count) const;
+
+	// out[row * rowStride + col] = GetNoise(startX + col * stepX, startY + row * stepY)
+	// rowStride <= 0 means a tightly packed grid (rowStride = sizeX)
+	void FillNoiseGrid(FN_DECIMAL* out, int sizeX, int sizeY,
+	                   FN_DECIMAL startX, FN_DECIMAL startY, FN_DECIMAL stepX, FN_DECIMAL stepY, int rowStride = 0) const;
+	// out[(k * sizeY + row) * sizeX + col] = GetNoise(startX + col * stepX, startY + row * stepY, startZ + k * stepZ)
+	void FillNoiseGrid(FN_DECIMAL* out, int sizeX, int sizeY, int sizeZ,
+	                   FN_DECIMAL startX, FN_DECIMAL startY, FN_DECIMAL startZ,
+	                   FN_DECIMAL stepX, FN_DECIMAL stepY, FN_DECIMAL stepZ) const;
+
 private:
 	unsigned char m_perm[512];
 	unsigned char m_perm12[512];
@@ -237,8 +272,14 @@ private:
 
 	FN_DECIMAL m_gradientPerturbAmp = FN_DECIMAL(1);
 
+	SIMDLevel m_maxSIMDLevel = SIMD_AVX2;
+
 	void CalculateFractalBounding();
 
+	//Batch
+	SIMDLevel ActiveSIMDLevel() const;
+	void PerlinBatch(SIMDLevel simdLevel, const FN_DECIMAL* x, const FN_DECIMAL* y, const FN_DECIMAL* z, FN_DECIMAL* out) const;
+
 	//2D
 	FN_DECIMAL SingleValueFractalFBM(FN_DECIMAL x, FN_DECIMAL y) const;
 	FN_DECIMAL SingleValueFractalBillow(FN_DECIMAL x, FN_DECIMAL y) const;
@@ -0,0 +1,101 @@
+// Procedural geometry clipmap.
+// The terrain is made of nested square levels centered on the origin, each with the same resolution and
+// twice the spacing of the previous one: level 0 is a full grid of (2 * halfSize + 1)^2 vertices, the
+// other levels are rings whose hole is exactly covered by the previous level.
+// Vertices are given in lattice coordinates of their own level, so vertex (gx, gz) of level l is at
+// (gx, gz) * spacing * 2^l. If the whole grid is moved by multiples of the coarsest spacing, every
+// vertex stays on a lattice point of its level.
+// Where a level meets the next coarser one, every other vertex of its outer border lies halfway along an
+// edge of the coarser level: giving it the average height of the two ends of that edge (see "stitches")
+// closes the cracks between the levels.
+
+struct ClipmapVertex {
+	int gx, gz;		// lattice coordinates, in units of the spacing of the level
+	int level;
+} ;
+
+class ClipmapGrid {
+	public:
+	int levels = 0;
+	int halfSize = 0;
+
+	std::vector<ClipmapVertex> vertices;
+	std::vector<uint32_t> indices;
+	// vertices of level l are [levelStart[l], levelStart[l + 1])
+	std::vector<uint32_t> levelStart;
+	// neighbours of each vertex on its own level (-x, +x, -z, +z), the vertex itself where missing
+	std::vector<glm::uvec4> neighbours;
+	// (vertex, a, b): the height of the vertex must be the average of the heights of a and b
+	std::vector<glm::uvec3> stitches;
+
+	// halfSize must be even, so that the border of each level falls on the lattice of the next one
+	void init(int _levels, int _halfSize);
+	void cleanup();
+};
+
+#ifdef CLIPMAP_IMPLEMENTATION
+
+void ClipmapGrid::init(int _levels, int _halfSize) {
+	levels = _levels;
+	halfSize = _halfSize & ~1;
+	cleanup();
+
+	const int side = 2 * halfSize + 1;
+	const int hole = halfSize / 2;		// half size of the hole of a ring, in its own lattice units
+	std::vector<uint32_t> grid(side * side);
+
+	for(int l = 0; l < levels; l++) {
+		levelStart.push_back((uint32_t)vertices.size());
+
+		// vertices: the whole square for level 0, the ring outside the hole (border included) for the others
+		std::fill(grid.begin(), grid.end(), UINT32_MAX);
+		for(int gz = -halfSize; gz <= halfSize; gz++) {
+			for(int gx = -halfSize; gx <= halfSize; gx++) {
+				if(l > 0 && std::abs(gx) < hole && std::abs(gz) < hole) continue;
+				grid[(gz + halfSize) * side + (gx + halfSize)] = (uint32_t)vertices.size();
+				vertices.push_back({gx, gz, l});
+			}
+		}
+		auto at = [&](int gx, int gz) -> uint32_t {
+			if(gx < -halfSize || gx > halfSize || gz < -halfSize || gz > halfSize) return UINT32_MAX;
+			return grid[(gz + halfSize) * side + (gx + halfSize)];
+		};
+
+		// two triangles per cell, skipping the cells of the hole
+		for(int gz = -halfSize; gz < halfSize; gz++) {
+			for(int gx = -halfSize; gx < halfSize; gx++) {
+				if(l > 0 && gx >= -hole && gx < hole && gz >= -hole && gz < hole) continue;
+				uint32_t a = at(gx, gz + 1), b = at(gx + 1, gz + 1), c = at(gx + 1, gz), d = at(gx, gz);
+				indices.insert(indices.end(), {a, b, c, a, c, d});
+			}
+		}
+
+		for(uint32_t vi = levelStart[l]; vi < (uint32_t)vertices.size(); vi++) {
+			int gx = vertices[vi].gx, gz = vertices[vi].gz;
+			uint32_t nb[4] = {at(gx - 1, gz), at(gx + 1, gz), at(gx, gz - 1), at(gx, gz + 1)};
+			for(auto &n : nb) {
+				if(n == UINT32_MAX) n = vi;
+			}
+			neighbours.push_back(glm::uvec4(nb[0], nb[1], nb[2], nb[3]));
+
+			// odd vertices of the outer border, the coarsest level has nothing to stitch to
+			if(l == levels - 1) continue;
+			if((std::abs(gx) == halfSize) && (gz & 1)) {
+				stitches.push_back(glm::uvec3(vi, at(gx, gz - 1), at(gx, gz + 1)));
+			} else if((std::abs(gz) == halfSize) && (gx & 1)) {
+				stitches.push_back(glm::uvec3(vi, at(gx - 1, gz), at(gx + 1, gz)));
+			}
+		}
+	}
+	levelStart.push_back((uint32_t)vertices.size());
+}
+
+void ClipmapGrid::cleanup() {
+	vertices.clear();
+	indices.clear();
+	levelStart.clear();
+	neighbours.clear();
+	stitches.clear();
+}
+
+#endif
@@ -0,0 +1,449 @@
+// CPU ground mesh.
+// The ground is a clipmap (see Clipmap.hpp) displaced with a noise generator: the mesh follows a point in steps
+// of the coarsest spacing, so every vertex always lies on a lattice point of the height cache of its level
+// (see TerrainCache.hpp), and only the tiles that become visible need new noise evaluations.
+// write() computes the heights (terrain blended with an animated water surface), the normals and the tangents
+// at the current position, and writes them into a copy of "vertices", in one of two formats:
+// - VertexTan, 48 bytes, read by ModelWithTangents.vert
+// - VertexTerrain, 12 bytes, read by ModelWithTangentsCompact.vert
+// X and Z of the vertices never change, so write() leaves them untouched.
+// The mesh is independent from Vulkan: the application copies "vertices" and "indices" to its buffers.
+
+#include <FastNoise.h>
+
+struct VertexTan {
+	glm::vec3 pos;
+	glm::vec3 norm;
+	glm::vec2 UV;
+	glm::vec4 tan;
+} ;
+
+// The position is quantized to 16 bits per component (see GroundMesh::getQuantization()), its w holds the
+// handedness of the tangent frame. Normal and tangent are octahedral encoded in 8 bits per component, and
+// the UVs are derived from XZ in the shader.
+struct VertexTerrain {
+	int16_t pos[4];		// SNORM: x, y, z, handedness
+	int8_t frame[4];	// SNORM: octahedral normal (xy) and tangent (zw)
+} ;
+
+inline int16_t packSnorm16(float v) {
+	return (int16_t)std::lround(glm::clamp(v, -1.0f, 1.0f) * 32767.0f);
+}
+
+inline int8_t packSnorm8(float v) {
+	return (int8_t)std::lround(glm::clamp(v, -1.0f, 1.0f) * 127.0f);
+}
+
+// Unit vector to the [-1, 1]^2 square: the octahedron |x| + |y| + |z| = 1 unfolded along z
+inline glm::vec2 octEncode(const glm::vec3 &n) {
+	glm::vec3 o = n / (std::abs(n.x) + std::abs(n.y) + std::abs(n.z));
+	glm::vec2 e(o.x, o.y);
+	if(o.z < 0.0f) {
+		e = glm::vec2((1.0f - std::abs(o.y)) * (o.x >= 0.0f ? 1.0f : -1.0f),
+					  (1.0f - std::abs(o.x)) * (o.y >= 0.0f ? 1.0f : -1.0f));
+	}
+	return e;
+}
+
+// Normal and tangent (with its handedness in w) of a VertexTerrain
+inline void packTerrainFrame(VertexTerrain &v, const glm::vec3 &n, const glm::vec4 &t) {
+	glm::vec2 en = octEncode(n), et = octEncode(glm::vec3(t));
+	v.frame[0] = packSnorm8(en.x);
+	v.frame[1] = packSnorm8(en.y);
+	v.frame[2] = packSnorm8(et.x);
+	v.frame[3] = packSnorm8(et.y);
+	v.pos[3] = packSnorm16(t.w);
+}
+
+class GroundMesh {
+	public:
+	// flat mesh, facing up, with the UVs spanning [0, 1] over [-1, 1] in object space:
+	// every vertex buffer region written by write() must start as a copy of it
+	std::vector<unsigned char> vertices;
+	std::vector<uint32_t> indices;
+	ClipmapGrid clipmap;
+
+	// the noise is sampled at world (x, z) * noiseScale and multiplied by heightScale, the mesh is in object
+	// space, with world = object * scaleXZ
+	void init(JobSystem *_jobs, FastNoise *_noise, int _levels, int halfSize, float spacing, float _scaleXZ,
+			  float _noiseScale, float _heightScale, bool _compact);
+	void cleanup();
+
+	bool isCompact() const { return compact; }
+	size_t getStride() const { return compact ? sizeof(VertexTerrain) : sizeof(VertexTan); }
+	size_t getVertexCount() const { return vertexXZ.size(); }
+	// lattice spacing of a level, in world units
+	float getSpacing(int level) const { return heights[level].getSpacing(); }
+	// VertexTerrain: object space size of a unit of XZ and of Y
+	glm::vec4 getQuantization() const { return quantization; }
+
+	// Moves the mesh to the lattice point of the coarsest level nearest to world (x, z), returns its position
+	glm::vec3 follow(float x, float z);
+	// Computes the mesh at the current position and writes heights, normals and tangents in dst.
+	// The water surface is flat at waterFloor (in object space), animated by the noise at time waterTime, and
+	// blended with the terrain over waterBlend. Without normals, the flat ones are restored; gridNormals uses
+	// the central differences of the grid neighbours instead of the average of the triangles around a vertex
+	void write(unsigned char *dst, float waterTime, float waterFloor, float waterBlend,
+			   bool normals, bool gridNormals);
+	// Noise value at world (x, z), interpolated from the cache of level 0
+	float sampleNoise(float x, float z) { return heights[0].sample(x, z); }
+
+	// statistics, cumulative since init() or resetStats()
+	int64_t getNoiseEvaluations() const;
+	void resetStats();
+
+	private:
+	JobSystem *jobs = nullptr;
+	FastNoise *noise = nullptr;
+	int levels = 0;
+	float scaleXZ = 1.0f;
+	float noiseScale = 1.0f;
+	float heightScale = 1.0f;
+	bool compact = false;
+	glm::vec4 quantization = glm::vec4(0.0f);
+	int offX = 0, offZ = 0;		// position of the mesh, in units of the coarsest spacing
+	int64_t waterEvaluations = 0;
+
+	// world-space caches of the noise, one per level
+	std::vector<TerrainHeightCache> heights;
+	// lattice coordinates of each vertex, in units of the spacing of its level, relative to the center of the mesh
+	std::vector<int> latticeX, latticeZ;
+	std::vector<int> vertexLevel;
+	// XZ of each vertex in object space
+	std::vector<glm::vec2> vertexXZ;
+	// grid neighbours of each vertex (-x, +x, -z, +z), the vertex itself on the border
+	std::vector<glm::uvec4> gridNbr;
+	float gridNormalSign = 1.0f;
+	// triangles around each vertex (CSR layout, in index buffer order) and per triangle
+	// normal, tangent and bitangent: the normal pass first computes the faces in parallel,
+	// then every vertex gathers its own faces, so no two threads ever write the same vertex
+	std::vector<uint32_t> vertTriStart, vertTris;
+	std::vector<glm::vec3> faceN, faceT, faceB;
+	// per-vertex scratch buffers, kept to avoid reallocating them every frame
+	std::vector<float> noiseX, noiseZ, noiseT, rawH, waterH, vertexH;
+	std::vector<uint32_t> waterIdx;
+};
+
+#ifdef GROUND_MESH_IMPLEMENTATION
+
+void GroundMesh::init(JobSystem *_jobs, FastNoise *_noise, int _levels, int halfSize, float spacing, float _scaleXZ,
+					  float _noiseScale, float _heightScale, bool _compact) {
+	jobs = _jobs;
+	noise = _noise;
+	scaleXZ = _scaleXZ;
+	noiseScale = _noiseScale;
+	heightScale = _heightScale;
+	compact = _compact;
+	cleanup();
+	resetStats();
+	offX = offZ = 0;
+
+	clipmap.init(_levels, halfSize);
+	levels = clipmap.levels;
+	indices = clipmap.indices;
+	size_t vertexCount = clipmap.vertices.size();
+
+	heights.resize(levels);
+	for(int l = 0; l < levels; l++) {
+		heights[l].init(noise, spacing * (float)(1 << l), noiseScale);
+	}
+	latticeX.resize(vertexCount);
+	latticeZ.resize(vertexCount);
+	vertexLevel.resize(vertexCount);
+	vertexXZ.resize(vertexCount);
+	for(size_t vi = 0; vi < vertexCount; vi++) {
+		const ClipmapVertex &cv = clipmap.vertices[vi];
+		float step = spacing * (float)(1 << cv.level) / scaleXZ;
+		vertexXZ[vi] = glm::vec2(cv.gx * step, cv.gz * step);
+		latticeX[vi] = cv.gx;
+		latticeZ[vi] = cv.gz;
+		vertexLevel[vi] = cv.level;
+	}
+
+	const glm::vec3 up(0.0f, 1.0f, 0.0f);
+	const glm::vec4 tangent(1.0f, 0.0f, 0.0f, 1.0f);
+	if(compact) {
+		// XZ are the lattice coordinates in units of the finest spacing, times the largest integer
+		// that keeps them in 16 bits: vertices shared by two levels get exactly the same values.
+		// Heights are quantized in twice the range of the noise, to leave room to the water
+		int maxLattice = clipmap.halfSize << (levels - 1);
+		int unitsPerStep = 32767 / maxLattice;
+		if(unitsPerStep == 0) {
+			throw std::runtime_error("Clipmap too large for the compact ground vertices");
+		}
+		float step0 = spacing / scaleXZ;
+		quantization = glm::vec4(32767.0f * step0 / (float)unitsPerStep, 2.0f * heightScale, 0.0f, 0.0f);
+		vertices.resize(vertexCount * sizeof(VertexTerrain));
+		VertexTerrain *V = reinterpret_cast<VertexTerrain *>(vertices.data());
+		for(size_t vi = 0; vi < vertexCount; vi++) {
+			const ClipmapVertex &cv = clipmap.vertices[vi];
+			V[vi].pos[0] = (int16_t)(cv.gx * (1 << cv.level) * unitsPerStep);
+			V[vi].pos[1] = 0;
+			V[vi].pos[2] = (int16_t)(cv.gz * (1 << cv.level) * unitsPerStep);
+			packTerrainFrame(V[vi], up, tangent);
+		}
+	} else {
+		vertices.resize(vertexCount * sizeof(VertexTan));
+		VertexTan *V = reinterpret_cast<VertexTan *>(vertices.data());
+		for(size_t vi = 0; vi < vertexCount; vi++) {
+			V[vi].pos = glm::vec3(vertexXZ[vi].x, 0.0f, vertexXZ[vi].y);
+			V[vi].norm = up;
+			V[vi].UV = vertexXZ[vi] * 0.5f + 0.5f;
+			V[vi].tan = tangent;
+		}
+	}
+
+	// grid neighbours of each vertex, on its own level
+	gridNbr = clipmap.neighbours;
+	{
+		// the cross product of the grid directions must agree with the normals of the mesh
+		const glm::uvec4 &nb = gridNbr[0];
+		glm::vec2 ex = vertexXZ[nb.y] - vertexXZ[nb.x];
+		glm::vec2 ez = vertexXZ[nb.w] - vertexXZ[nb.z];
+		glm::vec3 n = glm::cross(glm::vec3(ex.x, 0.0f, ex.y), glm::vec3(ez.x, 0.0f, ez.y));
+		gridNormalSign = (glm::dot(n, up) < 0.0f) ? -1.0f : 1.0f;
+	}
+
+	// triangles sharing each vertex, listed in the same order as in the index buffer
+	vertTriStart.assign(vertexCount + 1, 0);
+	for(uint32_t idx : indices) {
+		vertTriStart[idx + 1]++;
+	}
+	for(size_t vi = 0; vi < vertexCount; vi++) {
+		vertTriStart[vi + 1] += vertTriStart[vi];
+	}
+	vertTris.resize(indices.size());
+	std::vector<uint32_t> fill(vertTriStart.begin(), vertTriStart.end() - 1);
+	for(size_t i = 0; i < indices.size(); i++) {
+		vertTris[fill[indices[i]]++] = (uint32_t)(i / 3);
+	}
+}
+
+void GroundMesh::cleanup() {
+	vertices.clear();
+	indices.clear();
+	clipmap.cleanup();
+	for(auto &cache : heights) cache.cleanup();
+	heights.clear();
+	latticeX.clear();
+	latticeZ.clear();
+	vertexLevel.clear();
+	vertexXZ.clear();
+	gridNbr.clear();
+	vertTriStart.clear();
+	vertTris.clear();
+	faceN.clear();
+	faceT.clear();
+	faceB.clear();
+}
+
+void GroundMesh::resetStats() {
+	for(auto &cache : heights) cache.resetStats();
+	waterEvaluations = 0;
+}
+
+int64_t GroundMesh::getNoiseEvaluations() const {
+	int64_t n = waterEvaluations;
+	for(const auto &cache : heights) {
+		n += (int64_t)cache.tilesFilled * TerrainHeightCache::TILE_SIZE * TerrainHeightCache::TILE_SIZE;
+	}
+	return n;
+}
+
+glm::vec3 GroundMesh::follow(float x, float z) {
+	const float spacing = getSpacing(levels - 1);
+	offX = (int)std::floor(x / spacing + 0.5f);
+	offZ = (int)std::floor(z / spacing + 0.5f);
+	return glm::vec3(offX * spacing, 0.0f, offZ * spacing);
+}
+
+void GroundMesh::write(unsigned char *dst, float waterTime, float waterFloor, float waterBlend,
+					   bool normals, bool gridNormals) {
+	const size_t stride = getStride();
+	// X and Z of the vertices are never written: the region keeps the ones it was initialized with
+	auto storeHeight = [&](size_t vi, float y) {
+		if(compact) {
+			reinterpret_cast<VertexTerrain *>(dst)[vi].pos[1] = packSnorm16(y / quantization.y);
+		} else {
+			reinterpret_cast<VertexTan *>(dst + vi * stride)->pos.y = y;
+		}
+	};
+	auto storeFrame = [&](size_t vi, const glm::vec3 &n, const glm::vec4 &t) {
+		if(compact) {
+			packTerrainFrame(reinterpret_cast<VertexTerrain *>(dst)[vi], n, t);
+		} else {
+			reinterpret_cast<VertexTan *>(dst + vi * stride)->norm = n;
+			reinterpret_cast<VertexTan *>(dst + vi * stride)->tan = t;
+		}
+	};
+
+	size_t vertexCount = vertexXZ.size();
+	rawH.resize(vertexCount);
+	// offset of the mesh and lattice spacing of each level
+	int levelOffX[32], levelOffZ[32];
+	float levelSpacing[32];
+	for(int l = 0; l < levels; l++) {
+		levelOffX[l] = offX * (1 << (levels - 1 - l));
+		levelOffZ[l] = offZ * (1 << (levels - 1 - l));
+		levelSpacing[l] = heights[l].getSpacing();
+		uint32_t first = clipmap.levelStart[l];
+		uint32_t count = clipmap.levelStart[l + 1] - first;
+		heights[l].gather(&latticeX[first], &latticeZ[first], (int)count,
+						  levelOffX[l], levelOffZ[l], &rawH[first]);
+	}
+
+	// The water animation is the only part that changes every frame, and it is needed only
+	// by the vertices inside (or blending into) the water.
+	// Each chunk of vertices compacts its water vertices in its own range of the scratch arrays
+	const size_t vertexGrain = jobs->getGrain(vertexCount);
+	waterIdx.resize(vertexCount);
+	noiseX.resize(vertexCount);
+	noiseZ.resize(vertexCount);
+	noiseT.resize(vertexCount);
+	waterH.resize(vertexCount);
+	vertexH.resize(vertexCount);
+	std::atomic<int64_t> waterCountTotal(0);
+	jobs->parallelFor(vertexCount, vertexGrain, [&](size_t begin, size_t end) {
+		int waterCount = 0;
+		for(size_t vi = begin; vi < end; vi++) {
+			// dry land: the height is the cached sample
+			vertexH[vi] = rawH[vi] * heightScale;
+
+			if(vertexH[vi] < waterFloor + waterBlend) {
+				size_t wi = begin + waterCount;
+				waterIdx[wi] = (uint32_t)vi;
+				int l = vertexLevel[vi];
+				noiseX[wi] = (latticeX[vi] + levelOffX[l]) * levelSpacing[l] * noiseScale;
+				noiseZ[wi] = (latticeZ[vi] + levelOffZ[l]) * levelSpacing[l] * noiseScale;
+				noiseT[wi] = waterTime;
+				waterCount++;
+			}
+		}
+		noise->GetNoiseSet(&noiseX[begin], &noiseZ[begin], &noiseT[begin], &waterH[begin], waterCount);
+		waterCountTotal += waterCount;
+
+		// water: blend between the terrain and the animated water surface
+		for(size_t wi = begin; wi < begin + waterCount; wi++) {
+			size_t vi = waterIdx[wi];
+			float terrainH = vertexH[vi];
+
+			// blend factor t that goes 0 to 1 as the terrain goes from (waterFloor - waterBlend) up to (waterFloor + waterBlend)
+			float t = glm::smoothstep(waterFloor - waterBlend, waterFloor + waterBlend, terrainH);
+			// small animation of water level
+			float flatH = waterFloor - std::abs(waterH[wi] * 0.001f);
+			vertexH[vi] = glm::mix(flatH, terrainH, t);
+		}
+
+		// write back, the region is only written, never read
+		for(size_t vi = begin; vi < end; vi++) {
+			storeHeight(vi, vertexH[vi]);
+		}
+	});
+	waterEvaluations += waterCountTotal;
+
+	// close the cracks between the levels of the clipmap
+	for(const glm::uvec3 &st : clipmap.stitches) {
+		vertexH[st.x] = 0.5f * (vertexH[st.y] + vertexH[st.z]);
+		storeHeight(st.x, vertexH[st.x]);
+	}
+
+	// positions of the vertices, as they have just been written in the region
+	auto position = [&](uint32_t vi) {
+		return glm::vec3(vertexXZ[vi].x, vertexH[vi], vertexXZ[vi].y);
+	};
+	auto uv = [&](uint32_t vi) {
+		return vertexXZ[vi] * 0.5f + 0.5f;
+	};
+
+	if(normals && gridNormals) {
+		// The ground is a regular grid: the normal and the tangent frame of a vertex come from the
+		// central differences of the positions (and UVs) of its four neighbours
+		jobs->parallelFor(vertexCount, vertexGrain, [&](size_t begin, size_t end) {
+			for(size_t vi = begin; vi < end; vi++) {
+				const glm::uvec4 &nb = gridNbr[vi];
+
+				glm::vec3 PL = position(nb.x), PR = position(nb.y), PD = position(nb.z), PU = position(nb.w);
+				glm::vec2 UVL = uv(nb.x), UVR = uv(nb.y), UVD = uv(nb.z), UVU = uv(nb.w);
+
+				glm::vec3 ex = PR - PL;
+				glm::vec3 ez = PU - PD;
+				glm::vec3 n = glm::normalize(glm::cross(ex, ez)) * gridNormalSign;
+
+				// tangent & bitangent, as for a triangle with edges ex and ez
+				glm::vec2 dUVx = UVR - UVL;
+				glm::vec2 dUVz = UVU - UVD;
+				float r = 1.0f / (dUVx.x * dUVz.y - dUVz.x * dUVx.y);
+				glm::vec3 tangent = (ex * dUVz.y - ez * dUVx.y) * r;
+				glm::vec3 bitan   = (ez * dUVx.x - ex * dUVz.x) * r;
+
+				// Gram-Schmidt tangent
+				glm::vec3 t = glm::normalize(tangent - n * glm::dot(n, tangent));
+
+				// handedness
+				float h = (glm::dot(glm::cross(n, t), bitan) < 0.0f) ? -1.0f : +1.0f;
+
+				storeFrame(vi, n, glm::vec4(t, h));
+			}
+		});
+	} else if(normals) {
+		size_t triangleCount = indices.size() / 3;
+		const size_t triangleGrain = jobs->getGrain(triangleCount);
+		faceN.resize(triangleCount);
+		faceT.resize(triangleCount);
+		faceB.resize(triangleCount);
+
+		// Per triangle normals & tangents
+		jobs->parallelFor(triangleCount, triangleGrain, [&](size_t begin, size_t end) {
+			for(size_t f = begin; f < end; f++) {
+				uint32_t i0 = indices[3 * f + 0];
+				uint32_t i1 = indices[3 * f + 1];
+				uint32_t i2 = indices[3 * f + 2];
+
+				glm::vec3 P0 = position(i0), P1 = position(i1), P2 = position(i2);
+				glm::vec2 UV0 = uv(i0), UV1 = uv(i1), UV2 = uv(i2);
+
+				// face normal
+				glm::vec3 edge1 = P1 - P0;
+				glm::vec3 edge2 = P2 - P0;
+				faceN[f] = glm::normalize(glm::cross(edge1, edge2));
+
+				// tangent & bitangent
+				glm::vec2 dUV1 = UV1 - UV0;
+				glm::vec2 dUV2 = UV2 - UV0;
+				float r = 1.0f / (dUV1.x * dUV2.y - dUV2.x * dUV1.y);
+				faceT[f] = (edge1 * dUV2.y - edge2 * dUV1.y) * r;
+				faceB[f] = (edge2 * dUV1.x - edge1 * dUV2.x) * r;
+			}
+		});
+
+		// Per vertex: accumulate the faces around it, orthonormalize and write back into the region
+		jobs->parallelFor(vertexCount, vertexGrain, [&](size_t begin, size_t end) {
+			for(size_t vi = begin; vi < end; vi++) {
+				glm::vec3 nAccum(0.0f), tAccum(0.0f), bAccum(0.0f);
+				for(uint32_t k = vertTriStart[vi]; k < vertTriStart[vi + 1]; k++) {
+					uint32_t f = vertTris[k];
+					nAccum += faceN[f];
+					tAccum += faceT[f];
+					bAccum += faceB[f];
+				}
+
+				glm::vec3 n = glm::normalize(nAccum);
+				// Gram-Schmidt tangent
+				glm::vec3 t = glm::normalize(tAccum - n * glm::dot(n, tAccum));
+				// handedness
+				float h = (glm::dot(glm::cross(n, t), bAccum) < 0.0f) ? -1.0f : +1.0f;
+
+				storeFrame(vi, n, glm::vec4(t, h));
+			}
+		});
+	} else {
+		// the region may still hold the normals computed in a previous frame: restore the flat ones
+		jobs->parallelFor(vertexCount, vertexGrain, [&](size_t begin, size_t end) {
+			for(size_t vi = begin; vi < end; vi++) {
+				storeFrame(vi, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec4(1.0f, 0.0f, 0.0f, 1.0f));
+			}
+		});
+	}
+}
+
+#endif
@@ -0,0 +1,127 @@
+// Window of ground heights centered on a moving point, stored in a toroidal ring buffer.
+// Lattice point (gx, gz), at world (gx * cellSize, gz * cellSize), is stored at
+// samples[(gz mod rows) * cols + (gx mod cols)], so when the window scrolls only the rows and
+// columns that enter it have to be computed.
+// Heights are noise->GetNoise(x * noiseScale, z * noiseScale) * heightScale * scale
+
+#include <FastNoise.h>
+
+class HeightfieldRing {
+	public:
+	// statistics, cumulative since init() or resetStats()
+	int64_t samplesFilled = 0;
+
+	void init(FastNoise *_noise, int _cols, int _rows, float _cellSize, float _noiseScale, float _heightScale);
+	void cleanup();
+	void resetStats() { samplesFilled = 0; }
+
+	// Centers the window on world (worldX, worldZ), snapped to whole cells.
+	// Returns true if the whole window has been sampled again (the first time, or when scale changes)
+	bool recenter(float worldX, float worldZ, float scale);
+
+	// Height of lattice point (gx, gz), it must be inside the window
+	float at(int gx, int gz) const {
+		return samples[wrapIndex(gz, rows) * cols + wrapIndex(gx, cols)];
+	}
+	// lattice coordinates of the first sample of the window
+	int getOriginX() const { return originX; }
+	int getOriginZ() const { return originZ; }
+	float getScale() const { return scale; }
+
+	private:
+	FastNoise *noise = nullptr;
+	int cols = 0, rows = 0;
+	float cellSize = 1.0f;
+	float noiseScale = 1.0f;
+	float heightScale = 1.0f;
+
+	std::vector<float> samples;
+	int originX = 0, originZ = 0;
+	float scale = 0.0f;
+	bool valid = false;
+
+	static int wrapIndex(int i, int n) {
+		int r = i % n;
+		return (r < 0) ? r + n : r;
+	}
+	void fill(int gx0, int gz0, int w, int h);
+};
+
+#ifdef HEIGHTFIELD_RING_IMPLEMENTATION
+
+void HeightfieldRing::init(FastNoise *_noise, int _cols, int _rows, float _cellSize, float _noiseScale, float _heightScale) {
+	noise = _noise;
+	cols = _cols;
+	rows = _rows;
+	cellSize = _cellSize;
+	noiseScale = _noiseScale;
+	heightScale = _heightScale;
+	samples.assign(cols * rows, 0.0f);
+	originX = originZ = 0;
+	scale = 0.0f;
+	valid = false;
+	resetStats();
+}
+
+void HeightfieldRing::cleanup() {
+	samples.clear();
+	valid = false;
+}
+
+// Computes the samples of the lattice rectangle [gx0, gx0 + w) x [gz0, gz0 + h)
+void HeightfieldRing::fill(int gx0, int gz0, int w, int h) {
+	for(int gz = gz0; gz < gz0 + h; gz++) {
+		float *row = &samples[wrapIndex(gz, rows) * cols];
+		// a row that wraps around the end of the ring is filled in two segments
+		int gx = gx0;
+		int remaining = w;
+		while(remaining > 0) {
+			int px = wrapIndex(gx, cols);
+			int n = std::min(remaining, cols - px);
+			noise->FillNoiseGrid(row + px, n, 1,
+								 gx * cellSize * noiseScale, gz * cellSize * noiseScale,
+								 cellSize * noiseScale, cellSize * noiseScale);
+			for(int i = 0; i < n; i++) {
+				row[px + i] *= heightScale * scale;
+			}
+			gx += n;
+			remaining -= n;
+		}
+	}
+	samplesFilled += (int64_t)w * h;
+}
+
+bool HeightfieldRing::recenter(float worldX, float worldZ, float _scale) {
+	int newOriginX = (int)std::floor(worldX / cellSize + 0.5f) - cols / 2;
+	int newOriginZ = (int)std::floor(worldZ / cellSize + 0.5f) - rows / 2;
+	int dx = newOriginX - originX;
+	int dz = newOriginZ - originZ;
+	bool full = !valid || _scale != scale || std::abs(dx) >= cols || std::abs(dz) >= rows;
+
+	if(full) {
+		// nothing can be reused: sample the whole window
+		scale = _scale;
+		fill(newOriginX, newOriginZ, cols, rows);
+		valid = true;
+	} else {
+		// columns entering the window, over all its rows
+		if(dx > 0) {
+			fill(originX + cols, newOriginZ, dx, rows);
+		} else if(dx < 0) {
+			fill(newOriginX, newOriginZ, -dx, rows);
+		}
+		// rows entering the window, over the columns kept from the previous one
+		int keptX0 = std::max(originX, newOriginX);
+		int keptX1 = std::min(originX, newOriginX) + cols;
+		if(dz > 0) {
+			fill(keptX0, originZ + rows, keptX1 - keptX0, dz);
+		} else if(dz < 0) {
+			fill(keptX0, newOriginZ, keptX1 - keptX0, -dz);
+		}
+	}
+	originX = newOriginX;
+	originZ = newOriginZ;
+	return full;
+}
+
+#endif
@@ -0,0 +1,310 @@
+// Impostors: pictures of models taken from a ring of directions around their vertical axis, baked at load
+// time into two atlases with one row per model and one column per direction:
+// - albedo: the color of the model in rgb, its coverage in alpha
+// - normal: the object space normal in rgb (remapped to [0, 1]), the roughness in alpha
+// The view of column k is an orthographic projection of the bounding sphere of the model, looking at its
+// center horizontally from azimuth 2 * pi * k / views: column 0 looks from +z towards -z.
+// The models are drawn by ImpostorBake.vert and ImpostorBake.frag with the two textures used by
+// CookTorrance.frag (albedo and detail). The billboards made by makeBillboard() are quads as large as the
+// bounding spheres, that ImpostorInstanced.vert turns toward the camera, showing the closest view.
+
+struct ImpostorSource {
+	Model *M;
+	VkDescriptorImageInfo albedo;
+	VkDescriptorImageInfo detail;
+} ;
+
+class ImpostorAtlas {
+	public:
+	// directions around the vertical axis: it must be the VIEWS constant of ImpostorInstanced.vert
+	static const int views = 8;
+
+	// _cellSize is the side in pixels of a view, reduced if the atlas would not fit a framebuffer
+	void init(BaseProject *_BP, int _cellSize, std::vector<ImpostorSource> _sources);
+	// Renders all the views, and stores them in two new textures: their mipmaps stop at 8 x 8 pixels
+	// per view, so that a view never blends with the ones around it
+	void bake(Texture *albedo, Texture *normal);
+	// Quad of the billboard of source row, in vertex format VD: the position is the center of the bounding
+	// sphere plus the offset of the corner in the picture, the normal the center, and UV the coordinates of
+	// the corner in the first view. Its bounding sphere is the one of the source
+	void makeBillboard(int row, VertexDescriptor *VD, Model *B);
+	int getCellSize() const { return cellSize; }
+	int getRows() const { return (int)sources.size(); }
+
+	private:
+	BaseProject *BP = nullptr;
+	int cellSize = 0;
+	std::vector<ImpostorSource> sources;
+
+	glm::mat4 viewMatrix(int row, int view);
+	void makeTexture(Texture *Tx, VkFormat format, VkImage image);
+};
+
+#ifdef IMPOSTORS_IMPLEMENTATION
+
+void ImpostorAtlas::init(BaseProject *_BP, int _cellSize, std::vector<ImpostorSource> _sources) {
+	BP = _BP;
+	sources = _sources;
+	cellSize = _cellSize;
+	for(int i = 0; i < sources.size(); i++) {
+		if(sources[i].M->boundsRadius < 0.0f) {
+			std::cout << "Impostor Error: model " << i << " has no bounds\n";
+			exit(0);
+		}
+		if(sources[i].M->VD != sources[0].M->VD) {
+			std::cout << "Impostor Error: all the models must have the same vertex format\n";
+			exit(0);
+		}
+	}
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	while((cellSize > 16) && ((views * cellSize > properties.limits.maxFramebufferWidth) ||
+							  (getRows() * cellSize > properties.limits.maxFramebufferHeight))) {
+		cellSize /= 2;
+	}
+	if(cellSize != _cellSize) {
+		std::cout << "Impostor views reduced to " << cellSize << " pixels, to fit the framebuffer\n";
+	}
+}
+
+// Maps the bounding sphere of source row, seen from view, to the rectangle of the atlas of that view:
+// x to the right of the view, y up (the top of the atlas is at y = -1), and depth from the camera
+glm::mat4 ImpostorAtlas::viewMatrix(int row, int view) {
+	Model *Md = sources[row].M;
+	glm::vec3 c = Md->boundsCenter;
+	float r = Md->boundsRadius;
+	float a = glm::two_pi<float>() * view / views;
+	glm::vec3 D = glm::vec3(std::sin(a), 0.0f, std::cos(a));	// from the center to the camera
+	glm::vec3 R = glm::vec3(D.z, 0.0f, -D.x);
+	float sx = 1.0f / (r * views);
+	float sy = 1.0f / (r * getRows());
+	float cx = -1.0f + (2 * view + 1) / (float)views;
+	float cy = -1.0f + (2 * row + 1) / (float)getRows();
+
+	glm::mat4 Mt = glm::mat4(0.0f);
+	Mt[0][0] = sx * R.x;
+	Mt[2][0] = sx * R.z;
+	Mt[3][0] = cx - sx * glm::dot(c, R);
+	Mt[1][1] = -sy;
+	Mt[3][1] = cy + sy * c.y;
+	Mt[0][2] = -D.x / (2.0f * r);
+	Mt[2][2] = -D.z / (2.0f * r);
+	Mt[3][2] = 0.5f + glm::dot(c, D) / (2.0f * r);
+	Mt[3][3] = 1.0f;
+	return Mt;
+}
+
+void ImpostorAtlas::bake(Texture *albedo, Texture *normal) {
+	auto start = std::chrono::high_resolution_clock::now();
+	// the meshes of the trees may still be in the staging ring
+	BP->stagingRing.flush();
+	int width = views * cellSize;
+	int height = getRows() * cellSize;
+
+	// the albedo keeps the precision of the sRGB textures it comes from. The atlases are copied
+	// to the textures after the pass, so they end in the layout of the copy
+	std::vector<AttachmentProperties> props = {
+		{COLOR_AT, VK_FORMAT_R8G8B8A8_SRGB,
+			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+			VK_IMAGE_ASPECT_COLOR_BIT, false, false,
+			{.color = {.float32 = {0.0f, 0.0f, 0.0f, 0.0f}}},
+			VK_SAMPLE_COUNT_1_BIT,
+			VK_ATTACHMENT_LOAD_OP_CLEAR,
+			VK_ATTACHMENT_STORE_OP_STORE,
+			VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+			VK_ATTACHMENT_STORE_OP_DONT_CARE,
+			VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+		{COLOR_AT, VK_FORMAT_R8G8B8A8_UNORM,
+			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+			VK_IMAGE_ASPECT_COLOR_BIT, false, false,
+			{.color = {.float32 = {0.5f, 0.5f, 1.0f, 1.0f}}},
+			VK_SAMPLE_COUNT_1_BIT,
+			VK_ATTACHMENT_LOAD_OP_CLEAR,
+			VK_ATTACHMENT_STORE_OP_STORE,
+			VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+			VK_ATTACHMENT_STORE_OP_DONT_CARE,
+			VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+		{DEPTH_AT, BP->findDepthFormat(),
+			VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+			VK_IMAGE_ASPECT_DEPTH_BIT, false, false,
+			{.depthStencil = {1.0f, 0}},
+			VK_SAMPLE_COUNT_1_BIT,
+			VK_ATTACHMENT_LOAD_OP_CLEAR,
+			VK_ATTACHMENT_STORE_OP_DONT_CARE,
+			VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+			VK_ATTACHMENT_STORE_OP_DONT_CARE,
+			VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+			VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL}
+	};
+	std::vector<VkSubpassDependency> deps = {
+		{
+			0,
+			VK_SUBPASS_EXTERNAL,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+			VK_ACCESS_TRANSFER_READ_BIT,
+			0
+		}
+	};
+	RenderPass RP;
+	RP.init(BP, width, height, 1, &props, &deps);
+	RP.create();
+
+	DescriptorSetLayout DSL;
+	DSL.init(BP, {
+				 {0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 0, 1},
+				 {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1, 1}
+			 });
+	Pipeline P;
+	P.init(BP, sources[0].M->VD, "shaders/ImpostorBake.vert.spv", "shaders/ImpostorBake.frag.spv",
+		   {&DSL}, {{VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(glm::mat4)}});
+	// leaves can be single sided
+	P.setCullMode(VK_CULL_MODE_NONE);
+	P.create(&RP);
+
+	// the descriptor pool of the application is created after the scene is loaded: the bake has its own
+	int n = getRows();
+	VkDescriptorPoolSize poolSize{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, static_cast<uint32_t>(2 * n)};
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = 1;
+	poolInfo.pPoolSizes = &poolSize;
+	poolInfo.maxSets = static_cast<uint32_t>(n);
+	VkDescriptorPool pool;
+	VkResult result = vkCreateDescriptorPool(BP->device, &poolInfo, nullptr, &pool);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create impostor descriptor pool!");
+	}
+	std::vector<VkDescriptorSetLayout> layouts(n, DSL.descriptorSetLayout);
+	std::vector<VkDescriptorSet> sets(n);
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = pool;
+	allocInfo.descriptorSetCount = static_cast<uint32_t>(n);
+	allocInfo.pSetLayouts = layouts.data();
+	result = vkAllocateDescriptorSets(BP->device, &allocInfo, sets.data());
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate impostor descriptor sets!");
+	}
+	for(int i = 0; i < n; i++) {
+		VkDescriptorImageInfo imageInfo[2] = {sources[i].albedo, sources[i].detail};
+		VkWriteDescriptorSet write{};
+		write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write.dstSet = sets[i];
+		write.dstBinding = 0;
+		write.dstArrayElement = 0;
+		write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		write.descriptorCount = 1;
+		write.pImageInfo = &imageInfo[0];
+		VkWriteDescriptorSet writes[2] = {write, write};
+		writes[1].dstBinding = 1;
+		writes[1].pImageInfo = &imageInfo[1];
+		vkUpdateDescriptorSets(BP->device, 2, writes, 0, nullptr);
+	}
+
+	// every view has its own rectangle in the atlas, so they are all drawn in the same pass
+	VkCommandBuffer commandBuffer = BP->beginSingleTimeCommands();
+	RP.begin(commandBuffer, 0);
+	P.bind(commandBuffer);
+	for(int i = 0; i < n; i++) {
+		Model *Md = sources[i].M;
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, P.pipelineLayout,
+								0, 1, &sets[i], 0, nullptr);
+		Md->bind(commandBuffer);
+		for(int v = 0; v < views; v++) {
+			glm::mat4 Mt = viewMatrix(i, v);
+			vkCmdPushConstants(commandBuffer, P.pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT,
+							   0, sizeof(glm::mat4), &Mt);
+			vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(Md->indices.size()), 1,
+							 Md->firstIndex, Md->vertexOffset, 0);
+		}
+	}
+	RP.end(commandBuffer);
+	BP->endSingleTimeCommands(commandBuffer);
+
+	makeTexture(albedo, VK_FORMAT_R8G8B8A8_SRGB, RP.attachments[0].image);
+	makeTexture(normal, VK_FORMAT_R8G8B8A8_UNORM, RP.attachments[1].image);
+
+	vkDestroyDescriptorPool(BP->device, pool, nullptr);
+	P.cleanup();
+	P.destroy();
+	DSL.cleanup();
+	RP.cleanup();
+	RP.destroy();
+
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << "Impostors: " << n << " models, " << views << " views, atlas " << width << "x" << height
+			  << " baked in " << std::chrono::duration<float, std::milli>(end - start).count() << " ms\n";
+}
+
+// Copies image, in TRANSFER_SRC_OPTIMAL layout, to the first level of a new texture, and fills its mipmaps
+void ImpostorAtlas::makeTexture(Texture *Tx, VkFormat format, VkImage image) {
+	int width = views * cellSize;
+	int height = getRows() * cellSize;
+	Tx->BP = BP;
+	Tx->imgs = 1;
+	Tx->mipLevels = std::max(1, (int)std::floor(std::log2(cellSize)) - 2);
+	BP->createImage(width, height, Tx->mipLevels, 1, VK_SAMPLE_COUNT_1_BIT, format,
+					VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+					VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 0,
+					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, Tx->textureImage, Tx->textureImageMemory);
+	BP->transitionImageLayout(Tx->textureImage, format, VK_IMAGE_LAYOUT_UNDEFINED,
+							  VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, Tx->mipLevels, 1);
+
+	VkCommandBuffer commandBuffer = BP->beginSingleTimeCommands();
+	VkImageCopy region{};
+	region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.srcSubresource.mipLevel = 0;
+	region.srcSubresource.baseArrayLayer = 0;
+	region.srcSubresource.layerCount = 1;
+	region.srcOffset = {0, 0, 0};
+	region.dstSubresource = region.srcSubresource;
+	region.dstOffset = {0, 0, 0};
+	region.extent = {(uint32_t)width, (uint32_t)height, 1};
+	vkCmdCopyImage(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				   Tx->textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+	BP->endSingleTimeCommands(commandBuffer);
+
+	BP->generateMipmaps(Tx->textureImage, format, width, height, Tx->mipLevels, 1);
+	Tx->createTextureImageView(format);
+	Tx->createTextureSampler(VK_FILTER_LINEAR, VK_FILTER_LINEAR,
+							 VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+}
+
+void ImpostorAtlas::makeBillboard(int row, VertexDescriptor *VD, Model *B) {
+	if(!VD->Position.hasIt || !VD->Normal.hasIt || !VD->UV.hasIt) {
+		std::cout << "Impostor Error: billboards need a vertex format with position, normal and UV\n";
+		exit(0);
+	}
+	Model *Md = sources[row].M;
+	glm::vec3 c = Md->boundsCenter;
+	float r = Md->boundsRadius;
+	int stride = VD->Bindings[0].stride;
+
+	// corners in counterclockwise order, seen from the camera
+	const float corners[4][2] = {{-1.0f, -1.0f}, {1.0f, -1.0f}, {1.0f, 1.0f}, {-1.0f, 1.0f}};
+	B->vertices.assign(4 * stride, 0);
+	for(int i = 0; i < 4; i++) {
+		glm::vec3 pos = c + glm::vec3(corners[i][0] * r, corners[i][1] * r, 0.0f);
+		glm::vec2 uv = glm::vec2((corners[i][0] + 1.0f) * 0.5f,
+								 (row + (1.0f - corners[i][1]) * 0.5f) / getRows());
+		memcpy(&B->vertices[i * stride + VD->Position.offset], &pos, sizeof(glm::vec3));
+		memcpy(&B->vertices[i * stride + VD->Normal.offset], &c, sizeof(glm::vec3));
+		memcpy(&B->vertices[i * stride + VD->UV.offset], &uv, sizeof(glm::vec2));
+	}
+	B->indices = {0, 1, 2, 2, 3, 0};
+	B->initMesh(BP, VD, false);
+	B->boundsCenter = c;
+	B->boundsRadius = r;
+}
+
+#endif
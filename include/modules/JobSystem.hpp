@@ -0,0 +1,231 @@
+// Small work-stealing job system.
+// Every worker thread owns a queue of jobs: it pops its own jobs from the back and, when its
+// queue is empty, steals from the front of the other queues. The thread that submits a batch
+// of jobs (usually the render thread) does not sleep while waiting: it steals and runs jobs too,
+// so a job system with a single thread runs everything in the caller, without any worker.
+// An exception thrown by a job is caught on the thread that ran it, and the first one of a batch is
+// rethrown by parallelFor() once all the jobs of the batch have completed.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Jobs of a parallelFor() call, on the stack of the caller: it must not return while pending > 0
+struct JobBatch {
+	std::atomic<int> pending;		// jobs not yet completed
+	std::atomic<bool> failed{false};
+	std::exception_ptr error;		// first exception thrown by a job, written once by the thread that set failed
+} ;
+
+// The callable of parallelFor() is not copied: invoke() calls it through a pointer to the caller's object,
+// so submitting a batch never allocates
+struct Job {
+	void (*invoke)(const void *fn, size_t begin, size_t end);
+	const void *fn;
+	size_t begin, end;
+	JobBatch *batch;
+} ;
+
+// Double ended queue on a ring buffer: it grows only when it is full, so once it has reached
+// the size of the largest batch pushing and popping jobs does not touch the heap
+struct JobQueue {
+	std::mutex mutex;
+	std::vector<Job> ring;
+	size_t head = 0;
+	size_t count = 0;
+
+	void pushBack(const Job &job);
+	Job popBack();
+	Job popFront();
+} ;
+
+class JobSystem {
+	public:
+	// threadCount = 0 uses one thread per hardware thread, the calling thread counts as one of them
+	void init(int threadCount = 0);
+	void cleanup();
+
+	int getThreadCount() const { return (int)workers.size() + 1; }
+	// Index of the calling thread in [0, getThreadCount()): 0 for the thread that submits the jobs,
+	// 1 + i for worker i. Lets a job pick per thread resources without locking
+	static int getThreadIndex() { return threadIndex; }
+	// Grain that splits count elements in about four chunks per thread, so that stealing can
+	// even out their costs, but never in chunks smaller than minGrain
+	size_t getGrain(size_t count, size_t minGrain = 256) const {
+		return std::max(minGrain, count / (getThreadCount() * 4));
+	}
+
+	// Splits [0, count) in chunks of at most grain elements and calls fn(begin, end) on each of them,
+	// in parallel. Returns when all the chunks have been processed, rethrowing the first exception of fn, if any.
+	template <class F>
+	void parallelFor(size_t count, size_t grain, const F &fn) {
+		run(count, grain, &fn, [](const void *f, size_t begin, size_t end) { (*(const F *)f)(begin, end); });
+	}
+
+	private:
+	std::vector<std::thread> workers;
+	std::vector<JobQueue *> queues;		// one per worker
+	std::atomic<int> queuedJobs{0};
+	std::atomic<bool> quit{false};
+	std::mutex sleepMutex;
+	std::condition_variable wakeUp;
+	std::atomic<unsigned> nextQueue{0};	// any thread can submit jobs
+	static thread_local int threadIndex;
+
+	void run(size_t count, size_t grain, const void *fn, void (*invoke)(const void *fn, size_t begin, size_t end));
+	void workerLoop(int index);
+	bool popJob(int first, bool own, Job &job);
+	static void runJob(const Job &job);
+};
+
+#ifdef JOB_SYSTEM_IMPLEMENTATION
+
+thread_local int JobSystem::threadIndex = 0;
+
+void JobQueue::pushBack(const Job &job) {
+	if(count == ring.size()) {
+		// unrolls the ring in the new storage, starting from head
+		std::vector<Job> grown(std::max<size_t>(16, 2 * ring.size()));
+		for(size_t i = 0; i < count; i++) {
+			grown[i] = ring[(head + i) % ring.size()];
+		}
+		ring.swap(grown);
+		head = 0;
+	}
+	ring[(head + count) % ring.size()] = job;
+	count++;
+}
+
+Job JobQueue::popBack() {
+	count--;
+	return ring[(head + count) % ring.size()];
+}
+
+Job JobQueue::popFront() {
+	Job job = ring[head];
+	head = (head + 1) % ring.size();
+	count--;
+	return job;
+}
+
+void JobSystem::init(int threadCount) {
+	cleanup();
+	if(threadCount <= 0) {
+		threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+	}
+	quit = false;
+	queuedJobs = 0;
+	nextQueue = 0;
+	for(int i = 1; i < threadCount; i++) {
+		queues.push_back(new JobQueue());
+	}
+	for(int i = 0; i < (int)queues.size(); i++) {
+		workers.emplace_back(&JobSystem::workerLoop, this, i);
+	}
+	std::cout << "Job system: " << getThreadCount() << " threads\n";
+}
+
+void JobSystem::cleanup() {
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		quit = true;
+	}
+	wakeUp.notify_all();
+	for(auto &w : workers) {
+		w.join();
+	}
+	workers.clear();
+	for(auto q : queues) {
+		delete q;
+	}
+	queues.clear();
+}
+
+// The exception of a job must not leave the thread: on a worker it would terminate the program,
+// on the submitting thread it would unwind the batch while other threads still use it
+void JobSystem::runJob(const Job &job) {
+	try {
+		job.invoke(job.fn, job.begin, job.end);
+	} catch(...) {
+		if(!job.batch->failed.exchange(true, std::memory_order_relaxed)) {
+			job.batch->error = std::current_exception();
+		}
+	}
+	// releases the error together with the completion of the job
+	job.batch->pending.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+// Looks for a job starting from queue "first": the owner of a queue takes the most recently
+// pushed job, the others steal the oldest one
+bool JobSystem::popJob(int first, bool own, Job &job) {
+	int n = (int)queues.size();
+	for(int k = 0; k < n; k++) {
+		JobQueue *q = queues[(first + k) % n];
+		std::lock_guard<std::mutex> lock(q->mutex);
+		if(q->count == 0) continue;
+		job = (own && k == 0) ? q->popBack() : q->popFront();
+		queuedJobs--;
+		return true;
+	}
+	return false;
+}
+
+void JobSystem::workerLoop(int index) {
+	threadIndex = index + 1;
+	Job job;
+	while(true) {
+		if(popJob(index, true, job)) {
+			runJob(job);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		wakeUp.wait(lock, [this] { return quit || queuedJobs > 0; });
+		if(quit) return;
+	}
+}
+
+void JobSystem::run(size_t count, size_t grain, const void *fn, void (*invoke)(const void *fn, size_t begin, size_t end)) {
+	if(count == 0) return;
+	grain = std::max<size_t>(grain, 1);
+	size_t chunks = (count + grain - 1) / grain;
+	if(workers.empty() || chunks == 1) {
+		invoke(fn, 0, count);
+		return;
+	}
+
+	JobBatch batch;
+	batch.pending = (int)chunks;
+	// chunks are dealt round robin, so every worker starts on its own queue
+	for(size_t c = 0; c < chunks; c++) {
+		Job job = { invoke, fn, c * grain, std::min(count, (c + 1) * grain), &batch };
+		JobQueue *q = queues[nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size()];
+		std::lock_guard<std::mutex> lock(q->mutex);
+		q->pushBack(job);
+		queuedJobs++;
+	}
+	{
+		// taking the lock makes sure no worker misses the notification between its check and its wait
+		std::lock_guard<std::mutex> lock(sleepMutex);
+	}
+	wakeUp.notify_all();
+
+	// the calling thread helps until the whole batch is done
+	Job job;
+	while(batch.pending.load(std::memory_order_acquire) > 0) {
+		if(popJob(0, false, job)) {
+			runJob(job);
+		} else {
+			std::this_thread::yield();
+		}
+	}
+	if(batch.error) {
+		std::rethrow_exception(batch.error);
+	}
+}
+
+#endif
@@ -1,3 +1,8 @@
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCENE_CULL_SSE
+#include <emmintrin.h>
+#endif
+
 struct TechniqueInstances;
 
 struct Instance {
@@ -12,6 +17,112 @@ struct Instance {
 	
 	glm::mat4 Wm;
 	TechniqueInstances *TIp;
+	
+	// frustum culling: position in the sphere arrays of the Scene (-1 if not culled),
+	// the Wm the world sphere has been computed from, and the result of the last test
+	int cullId;
+	glm::mat4 boundsWm;
+	bool visible;
+	// instances that are not enabled are never drawn: cull() computes visible from it
+	bool enabled;
+
+	// level of detail: beyond lodDistance from the camera the instance is replaced by farLod, set by the
+	// "lodOf" field of the far one in the scene file. inRange is false while the other one is drawn
+	Instance *farLod;
+	float lodDistance;
+	bool inRange;
+
+	// instances of the same technique using the same textures have the same texSetId
+	int texSetId;
+} ;
+
+// Per instance data read by the vertex shaders of the instanced techniques,
+// through a vertex binding advanced once per instance
+struct InstanceTransform {
+	glm::mat4 mMat;
+	glm::mat4 nMat;
+} ;
+
+// GPU driven drawing (see initGpuCulling()): an instance as read by the culling compute shader.
+// The layout matches the std430 struct of shaders/CullInstances.comp
+struct GpuInstance {
+	glm::mat4 mMat;
+	uint32_t batch;		// in the batches of all the GPU driven techniques
+	uint32_t farBatch;	// where the instance goes beyond lodDistance, noFarBatch if it has no far level
+	float lodDistance2;
+	uint32_t enabled;
+} ;
+
+struct GpuBatch {
+	glm::vec4 sphere;	// bounding sphere of the model in object space, negative radius if never culled
+	uint32_t first;		// first slot of the batch in the output instance buffer
+	uint32_t pad[3];
+} ;
+
+// push constants of the culling compute shader
+struct GpuCullParameters {
+	glm::vec4 planes[6];
+	glm::vec4 eye;
+	uint32_t instanceCount;
+	uint32_t instanceBase;	// first GpuInstance of the region of the current image
+	uint32_t commandBase;	// first uint of the region of the current image in the command buffer
+	uint32_t outputBase;	// first InstanceTransform of the region of the current image
+} ;
+
+// Instances of an instanced technique sharing the same model and textures, drawn with a single call.
+// Only the leader has descriptor sets: its uniforms apply to all the instances of the batch
+struct InstanceBatch {
+	int leader;		// index of the first instance of the batch in TechniqueInstances::I
+	int first;		// first slot of the batch in the instance buffer
+	int count;
+	int *Iids;		// instances of the batch
+	int visibleCount;	// visible instances, written at the beginning of the slots of the batch
+} ;
+
+// A draw call of the scene: an instance, or a batch of an instanced technique.
+// Draws are recorded in increasing key order, with bits from the most significant:
+// technique (8) | texture set (16) | mesh (16) | depth (24)
+// Techniques keep the order of the scene file (it decides, for example, what is drawn before the sky box):
+// each of them has its own pipeline, so the first field sorts by pipeline too
+struct DrawItem {
+	uint64_t key;
+	int technique;
+	int item;		// instance, or batch for instanced techniques
+} ;
+
+// State changes and draw calls recorded in the last frame
+struct BindStats {
+	int pipelines;
+	int descriptorSets;
+	int buffers;		// vertex and index buffer bindings
+	int draws;
+} ;
+
+// Command pool of a recording thread for a frame in flight, with the secondary command buffers
+// allocated from it so far: they are reused, in order, once the pool has been reset
+struct SecondaryCommandPool {
+	VkCommandPool pool;
+	std::vector<VkCommandBuffer> cb;
+	int used;
+} ;
+
+// Range of the draw list, recorded by a job in its own secondary command buffer
+struct RecordingChunk {
+	int first;
+	int last;
+	VkCommandBuffer cb;
+	BindStats stats;
+} ;
+
+struct CullStats {
+	int tested;
+	int visible;
+} ;
+
+// enabled instances with a far level of detail, split by the one drawn in the last selectLods()
+struct LodStats {
+	int near;
+	int far;
 } ;
 
 struct TextureDefs {
@@ -30,8 +141,14 @@ struct TechniqueRef {
 	std::vector<PipelineAndTexturesDefs>PT;
 	int Ntextures;
 	VertexDescriptor *VD;
+	// the instances sharing model and textures are drawn together, reading their
+	// InstanceTransform from vertex binding 1 of the pipelines
+	bool instanced;
+	// the instances outside the view frustum are not drawn: their Wm must be kept up to date
+	bool culled;
 
-	void init(const char *_id, std::vector<PipelineAndTexturesDefs> _PT, int _Ntextures, VertexDescriptor * _VD);
+	void init(const char *_id, std::vector<PipelineAndTexturesDefs> _PT, int _Ntextures, VertexDescriptor * _VD,
+			  bool _instanced = false, bool _culled = false);
 } ;
 
 struct VertexDescriptorRef {
@@ -46,6 +163,21 @@ struct TechniqueInstances {
 	int InstanceCount;
 	
 	TechniqueRef *T;
+
+	// instanced techniques only
+	int BatchCount;
+	InstanceBatch *B;
+	// one persistently mapped region of InstanceTransform per swap chain image
+	VkBuffer instanceBuffer;
+	MemoryAllocation instanceBufferMemory;
+	unsigned char *instanceMapped;
+	VkDeviceSize instanceRegionStride;
+	int instanceRegions;
+
+	// GPU driven techniques are culled by the compute shader, and draw each batch with an indirect command
+	bool gpuDriven;
+	int gpuBatchBase;	// first batch of the technique among the ones of all the GPU driven techniques
+	int gpuSlotBase;	// first slot of the technique in the output instance buffer
 } ;
 
 
@@ -85,22 +217,128 @@ class Scene {
 	std::unordered_map<std::string, VertexDescriptor *> VDIds;
 	int Npasses;
 
+	// Descriptor sets shared by all the instances: one for each of these layouts, bound once
+	// per pipeline. Their layouts can contain only uniform blocks
+	std::vector<DescriptorSetLayout *> SharedDSL;
+	std::unordered_map<DescriptorSetLayout *, DescriptorSet *> SharedDS;
+
+	// Frustum culling: world space bounding spheres of the instances of the culled techniques,
+	// stored as structure of arrays and padded to a multiple of 4 for the SIMD test
+	std::vector<float> cullX, cullY, cullZ, cullR;
+	std::vector<Instance *> cullI;
+	CullStats cullStats = {0, 0};
+
+	// Levels of detail: the instances with a farLod
+	std::vector<Instance *> lodI;
+	LodStats lodStats = {0, 0};
+	// billboards and atlases of the "impostors" section of the scene file
+	ImpostorAtlas impostors;
+
+	// Draws in recording order: the order of the scene file until sortDraws() is called
+	std::vector<DrawItem> drawList;
+	BindStats bindStats = {0, 0, 0, 0};
+	// maximum number of descriptor sets of the pipelines of the scene
+	static const int maxSets = 8;
+
+	// Parallel recording: one pool per frame in flight and recording thread,
+	// at secondaryPools[frame * recordingThreads + thread]
+	JobSystem *jobs = nullptr;
+	int recordingThreads = 0;
+	std::vector<SecondaryCommandPool> secondaryPools;
+	std::vector<RecordingChunk> recordingChunks;
+	std::vector<VkCommandBuffer> recordedChunks;
+	// maximum number of draws recorded by a single job
+	int recordingChunkSize = 32;
+
+	// GPU driven drawing, for the instanced and culled techniques. Each buffer but the batches
+	// has one region per swap chain image. The command buffer region starts with four counters,
+	// tested, visible, near and far instances, followed by a VkDrawIndexedIndirectCommand per batch
+	bool gpuCulling = false;
+	std::vector<Instance *> gpuI;
+	std::vector<GpuInstance> gpuInstances;	// as written every frame, but for mMat and enabled
+	std::vector<VkDrawIndexedIndirectCommand> gpuCommands;	// with no instances
+	int gpuBatchCount = 0;
+	int gpuSlotCount = 0;
+	int gpuRegions = 0;
+	VkDeviceSize gpuCommandStride = 0;
+	VkBuffer gpuInstanceBuffer, gpuBatchBuffer, gpuCommandBuffer, gpuOutputBuffer;
+	MemoryAllocation gpuInstanceMemory, gpuBatchMemory, gpuCommandMemory, gpuOutputMemory;
+	VkDescriptorSetLayout gpuSetLayout;
+	VkDescriptorPool gpuPool;
+	VkDescriptorSet gpuSet;
+	VkPipelineLayout gpuPipelineLayout;
+	VkPipeline gpuPipeline;
+	GpuCullParameters gpuParameters;
+	static const uint32_t noFarBatch = 0xffffffff;
+	static const int gpuCounters = 4;
 
-	int init(BaseProject *_BP,  int _Npasses, std::vector<VertexDescriptorRef>  &VDRs, std::vector<TechniqueRef> &PRs, std::string file);
+
+	int init(BaseProject *_BP,  int _Npasses, std::vector<VertexDescriptorRef>  &VDRs, std::vector<TechniqueRef> &PRs, std::string file,
+			 std::vector<DescriptorSetLayout *> _SharedDSL = {});
 
 	void pipelinesAndDescriptorSetsInit();
 	void pipelinesAndDescriptorSetsCleanup();
 	void localCleanup();
     void populateCommandBuffer(VkCommandBuffer commandBuffer, int passId, int currentImage);
+	// Creates the command pools used by populateCommandBufferParallel, one for each thread of _jobs
+	// and frame in flight. _jobs can be nullptr, to record the secondary command buffers in the calling thread
+	void initParallelRecording(JobSystem *_jobs);
+	// Records the draw calls of pass passId in secondary command buffers, filled in parallel by the
+	// job system, and executes them in commandBuffer in the order of the draw list, so the result
+	// is the same of populateCommandBuffer(). RP must have been begun on commandBuffer with
+	// VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+	void populateCommandBufferParallel(VkCommandBuffer commandBuffer, RenderPass *RP, int passId, int currentImage);
+	// copies Wm of the instances of the instanced techniques into the instance buffer of the current image
+	void updateInstances(int currentImage);
+	// Chooses the level of detail of the instances with a farLod from their distance to eyePos, and copies
+	// their Wm and enabled flag to the far one. To be called before cull(), with the Wm up to date
+	void selectLods(const glm::vec3 &eyePos);
+	// tests the enabled instances of the culled techniques against the frustum of ViewPrj,
+	// updating their visible flag and cullStats. The other instances are visible if enabled
+	void cull(const glm::mat4 &ViewPrj);
+	// Moves the instanced and culled techniques to the GPU: from now on their levels of detail and frustum
+	// culling are computed by shaders/CullInstances.comp, and they are drawn with indirect commands.
+	// To be called after init()
+	void initGpuCulling();
+	// Writes the world matrices of the GPU driven instances and resets the indirect commands of the
+	// current image, reading the statistics of its previous frame. To be called after cull()
+	void updateGpuCulling(const glm::mat4 &ViewPrj, const glm::vec3 &eyePos, int currentImage);
+	// Records the culling compute shader: to be called outside the render pass, before the draws
+	void recordGpuCulling(VkCommandBuffer commandBuffer, int currentImage);
+	// Rebuilds the draw list with the visible draws, sorted by key: the depth is the one seen from ViewPrj,
+	// so the instances closer to the camera are drawn first. To be called after cull() and updateInstances()
+	void sortDraws(const glm::mat4 &ViewPrj);
+	// the descriptor set shared by all the instances using DSL, nullptr if DSL is not shared
+	DescriptorSet *getSharedSet(DescriptorSetLayout *DSL);
+	bool isShared(DescriptorSetLayout *DSL) {
+		return std::find(SharedDSL.begin(), SharedDSL.end(), DSL) != SharedDSL.end();
+	}
+
+	private:
+	void initBatches(TechniqueInstances &Ti);
+	void initImpostors(nlohmann::json &ims);
+	void initCulling();
+	void initGpuPipeline();
+	static void frustumPlanes(const glm::mat4 &ViewPrj, glm::vec4 planes[6]);
+	void updateBounds(Instance *Inst);
+	void writeInstances(TechniqueInstances &Ti, int currentImage);
+	void checkPass(int passId);
+	void initDrawList();
+	// records the draws [first, last) of the draw list, binding only the state that changes from a draw to the next
+	void recordDraws(VkCommandBuffer commandBuffer, int first, int last, int passId, int currentImage, BindStats &stats);
+	VkCommandBuffer beginSecondary(SecondaryCommandPool &SP, RenderPass *RP, int currentImage);
 };
 
 #ifdef SCENE_IMPLEMENTATION
 
-void TechniqueRef::init(const char *_id, std::vector<PipelineAndTexturesDefs> _PT, int _Ntextures, VertexDescriptor * _VD) {
+void TechniqueRef::init(const char *_id, std::vector<PipelineAndTexturesDefs> _PT, int _Ntextures, VertexDescriptor * _VD,
+						bool _instanced, bool _culled) {
 	id = new std::string(_id);
 	PT = _PT;
 	Ntextures = _Ntextures;
 	VD = _VD;
+	instanced = _instanced;
+	culled = _culled;
 }
 
 void VertexDescriptorRef::init(const char *_id, VertexDescriptor * _VD) {
@@ -109,9 +347,22 @@ void VertexDescriptorRef::init(const char *_id, VertexDescriptor * _VD) {
 }
 
 int Scene::init(BaseProject *_BP,  int _Npasses, std::vector<VertexDescriptorRef>  &VDRs,  
-		  std::vector<TechniqueRef> &PRs, std::string file) {
+		  std::vector<TechniqueRef> &PRs, std::string file, std::vector<DescriptorSetLayout *> _SharedDSL) {
 	BP = _BP;
 	Npasses = _Npasses;
+	SharedDSL = _SharedDSL;
+	
+	for(int i = 0; i < SharedDSL.size(); i++) {
+		if(SharedDSL[i]->imgInfoSize > 0) {
+			std::cout << "Scene Error: shared descriptor set layouts cannot contain textures\n";
+			exit(0);
+		}
+		BP->DPSZs.setsInPool += 1;
+		for(int l = 0; l < SharedDSL[i]->Bindings.size(); l++) {
+			BP->DPSZs.uniformBlocksInPool += 1;
+			BP->DPSZs.uniformBytesInPool += SharedDSL[i]->Bindings[l].linkSize;
+		}
+	}
 	
 	for(int i = 0; i < VDRs.size(); i++) {
 		VDIds[*VDRs[i].id] = VDRs[i].VD;
@@ -231,6 +482,12 @@ int Scene::init(BaseProject *_BP,  int _Npasses, std::vector<VertexDescriptorRef
 std::cout << ts[k]["id"] << "(" << k << ") " << TT << "\n";
 		}
 
+		// IMPOSTORS
+		nlohmann::json ims = js["impostors"];
+		if(!ims.is_null()) {
+			initImpostors(ims);
+		}
+
 		// INSTANCES TextureCount
 		nlohmann::json pis = js["instances"];
 		TechniqueInstanceCount = pis.size();
@@ -250,6 +507,14 @@ std::cout << "Technique Instances count: " << TechniqueInstanceCount << "\n";
 
 		I = (Instance **)calloc(InstanceCount, sizeof(Instance *));
 		int current_instance_idx = 0;
+		// far levels of detail, with the id and the copy of the instance they replace
+		struct FarLod {
+			Instance *Inst;
+			std::string lodOf;
+			int copy;
+			float distance;
+		};
+		std::vector<FarLod> farLods;
 
 		for(int k = 0; k < TechniqueInstanceCount; k++) {
 			std::string Pid = pis[k]["technique"].template get<std::string>();
@@ -367,24 +632,46 @@ std::cout << "\n";
 					for(int ipas = 0; ipas < Npasses; ipas++) {
 						TI[k].I[current_instance_in_tech].D[ipas] = &TI[k].T->PT[ipas].P->D;
 						TI[k].I[current_instance_in_tech].NDs[ipas] = TI[k].I[current_instance_in_tech].D[ipas]->size();
-						BP->DPSZs.setsInPool += TI[k].I[current_instance_in_tech].NDs[ipas];
-						for(int h = 0; h < TI[k].I[current_instance_in_tech].NDs[ipas]; h++) {
-							DescriptorSetLayout *DSL = (*TI[k].I[current_instance_in_tech].D[ipas])[h];
-							int DSLsize = DSL->Bindings.size();
-
-							for (int l = 0; l < DSLsize; l++) {
-								if(DSL->Bindings[l].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
-									BP->DPSZs.uniformBlocksInPool += 1;
-								} else {
-									BP->DPSZs.texturesInPool += 1;
-								}
-							}
-						}
+					}
+					TI[k].I[current_instance_in_tech].cullId = -1;
+					TI[k].I[current_instance_in_tech].visible = true;
+					TI[k].I[current_instance_in_tech].enabled = true;
+					TI[k].I[current_instance_in_tech].inRange = true;
+					if(is[j].contains("lodOf")) {
+						farLods.push_back({&TI[k].I[current_instance_in_tech], is[j]["lodOf"].template get<std::string>(), c,
+										   is[j]["lodDistance"].template get<float>()});
 					}
 					I[current_instance_idx++] = &TI[k].I[current_instance_in_tech];
 				}
 				instance_offset += count;
 			}
+			
+			if(TI[k].T->instanced) {
+				initBatches(TI[k]);
+			}
+			
+			// descriptor sets needed by the instances, the shared ones are counted only once
+			for(int j = 0; j < TI[k].InstanceCount; j++) {
+				for(int ipas = 0; ipas < Npasses; ipas++) {
+					for(int h = 0; h < TI[k].I[j].NDs[ipas]; h++) {
+						DescriptorSetLayout *DSL = (*TI[k].I[j].D[ipas])[h];
+						if(isShared(DSL)) {
+							continue;
+						}
+						BP->DPSZs.setsInPool += 1;
+						int DSLsize = DSL->Bindings.size();
+
+						for (int l = 0; l < DSLsize; l++) {
+							if(DSL->Bindings[l].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+								BP->DPSZs.uniformBlocksInPool += 1;
+								BP->DPSZs.uniformBytesInPool += DSL->Bindings[l].linkSize;
+							} else {
+								BP->DPSZs.texturesInPool += 1;
+							}
+						}
+					}
+				}
+			}
 		}			
 
 std::cout << "Creating instances\n";
@@ -402,6 +689,28 @@ std::cout << "Creating instances\n";
 		}
 std::cout << i << " instances created\n";
 
+		// copy c of a far element replaces copy c of the element with id lodOf
+		std::unordered_map<std::string, std::vector<Instance *>> copies;
+		for(int h = 0; h < InstanceCount; h++) {
+			copies[*I[h]->id].push_back(I[h]);
+		}
+		lodI.clear();
+		for(auto &fl : farLods) {
+			std::vector<Instance *> &nearI = copies[fl.lodOf];
+			if(fl.copy >= nearI.size()) {
+				std::cout << "Scene Error: " << *fl.Inst->id << " has more copies than its lodOf " << fl.lodOf << "\n";
+				exit(0);
+			}
+			Instance *Near = nearI[fl.copy];
+			Near->farLod = fl.Inst;
+			Near->lodDistance = fl.distance;
+			Near->farLod->inRange = false;
+			lodI.push_back(Near);
+		}
+std::cout << lodI.size() << " instances with a far level of detail\n";
+		initCulling();
+		initDrawList();
+
 
 /*		} catch (const nlohmann::json::exception& e) {
 		std::cout << "\n\n\nException while parsing JSON file: " << file << "\n";
@@ -415,8 +724,616 @@ std::cout << i << " instances created\n";
 }
 
 
+// Groups the instances sharing model and textures, in order of first appearance,
+// and creates the instance buffer of the technique
+void Scene::initBatches(TechniqueInstances &Ti) {
+	int *batchOf = (int *)calloc(Ti.InstanceCount, sizeof(int));
+	Ti.B = (InstanceBatch *)calloc(Ti.InstanceCount, sizeof(InstanceBatch));
+	Ti.BatchCount = 0;
+	for(int i = 0; i < Ti.InstanceCount; i++) {
+		int b;
+		for(b = 0; b < Ti.BatchCount; b++) {
+			Instance &L = Ti.I[Ti.B[b].leader];
+			if((L.Mid == Ti.I[i].Mid) && (memcmp(L.Tid, Ti.I[i].Tid, L.NTx * sizeof(int)) == 0)) {
+				break;
+			}
+		}
+		if(b == Ti.BatchCount) {
+			Ti.B[b].leader = i;
+			Ti.BatchCount++;
+		}
+		Ti.B[b].count++;
+		batchOf[i] = b;
+	}
+
+	// slots are assigned batch by batch, so that each batch reads a contiguous range
+	int first = 0;
+	for(int b = 0; b < Ti.BatchCount; b++) {
+		Ti.B[b].first = first;
+		Ti.B[b].Iids = (int *)calloc(Ti.B[b].count, sizeof(int));
+		Ti.B[b].visibleCount = Ti.B[b].count;
+		first += Ti.B[b].count;
+		Ti.B[b].count = 0;
+	}
+	for(int i = 0; i < Ti.InstanceCount; i++) {
+		InstanceBatch &Bt = Ti.B[batchOf[i]];
+		Bt.Iids[Bt.count++] = i;
+		if(i != Bt.leader) {
+			for(int ipas = 0; ipas < Npasses; ipas++) {
+				Ti.I[i].NDs[ipas] = 0;
+			}
+		}
+	}
+	free(batchOf);
+std::cout << "Technique " << *Ti.T->id << ": " << Ti.InstanceCount << " instances in " << Ti.BatchCount << " instanced draw calls\n";
+
+	Ti.instanceRegions = BP->imageRegions;
+	Ti.instanceRegionStride = (Ti.InstanceCount * sizeof(InstanceTransform) + 255) & ~(VkDeviceSize)255;
+	BP->createBuffer(Ti.instanceRegionStride * Ti.instanceRegions,
+					 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 Ti.instanceBuffer, Ti.instanceBufferMemory);
+	Ti.instanceMapped = Ti.instanceBufferMemory.mapped;
+	for(int i = 0; i < Ti.instanceRegions; i++) {
+		writeInstances(Ti, i);
+	}
+}
+
+// The visible instances of each batch are packed at the beginning of its slots
+void Scene::writeInstances(TechniqueInstances &Ti, int currentImage) {
+	InstanceTransform *IT = (InstanceTransform *)(Ti.instanceMapped +
+							Ti.instanceRegionStride * (currentImage % Ti.instanceRegions));
+	for(int b = 0; b < Ti.BatchCount; b++) {
+		InstanceBatch &Bt = Ti.B[b];
+		InstanceTransform *BIT = IT + Bt.first;
+		int n = 0;
+		for(int j = 0; j < Bt.count; j++) {
+			Instance &Inst = Ti.I[Bt.Iids[j]];
+			if(Inst.visible) {
+				BIT[n].mMat = Inst.Wm;
+				BIT[n].nMat = glm::inverse(glm::transpose(Inst.Wm));
+				n++;
+			}
+		}
+		Bt.visibleCount = n;
+	}
+}
+
+// The billboards and the two atlases are added to the models and the textures of the scene,
+// so the instances can use them as any other one
+void Scene::initImpostors(nlohmann::json &ims) {
+	nlohmann::json bs = ims["models"];
+	int n = bs.size();
+	std::vector<ImpostorSource> sources(n);
+	for(int k = 0; k < n; k++) {
+		auto m = MeshIds.find(bs[k]["model"]);
+		if(m == MeshIds.end()) {
+			std::cout << "Scene Error: impostor " << bs[k]["id"] << " of unknown model " << bs[k]["model"] << "\n";
+			exit(0);
+		}
+		sources[k].M = M[m->second];
+		if(bs[k]["texture"].size() != 2) {
+			std::cout << "Scene Error: impostor " << bs[k]["id"] << " needs an albedo and a detail texture\n";
+			exit(0);
+		}
+		sources[k].albedo = T[TextureIds[bs[k]["texture"][0]]]->getViewAndSampler();
+		sources[k].detail = T[TextureIds[bs[k]["texture"][1]]]->getViewAndSampler();
+	}
+	impostors.init(BP, ims["size"], sources);
+
+	M = (Model **)realloc(M, (ModelCount + n) * sizeof(Model *));
+	for(int k = 0; k < n; k++) {
+		MeshIds[bs[k]["id"]] = ModelCount;
+		M[ModelCount] = new Model();
+		impostors.makeBillboard(k, VDIds[bs[k]["VD"]], M[ModelCount]);
+		ModelCount++;
+	}
+
+	T = (Texture **)realloc(T, (TextureCount + 2) * sizeof(Texture *));
+	TextureIds[ims["albedo"]] = TextureCount;
+	T[TextureCount] = new Texture();
+	TextureIds[ims["normal"]] = TextureCount + 1;
+	T[TextureCount + 1] = new Texture();
+	impostors.bake(T[TextureCount], T[TextureCount + 1]);
+	TextureCount += 2;
+}
+
+void Scene::initCulling() {
+	cullI.clear();
+	for(int k = 0; k < TechniqueInstanceCount; k++) {
+		if(!TI[k].T->culled || TI[k].gpuDriven) {
+			continue;
+		}
+		for(int i = 0; i < TI[k].InstanceCount; i++) {
+			// models without bounds are always drawn
+			if(M[TI[k].I[i].Mid]->boundsRadius >= 0.0f) {
+				TI[k].I[i].cullId = cullI.size();
+				cullI.push_back(&TI[k].I[i]);
+			}
+		}
+	}
+	
+	// the padding spheres have a negative infinite radius, and are never visible
+	int padded = (cullI.size() + 3) & ~3;
+	cullX.assign(padded, 0.0f);
+	cullY.assign(padded, 0.0f);
+	cullZ.assign(padded, 0.0f);
+	cullR.assign(padded, -std::numeric_limits<float>::infinity());
+	for(int c = 0; c < cullI.size(); c++) {
+		updateBounds(cullI[c]);
+	}
+std::cout << cullI.size() << " instances can be culled\n";
+}
+
+// Moves the bounding sphere of the model to world space: the radius is scaled by the largest axis scale
+void Scene::updateBounds(Instance *Inst) {
+	Model *Md = M[Inst->Mid];
+	const glm::mat4 &W = Inst->Wm;
+	glm::vec3 c = glm::vec3(W * glm::vec4(Md->boundsCenter, 1.0f));
+	float s2 = std::max(glm::dot(glm::vec3(W[0]), glm::vec3(W[0])),
+			   std::max(glm::dot(glm::vec3(W[1]), glm::vec3(W[1])),
+						glm::dot(glm::vec3(W[2]), glm::vec3(W[2]))));
+	int id = Inst->cullId;
+	cullX[id] = c.x;
+	cullY[id] = c.y;
+	cullZ[id] = c.z;
+	cullR[id] = Md->boundsRadius * std::sqrt(s2);
+	Inst->boundsWm = W;
+}
+
+// frustum planes from the rows of ViewPrj (depth from 0 to 1), normalized so that
+// their equation gives the signed distance: left, right, bottom, top, near, far
+void Scene::frustumPlanes(const glm::mat4 &ViewPrj, glm::vec4 planes[6]) {
+	glm::vec4 r0 = glm::vec4(ViewPrj[0][0], ViewPrj[1][0], ViewPrj[2][0], ViewPrj[3][0]);
+	glm::vec4 r1 = glm::vec4(ViewPrj[0][1], ViewPrj[1][1], ViewPrj[2][1], ViewPrj[3][1]);
+	glm::vec4 r2 = glm::vec4(ViewPrj[0][2], ViewPrj[1][2], ViewPrj[2][2], ViewPrj[3][2]);
+	glm::vec4 r3 = glm::vec4(ViewPrj[0][3], ViewPrj[1][3], ViewPrj[2][3], ViewPrj[3][3]);
+	planes[0] = r3 + r0;
+	planes[1] = r3 - r0;
+	planes[2] = r3 + r1;
+	planes[3] = r3 - r1;
+	planes[4] = r2;
+	planes[5] = r3 - r2;
+	for(int p = 0; p < 6; p++) {
+		planes[p] /= glm::length(glm::vec3(planes[p]));
+	}
+}
+
+void Scene::cull(const glm::mat4 &ViewPrj) {
+	// world space spheres are recomputed only for the instances that moved
+	for(int c = 0; c < cullI.size(); c++) {
+		if(memcmp(&cullI[c]->Wm, &cullI[c]->boundsWm, sizeof(glm::mat4)) != 0) {
+			updateBounds(cullI[c]);
+		}
+	}
+
+	glm::vec4 planes[6];
+	frustumPlanes(ViewPrj, planes);
+
+	int padded = cullR.size();
+	int tested = 0;
+	int visible = 0;
+	for(int c = 0; c < padded; c += 4) {
+		int mask;
+#ifdef SCENE_CULL_SSE
+		__m128 X = _mm_loadu_ps(&cullX[c]);
+		__m128 Y = _mm_loadu_ps(&cullY[c]);
+		__m128 Z = _mm_loadu_ps(&cullZ[c]);
+		__m128 NR = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&cullR[c]));
+		__m128 in = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for(int p = 0; p < 6; p++) {
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(X, _mm_set1_ps(planes[p].x)),
+											 _mm_mul_ps(Y, _mm_set1_ps(planes[p].y))),
+								  _mm_add_ps(_mm_mul_ps(Z, _mm_set1_ps(planes[p].z)),
+											 _mm_set1_ps(planes[p].w)));
+			in = _mm_and_ps(in, _mm_cmpge_ps(d, NR));
+		}
+		mask = _mm_movemask_ps(in);
+#else
+		mask = 0;
+		for(int l = 0; l < 4; l++) {
+			bool in = true;
+			for(int p = 0; p < 6; p++) {
+				float d = planes[p].x * cullX[c + l] + planes[p].y * cullY[c + l] +
+						  planes[p].z * cullZ[c + l] + planes[p].w;
+				in = in && (d >= -cullR[c + l]);
+			}
+			mask |= in ? (1 << l) : 0;
+		}
+#endif
+		for(int l = 0; (l < 4) && (c + l < cullI.size()); l++) {
+			Instance *Inst = cullI[c + l];
+			Inst->visible = Inst->enabled && Inst->inRange && ((mask >> l) & 1);
+			tested += (Inst->enabled && Inst->inRange) ? 1 : 0;
+			visible += Inst->visible ? 1 : 0;
+		}
+	}
+	cullStats.tested = tested;
+	cullStats.visible = visible;
+
+	for(int k = 0; k < TechniqueInstanceCount; k++) {
+		if(TI[k].gpuDriven) {
+			continue;
+		}
+		for(int i = 0; i < TI[k].InstanceCount; i++) {
+			if(TI[k].I[i].cullId < 0) {
+				TI[k].I[i].visible = TI[k].I[i].enabled && TI[k].I[i].inRange;
+			}
+		}
+	}
+}
+
+void Scene::selectLods(const glm::vec3 &eyePos) {
+	int nearCount = 0;
+	int farCount = 0;
+	for(int i = 0; i < lodI.size(); i++) {
+		Instance *Inst = lodI[i];
+		Instance *Far = Inst->farLod;
+		glm::vec3 d = glm::vec3(Inst->Wm[3]) - eyePos;
+		Inst->inRange = glm::dot(d, d) < Inst->lodDistance * Inst->lodDistance;
+		Far->inRange = !Inst->inRange;
+		Far->Wm = Inst->Wm;
+		Far->enabled = Inst->enabled;
+		if(Inst->enabled) {
+			nearCount += Inst->inRange ? 1 : 0;
+			farCount += Inst->inRange ? 0 : 1;
+		}
+	}
+	lodStats.near = nearCount;
+	lodStats.far = farCount;
+}
+
+// The batches of the instanced and culled techniques get an indirect command each, whose instance count is
+// written by the compute shader. Far levels of detail are not instances of their own: the compute shader
+// moves the near one to the batch of the far one, so both must be GPU driven
+void Scene::initGpuCulling() {
+	gpuBatchCount = 0;
+	gpuSlotCount = 0;
+	std::unordered_map<Instance *, uint32_t> batchOf;
+	std::vector<GpuBatch> batches;
+	gpuCommands.clear();
+	for(int k = 0; k < TechniqueInstanceCount; k++) {
+		TechniqueInstances &Ti = TI[k];
+		Ti.gpuDriven = Ti.T->instanced && Ti.T->culled;
+		if(!Ti.gpuDriven) {
+			continue;
+		}
+		Ti.gpuBatchBase = gpuBatchCount;
+		Ti.gpuSlotBase = gpuSlotCount;
+		for(int b = 0; b < Ti.BatchCount; b++) {
+			InstanceBatch &Bt = Ti.B[b];
+			Model *Md = M[Ti.I[Bt.leader].Mid];
+			GpuBatch GB{};
+			GB.sphere = glm::vec4(Md->boundsCenter, Md->boundsRadius);
+			GB.first = Ti.gpuSlotBase + Bt.first;
+			batches.push_back(GB);
+			gpuCommands.push_back({static_cast<uint32_t>(Md->indices.size()), 0, Md->firstIndex, Md->vertexOffset, 0});
+			for(int j = 0; j < Bt.count; j++) {
+				batchOf[&Ti.I[Bt.Iids[j]]] = gpuBatchCount + b;
+			}
+		}
+		gpuBatchCount += Ti.BatchCount;
+		gpuSlotCount += Ti.InstanceCount;
+	}
+	if(gpuBatchCount == 0) {
+std::cout << "GPU culling: no instanced and culled technique\n";
+		return;
+	}
+
+	// selectLods() keeps only the levels of detail of the instances drawn by the CPU
+	std::set<Instance *> farI;
+	std::vector<Instance *> cpuLodI;
+	for(Instance *Inst : lodI) {
+		if(Inst->TIp->gpuDriven != Inst->farLod->TIp->gpuDriven) {
+			std::cout << "Scene Error: " << *Inst->id << " and its far level of detail " << *Inst->farLod->id <<
+						 " must be both culled on the GPU or both on the CPU\n";
+			exit(0);
+		}
+		if(Inst->TIp->gpuDriven) {
+			farI.insert(Inst->farLod);
+		} else {
+			cpuLodI.push_back(Inst);
+		}
+	}
+	lodI = cpuLodI;
+
+	gpuI.clear();
+	gpuInstances.clear();
+	for(int k = 0; k < TechniqueInstanceCount; k++) {
+		if(!TI[k].gpuDriven) {
+			continue;
+		}
+		for(int i = 0; i < TI[k].InstanceCount; i++) {
+			Instance *Inst = &TI[k].I[i];
+			if(farI.count(Inst) > 0) {
+				continue;
+			}
+			GpuInstance GI{};
+			GI.batch = batchOf[Inst];
+			GI.farBatch = (Inst->farLod != nullptr) ? batchOf[Inst->farLod] : noFarBatch;
+			GI.lodDistance2 = (Inst->farLod != nullptr) ? Inst->lodDistance * Inst->lodDistance : 0.0f;
+			gpuI.push_back(Inst);
+			gpuInstances.push_back(GI);
+		}
+	}
+
+	// the host writes the instances and the commands of an image while the GPU can still use the others
+	gpuRegions = BP->imageRegions;
+	gpuCommandStride = (gpuCounters * sizeof(uint32_t) + gpuBatchCount * sizeof(VkDrawIndexedIndirectCommand) + 255) &
+					   ~(VkDeviceSize)255;
+	BP->createBuffer(gpuI.size() * sizeof(GpuInstance) * gpuRegions,
+					 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 gpuInstanceBuffer, gpuInstanceMemory);
+	BP->createBuffer(batches.size() * sizeof(GpuBatch),
+					 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 gpuBatchBuffer, gpuBatchMemory);
+	memcpy(gpuBatchMemory.mapped, batches.data(), batches.size() * sizeof(GpuBatch));
+	BP->createBuffer(gpuCommandStride * gpuRegions,
+					 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 gpuCommandBuffer, gpuCommandMemory);
+	memset(gpuCommandMemory.mapped, 0, gpuCommandStride * gpuRegions);
+	BP->createBuffer(gpuSlotCount * sizeof(InstanceTransform) * gpuRegions,
+					 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+					 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+					 gpuOutputBuffer, gpuOutputMemory);
+	initGpuPipeline();
+
+	gpuCulling = true;
+	initCulling();
+std::cout << "GPU culling: " << gpuI.size() << " instances in " << gpuBatchCount << " indirect draws\n";
+}
+
+void Scene::initGpuPipeline() {
+	VkDescriptorSetLayoutBinding bindings[4];
+	for(int b = 0; b < 4; b++) {
+		bindings[b] = {};
+		bindings[b].binding = b;
+		bindings[b].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		bindings[b].descriptorCount = 1;
+		bindings[b].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	}
+	VkDescriptorSetLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = 4;
+	layoutInfo.pBindings = bindings;
+	VkResult result = vkCreateDescriptorSetLayout(BP->device, &layoutInfo, nullptr, &gpuSetLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create culling descriptor set layout!");
+	}
+
+	// the descriptor pool of the application only has uniforms and textures: the culling has its own
+	VkDescriptorPoolSize poolSize{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4};
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = 1;
+	poolInfo.pPoolSizes = &poolSize;
+	poolInfo.maxSets = 1;
+	result = vkCreateDescriptorPool(BP->device, &poolInfo, nullptr, &gpuPool);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create culling descriptor pool!");
+	}
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = gpuPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &gpuSetLayout;
+	result = vkAllocateDescriptorSets(BP->device, &allocInfo, &gpuSet);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate culling descriptor set!");
+	}
+	VkDescriptorBufferInfo bufferInfo[4] = {{gpuInstanceBuffer, 0, VK_WHOLE_SIZE},
+											{gpuBatchBuffer, 0, VK_WHOLE_SIZE},
+											{gpuCommandBuffer, 0, VK_WHOLE_SIZE},
+											{gpuOutputBuffer, 0, VK_WHOLE_SIZE}};
+	VkWriteDescriptorSet writes[4];
+	for(int b = 0; b < 4; b++) {
+		writes[b] = {};
+		writes[b].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[b].dstSet = gpuSet;
+		writes[b].dstBinding = b;
+		writes[b].dstArrayElement = 0;
+		writes[b].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		writes[b].descriptorCount = 1;
+		writes[b].pBufferInfo = &bufferInfo[b];
+	}
+	vkUpdateDescriptorSets(BP->device, 4, writes, 0, nullptr);
+
+	VkPushConstantRange pushRange{VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(GpuCullParameters)};
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &gpuSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushRange;
+	result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr, &gpuPipelineLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create culling pipeline layout!");
+	}
+
+	auto compShaderCode = readFile("shaders/CullInstances.comp.spv");
+	VkShaderModuleCreateInfo moduleInfo{};
+	moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	moduleInfo.codeSize = compShaderCode.size();
+	moduleInfo.pCode = reinterpret_cast<const uint32_t*>(compShaderCode.data());
+	VkShaderModule compShaderModule;
+	result = vkCreateShaderModule(BP->device, &moduleInfo, nullptr, &compShaderModule);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create culling shader module!");
+	}
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipelineInfo.stage.module = compShaderModule;
+	pipelineInfo.stage.pName = "main";
+	pipelineInfo.layout = gpuPipelineLayout;
+	auto start = std::chrono::high_resolution_clock::now();
+	result = vkCreateComputePipelines(BP->device, BP->pipelineCache.cache, 1, &pipelineInfo, nullptr, &gpuPipeline);
+	BP->pipelineCache.addTiming(start);
+	vkDestroyShaderModule(BP->device, compShaderModule, nullptr);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create culling pipeline!");
+	}
+}
+
+void Scene::updateGpuCulling(const glm::mat4 &ViewPrj, const glm::vec3 &eyePos, int currentImage) {
+	if(!gpuCulling) {
+		return;
+	}
+	int region = currentImage % gpuRegions;
+
+	// the fence of the image has been waited: its counters are the ones of its previous frame
+	uint32_t *counters = (uint32_t *)(gpuCommandMemory.mapped + gpuCommandStride * region);
+	cullStats.tested += counters[0];
+	cullStats.visible += counters[1];
+	lodStats.near += counters[2];
+	lodStats.far += counters[3];
+	memset(counters, 0, gpuCounters * sizeof(uint32_t));
+	memcpy(counters + gpuCounters, gpuCommands.data(), gpuCommands.size() * sizeof(VkDrawIndexedIndirectCommand));
+
+	GpuInstance *GI = (GpuInstance *)gpuInstanceMemory.mapped + gpuI.size() * region;
+	for(int i = 0; i < gpuI.size(); i++) {
+		GI[i] = gpuInstances[i];
+		GI[i].mMat = gpuI[i]->Wm;
+		GI[i].enabled = gpuI[i]->enabled ? 1 : 0;
+	}
+
+	frustumPlanes(ViewPrj, gpuParameters.planes);
+	gpuParameters.eye = glm::vec4(eyePos, 1.0f);
+	gpuParameters.instanceCount = gpuI.size();
+	gpuParameters.instanceBase = gpuI.size() * region;
+	gpuParameters.commandBase = gpuCommandStride * region / sizeof(uint32_t);
+	gpuParameters.outputBase = gpuSlotCount * region;
+}
+
+void Scene::recordGpuCulling(VkCommandBuffer commandBuffer, int currentImage) {
+	if(!gpuCulling) {
+		return;
+	}
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, gpuPipeline);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, gpuPipelineLayout,
+							0, 1, &gpuSet, 0, nullptr);
+	vkCmdPushConstants(commandBuffer, gpuPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+					   0, sizeof(GpuCullParameters), &gpuParameters);
+	vkCmdDispatch(commandBuffer, (gpuParameters.instanceCount + 63) / 64, 1, 1);
+
+	// the commands and the instances are read by the draws, the counters by updateGpuCulling()
+	VkMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+							VK_ACCESS_HOST_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+						 VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+						 VK_PIPELINE_STAGE_HOST_BIT,
+						 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void Scene::updateInstances(int currentImage) {
+	for(int k = 0; k < TechniqueInstanceCount; k++) {
+		if(TI[k].T->instanced && !TI[k].gpuDriven) {
+			writeInstances(TI[k], currentImage);
+		}
+	}
+}
+
+// Assigns the texture sets and lists all the draws, in the order of the scene file
+void Scene::initDrawList() {
+	drawList.clear();
+	for(int k = 0; k < TechniqueInstanceCount; k++) {
+		for(int ipas = 0; ipas < Npasses; ipas++) {
+			Pipeline *P = TI[k].T->PT[ipas].P;
+			if((P != nullptr) && (P->D.size() > maxSets)) {
+				std::cout << "Scene Error: technique " << *TI[k].T->id << " uses more than " << maxSets << " descriptor sets\n";
+				exit(0);
+			}
+		}
+
+		int texSets = 0;
+		for(int i = 0; i < TI[k].InstanceCount; i++) {
+			Instance &Inst = TI[k].I[i];
+			int j;
+			for(j = 0; j < i; j++) {
+				if((TI[k].I[j].NTx == Inst.NTx) && (memcmp(TI[k].I[j].Tid, Inst.Tid, Inst.NTx * sizeof(int)) == 0)) {
+					break;
+				}
+			}
+			Inst.texSetId = (j < i) ? TI[k].I[j].texSetId : texSets++;
+		}
+
+		int count = TI[k].T->instanced ? TI[k].BatchCount : TI[k].InstanceCount;
+		for(int i = 0; i < count; i++) {
+			drawList.push_back({0, k, i});
+		}
+	}
+}
+
+void Scene::sortDraws(const glm::mat4 &ViewPrj) {
+	// clip space z grows with the distance from the camera, both in perspective and in parallel projections
+	glm::vec4 r2 = glm::vec4(ViewPrj[0][2], ViewPrj[1][2], ViewPrj[2][2], ViewPrj[3][2]);
+
+	drawList.clear();
+	for(int k = 0; k < TechniqueInstanceCount; k++) {
+		TechniqueInstances &Ti = TI[k];
+		int count = Ti.T->instanced ? Ti.BatchCount : Ti.InstanceCount;
+		for(int i = 0; i < count; i++) {
+			Instance *Inst;
+			uint32_t depth = 0;
+			if(Ti.T->instanced) {
+				// a batch covers instances at any distance: it is sorted by textures and mesh only.
+				// The visible instances of GPU driven batches are known only to the GPU
+				if(!Ti.gpuDriven && (Ti.B[i].visibleCount == 0)) {
+					continue;
+				}
+				Inst = &Ti.I[Ti.B[i].leader];
+			} else {
+				Inst = &Ti.I[i];
+				if(!Inst->visible) {
+					continue;
+				}
+				glm::vec4 pos = (Inst->cullId >= 0) ?
+						glm::vec4(cullX[Inst->cullId], cullY[Inst->cullId], cullZ[Inst->cullId], 1.0f) :
+						Inst->Wm[3];
+				// the bits of a non negative float grow with its value: the 24 most significant ones are kept
+				float z = std::max(glm::dot(r2, pos), 0.0f);
+				uint32_t zBits;
+				memcpy(&zBits, &z, sizeof(float));
+				depth = zBits >> 7;
+			}
+			uint64_t key = ((uint64_t)(k & 0xff) << 56) |
+						   ((uint64_t)(Inst->texSetId & 0xffff) << 40) |
+						   ((uint64_t)(Inst->Mid & 0xffff) << 24) |
+						   (uint64_t)(depth & 0xffffff);
+			drawList.push_back({key, k, i});
+		}
+	}
+	std::sort(drawList.begin(), drawList.end(), [](const DrawItem &a, const DrawItem &b) {
+		return (a.key != b.key) ? (a.key < b.key) :
+			   (a.technique != b.technique) ? (a.technique < b.technique) : (a.item < b.item);
+	});
+}
+
+DescriptorSet *Scene::getSharedSet(DescriptorSetLayout *DSL) {
+	auto it = SharedDS.find(DSL);
+	return (it == SharedDS.end()) ? nullptr : it->second;
+}
+
 void Scene::pipelinesAndDescriptorSetsInit() {
 //std::cout << "Scene DS init\n";
+	for(int i = 0; i < SharedDSL.size(); i++) {
+		SharedDS[SharedDSL[i]] = new DescriptorSet();
+		SharedDS[SharedDSL[i]]->init(BP, SharedDSL[i], {});
+	}
+
 	for(int i = 0; i < InstanceCount; i++) {
 //std::cout << "I: " << i << ", NTx: " << I[i]->NTx << ", NDs: " << I[i]->NDs << ", nPasses: " << Npasses << "\n";
 
@@ -425,6 +1342,10 @@ void Scene::pipelinesAndDescriptorSetsInit() {
 //std::cout << "DSs for pass " << ipas << ": " << I[i]->NDs[ipas] << "\n";
 			I[i]->DS[ipas] = (DescriptorSet **)calloc(I[i]->NDs[ipas], sizeof(DescriptorSet *));
 			for(int j = 0; j < I[i]->NDs[ipas]; j++) {
+				if(isShared((*I[i]->D[ipas])[j])) {
+					I[i]->DS[ipas][j] = SharedDS[(*I[i]->D[ipas])[j]];
+					continue;
+				}
 				std::vector<VkDescriptorImageInfo> Tids = {};
 				TechniqueRef *Tr = I[i]->TIp->T;
 				int ntxs = Tr->PT[ipas].texDefs[j].size();
@@ -458,13 +1379,20 @@ void Scene::pipelinesAndDescriptorSetsCleanup() {
 	for(int i = 0; i < InstanceCount; i++) {
 		for(int ipas = 0; ipas < Npasses; ipas++) {
 			for(int j = 0; j < I[i]->NDs[ipas]; j++) {
-				I[i]->DS[ipas][j]->cleanup();
-				delete I[i]->DS[ipas][j];
+				if(!isShared((*I[i]->D[ipas])[j])) {
+					I[i]->DS[ipas][j]->cleanup();
+					delete I[i]->DS[ipas][j];
+				}
 			}
 			free(I[i]->DS[ipas]);
 		}
 		free(I[i]->DS);
 	}
+	for(auto &SDS : SharedDS) {
+		SDS.second->cleanup();
+		delete SDS.second;
+	}
+	SharedDS.clear();
 }
 
 void Scene::localCleanup() {
@@ -490,36 +1418,246 @@ void Scene::localCleanup() {
 	
 	// To add: delete the also the datastructure relative to the pipeline
 	for(int i = 0; i < TechniqueInstanceCount; i++) {
+		if(TI[i].T->instanced) {
+			vkDestroyBuffer(BP->device, TI[i].instanceBuffer, nullptr);
+			BP->memoryAllocator.free(TI[i].instanceBufferMemory);
+			for(int b = 0; b < TI[i].BatchCount; b++) {
+				free(TI[i].B[b].Iids);
+			}
+			free(TI[i].B);
+		}
 		free(TI[i].I);
 	}
 	free(TI);
+
+	if(gpuCulling) {
+		vkDestroyPipeline(BP->device, gpuPipeline, nullptr);
+		vkDestroyPipelineLayout(BP->device, gpuPipelineLayout, nullptr);
+		vkDestroyDescriptorPool(BP->device, gpuPool, nullptr);
+		vkDestroyDescriptorSetLayout(BP->device, gpuSetLayout, nullptr);
+		vkDestroyBuffer(BP->device, gpuInstanceBuffer, nullptr);
+		BP->memoryAllocator.free(gpuInstanceMemory);
+		vkDestroyBuffer(BP->device, gpuBatchBuffer, nullptr);
+		BP->memoryAllocator.free(gpuBatchMemory);
+		vkDestroyBuffer(BP->device, gpuCommandBuffer, nullptr);
+		BP->memoryAllocator.free(gpuCommandMemory);
+		vkDestroyBuffer(BP->device, gpuOutputBuffer, nullptr);
+		BP->memoryAllocator.free(gpuOutputMemory);
+		gpuCulling = false;
+	}
+
+	for(int i = 0; i < secondaryPools.size(); i++) {
+		vkDestroyCommandPool(BP->device, secondaryPools[i].pool, nullptr);
+	}
+	secondaryPools.clear();
 }
 
-void Scene::populateCommandBuffer(VkCommandBuffer commandBuffer, int passId, int currentImage) {
+void Scene::checkPass(int passId) {
 	if(passId >= Npasses) {
 		std::cout << "Scene Error: requested a pass too high in scene : " << passId << " >= " << Npasses << "\n";
 		exit(0);
 	}
-	
-std::cout << "Generating draw calls for pass " << passId << "\n";
-	for(int k = 0; k < TechniqueInstanceCount; k++) {
-std::cout << "Considering technique " << k << "\n";
-		Pipeline *P = TI[k].T->PT[passId].P;
-		if(P != nullptr) {
+}
+
+void Scene::populateCommandBuffer(VkCommandBuffer commandBuffer, int passId, int currentImage) {
+	checkPass(passId);
+	bindStats = {0, 0, 0, 0};
+	recordDraws(commandBuffer, 0, drawList.size(), passId, currentImage, bindStats);
+}
+
+void Scene::recordDraws(VkCommandBuffer commandBuffer, int first, int last, int passId, int currentImage, BindStats &stats) {
+	Pipeline *boundP = nullptr;
+	VkBuffer boundVB = VK_NULL_HANDLE;
+	VkBuffer boundIB = VK_NULL_HANDLE;
+	DescriptorSet *boundDS[maxSets];
+
+	for(int d = first; d < last; d++) {
+		TechniqueInstances &Ti = TI[drawList[d].technique];
+		Pipeline *P = Ti.T->PT[passId].P;
+		if(P == nullptr) {
+			continue;
+		}
+
+		Instance *Inst;
+		int instanceCount;
+		if(Ti.T->instanced) {
+			InstanceBatch &Bt = Ti.B[drawList[d].item];
+			if(!Ti.gpuDriven && (Bt.visibleCount == 0)) {
+				continue;
+			}
+			Inst = &Ti.I[Bt.leader];
+			instanceCount = Bt.visibleCount;
+		} else {
+			Inst = &Ti.I[drawList[d].item];
+			if(!Inst->visible) {
+				continue;
+			}
+			instanceCount = 1;
+		}
+
+		if(P != boundP) {
 			P->bind(commandBuffer);
-			for(int i = 0; i < TI[k].InstanceCount; i++) {
+			stats.pipelines++;
+			boundP = P;
+			// sets bound with the layout of another pipeline are bound again
+			for(int j = 0; j < P->D.size(); j++) {
+				boundDS[j] = nullptr;
+			}
+		}
 
-std::cout << "Drawing Instance " << i << "\n";
-				M[TI[k].I[i].Mid]->bind(commandBuffer);
-				for(int j = 0; j < TI[k].I[i].NDs[passId]; j++) {
-std::cout << "Binding DS: set " << j << "\n";
-					TI[k].I[i].DS[passId][j]->bind(commandBuffer, *P, j, currentImage);
-				}
-std::cout << "Draw Call\n";
-				vkCmdDrawIndexed(commandBuffer,
-						static_cast<uint32_t>(M[TI[k].I[i].Mid]->indices.size()), 1, 0, 0, 0);
+		// models in the same page of a geometry pool share their buffers
+		Model *Md = M[Inst->Mid];
+		if((Md->vertexBuffer != boundVB) || (Md->indexBuffer != boundIB)) {
+			Md->bind(commandBuffer, currentImage);
+			stats.buffers += 2;
+			boundVB = Md->vertexBuffer;
+			boundIB = Md->indexBuffer;
+		}
+		if(Ti.gpuDriven) {
+			InstanceBatch &Bt = Ti.B[drawList[d].item];
+			VkDeviceSize offsets[] = {(gpuSlotCount * (currentImage % gpuRegions) + Ti.gpuSlotBase + Bt.first) *
+									  sizeof(InstanceTransform)};
+			vkCmdBindVertexBuffers(commandBuffer, 1, 1, &gpuOutputBuffer, offsets);
+			stats.buffers++;
+		} else if(Ti.T->instanced) {
+			InstanceBatch &Bt = Ti.B[drawList[d].item];
+			VkDeviceSize offsets[] = {Ti.instanceRegionStride * (currentImage % Ti.instanceRegions) +
+									  Bt.first * sizeof(InstanceTransform)};
+			vkCmdBindVertexBuffers(commandBuffer, 1, 1, &Ti.instanceBuffer, offsets);
+			stats.buffers++;
+		}
+
+		for(int j = 0; j < P->D.size(); j++) {
+			DescriptorSet *DS = isShared(P->D[j]) ? getSharedSet(P->D[j]) : Inst->DS[passId][j];
+			if(DS != boundDS[j]) {
+				DS->bind(commandBuffer, *P, j, currentImage);
+				stats.descriptorSets++;
+				boundDS[j] = DS;
+			}
+		}
+
+		if(Ti.gpuDriven) {
+			// the instance count has been written by the culling compute shader
+			VkDeviceSize command = gpuCommandStride * (currentImage % gpuRegions) + gpuCounters * sizeof(uint32_t) +
+								   (Ti.gpuBatchBase + drawList[d].item) * sizeof(VkDrawIndexedIndirectCommand);
+			vkCmdDrawIndexedIndirect(commandBuffer, gpuCommandBuffer, command, 1, sizeof(VkDrawIndexedIndirectCommand));
+		} else {
+			vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(Md->indices.size()), instanceCount,
+							 Md->firstIndex, Md->vertexOffset, 0);
+		}
+		stats.draws++;
+	}
+}
+
+void Scene::initParallelRecording(JobSystem *_jobs) {
+	jobs = _jobs;
+	recordingThreads = (jobs == nullptr) ? 1 : jobs->getThreadCount();
+
+	QueueFamilyIndices queueFamilyIndices = BP->findQueueFamilies(BP->physicalDevice);
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+	// command pools are externally synchronized: every thread records with its own pool
+	secondaryPools.resize(MAX_FRAMES_IN_FLIGHT * recordingThreads);
+	for(int i = 0; i < secondaryPools.size(); i++) {
+		secondaryPools[i].cb.clear();
+		secondaryPools[i].used = 0;
+		VkResult result = vkCreateCommandPool(BP->device, &poolInfo, nullptr, &secondaryPools[i].pool);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create secondary command pool!");
+		}
+	}
+}
+
+VkCommandBuffer Scene::beginSecondary(SecondaryCommandPool &SP, RenderPass *RP, int currentImage) {
+	if(SP.used == SP.cb.size()) {
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = SP.pool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		allocInfo.commandBufferCount = 1;
+
+		VkCommandBuffer cb;
+		VkResult result = vkAllocateCommandBuffers(BP->device, &allocInfo, &cb);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to allocate secondary command buffer!");
+		}
+		SP.cb.push_back(cb);
+	}
+	VkCommandBuffer cb = SP.cb[SP.used++];
+
+	VkCommandBufferInheritanceInfo inheritanceInfo{};
+	inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritanceInfo.renderPass = RP->renderPass;
+	inheritanceInfo.subpass = 0;
+	inheritanceInfo.framebuffer = RP->frameBuffers[currentImage];
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+					  VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+	beginInfo.pInheritanceInfo = &inheritanceInfo;
+	if (vkBeginCommandBuffer(cb, &beginInfo) != VK_SUCCESS) {
+		throw std::runtime_error("failed to begin recording secondary command buffer!");
+	}
+	return cb;
+}
+
+void Scene::populateCommandBufferParallel(VkCommandBuffer commandBuffer, RenderPass *RP, int passId, int currentImage) {
+	checkPass(passId);
+	if(secondaryPools.empty()) {
+		initParallelRecording(nullptr);
+	}
+
+	// the fence of this frame has been waited, so its command buffers can be reused
+	int frame = BP->currentFrame;
+	for(int t = 0; t < recordingThreads; t++) {
+		SecondaryCommandPool &SP = secondaryPools[frame * recordingThreads + t];
+		vkResetCommandPool(BP->device, SP.pool, 0);
+		SP.used = 0;
+	}
+
+	// the draw list is split in chunks: executing them in order gives the draws of populateCommandBuffer(),
+	// whatever thread recorded them. Each chunk starts with no state bound, so it binds it again
+	recordingChunks.clear();
+	int count = drawList.size();
+	for(int first = 0; first < count; first += recordingChunkSize) {
+		recordingChunks.push_back({first, std::min(count, first + recordingChunkSize), VK_NULL_HANDLE, {0, 0, 0, 0}});
+	}
+
+	auto recordChunks = [&](size_t begin, size_t end) {
+		int thread = (jobs == nullptr) ? 0 : JobSystem::getThreadIndex();
+		SecondaryCommandPool &SP = secondaryPools[frame * recordingThreads + thread];
+		for(size_t c = begin; c < end; c++) {
+			RecordingChunk &RC = recordingChunks[c];
+			RC.cb = beginSecondary(SP, RP, currentImage);
+			recordDraws(RC.cb, RC.first, RC.last, passId, currentImage, RC.stats);
+			if (vkEndCommandBuffer(RC.cb) != VK_SUCCESS) {
+				throw std::runtime_error("failed to record secondary command buffer!");
 			}
 		}
+	};
+	if(jobs == nullptr) {
+		recordChunks(0, recordingChunks.size());
+	} else {
+		jobs->parallelFor(recordingChunks.size(), 1, recordChunks);
+	}
+
+	bindStats = {0, 0, 0, 0};
+	recordedChunks.resize(recordingChunks.size());
+	for(int c = 0; c < recordingChunks.size(); c++) {
+		recordedChunks[c] = recordingChunks[c].cb;
+		bindStats.pipelines += recordingChunks[c].stats.pipelines;
+		bindStats.descriptorSets += recordingChunks[c].stats.descriptorSets;
+		bindStats.buffers += recordingChunks[c].stats.buffers;
+		bindStats.draws += recordingChunks[c].stats.draws;
+	}
+	if(!recordedChunks.empty()) {
+		vkCmdExecuteCommands(commandBuffer, static_cast<uint32_t>(recordedChunks.size()), recordedChunks.data());
 	}
 }
 
@@ -16,6 +16,8 @@
 #include <chrono>
 #include <unordered_map>
 #include <map>
+#include <limits>
+#include <filesystem>
 
 #ifdef STARTER_IMPLEMENTATION
 // to allow splitting header and implementation
@@ -108,6 +110,130 @@ std::vector<char> readFile(const std::string& filename);
 
 class BaseProject;
 
+// Device memory is taken from the driver in large blocks, with one pool of blocks for each memory type,
+// strategy and kind of resource, and every buffer and image is bound to a part of a block.
+// Long lived resources (models, textures, attachments, uniforms) use a buddy allocator, that splits
+// a block in halves down to the size of the request, and merges the halves again when they are freed.
+// Transient resources (staging buffers, screenshots) use a linear allocator: a block is filled in order,
+// and starts again from the beginning when all its allocations have been freed.
+// Buffers and linear images never share a block with optimal images, so bufferImageGranularity
+// does not need to be considered. Requests larger than half a block get their own device memory.
+enum MemoryStrategy {MEMORY_LONG_LIVED, MEMORY_TRANSIENT};
+
+struct MemoryAllocation {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	// host visible memory is mapped once, when its block is allocated
+	unsigned char *mapped = nullptr;
+	int pool = -1;		// -1 for dedicated device memory
+	int block = -1;
+	int order = 0;		// size of a buddy allocation: minSize << order
+};
+
+struct MemoryStats {
+	int blocks = 0;
+	int dedicated = 0;
+	int allocations = 0;			// live allocations, in blocks or dedicated
+	VkDeviceSize blockBytes = 0;	// device memory taken by the blocks
+	VkDeviceSize dedicatedBytes = 0;
+	VkDeviceSize bytesInUse = 0;	// requested by the live allocations
+	VkDeviceSize bytesFree = 0;		// that the blocks can still give
+	VkDeviceSize largestFree = 0;	// largest request the blocks can still satisfy
+	
+	// share of the free memory of the blocks that is not available to a single request
+	float fragmentation() {
+		return bytesFree == 0 ? 0.0f : 1.0f - (float)largestFree / (float)bytesFree;
+	}
+};
+
+class DeviceMemoryAllocator {
+	struct Block {
+		VkDeviceMemory memory;
+		unsigned char *mapped;
+		int live;
+		VkDeviceSize used;
+		// buddy: offsets of the free parts, for each order
+		std::vector<std::set<VkDeviceSize>> freeParts;
+		// linear: first byte after the last allocation
+		VkDeviceSize top;
+	};
+	struct Pool {
+		uint32_t memoryType;
+		MemoryStrategy strategy;
+		bool linearResources;
+		VkDeviceSize blockSize;
+		int orders;
+		std::vector<Block *> blocks;	// nullptr for blocks given back to the driver
+	};
+
+	BaseProject *BP;
+	VkPhysicalDeviceMemoryProperties memProperties;
+	uint32_t maxAllocations;
+	int deviceAllocations;
+	int dedicated;
+	VkDeviceSize dedicatedBytes;
+	std::vector<Pool> pools;
+	
+	int findPool(uint32_t memoryType, MemoryStrategy strategy, bool linearResources);
+	VkDeviceMemory allocateDeviceMemory(VkDeviceSize size, uint32_t memoryType, unsigned char **mapped);
+	int newBlock(Pool &P);
+	bool allocateBuddy(Block *B, Pool &P, int order, VkDeviceSize &offset);
+	void freeBlock(Block *B);
+
+	public:
+	// smallest part of a block given by the buddy allocator
+	static const VkDeviceSize minSize = 256;
+	// blocks are smaller only on small heaps
+	static const VkDeviceSize defaultBlockSize = 64 << 20;
+
+	void init(BaseProject *bp);
+	// linearResource is true for buffers and for images with linear tiling
+	void allocate(const VkMemoryRequirements &req, VkMemoryPropertyFlags properties,
+				  bool linearResource, MemoryStrategy strategy, MemoryAllocation &A);
+	void free(MemoryAllocation &A);
+	MemoryStats getStats();
+	void cleanup();
+};
+
+class Model;
+
+// Shared vertex and index buffers of the static models of a vertex format. The models are placed one
+// after the other in pages of device local memory, and are drawn at the firstIndex and vertexOffset
+// of their range: consecutive draws of models in the same page need no new buffer binds.
+// A page is given back when all its models have been cleaned up.
+class GeometryPool {
+	struct Page {
+		VkBuffer vertexBuffer = VK_NULL_HANDLE;	// VK_NULL_HANDLE for released pages
+		MemoryAllocation vertexMemory;
+		VkBuffer indexBuffer = VK_NULL_HANDLE;
+		MemoryAllocation indexMemory;
+		VkDeviceSize vertexCapacity = 0;	// bytes
+		VkDeviceSize vertexUsed = 0;
+		VkDeviceSize indexCapacity = 0;		// indices
+		VkDeviceSize indexUsed = 0;
+		int models = 0;
+	};
+
+	BaseProject *BP = nullptr;
+	std::vector<Page> pages;
+
+	void createPage(Page &Pg, VkDeviceSize vertexBytes, VkDeviceSize indexCount);
+	void destroyPage(Page &Pg);
+
+	public:
+	// models larger than this get a page of their own size
+	static const VkDeviceSize pageVertexBytes = 8 << 20;
+	static const VkDeviceSize pageIndices = 1 << 19;
+
+	// places the vertices and the indices of the model, and uploads them through the staging ring
+	void add(BaseProject *bp, Model *M, uint32_t stride);
+	void release(Model *M);
+	int getPageCount();
+	int getModelCount();
+	void cleanup();
+};
+
 struct VertexBindingDescriptorElement {
 	uint32_t binding;
 	uint32_t stride;
@@ -144,6 +270,9 @@ struct VertexDescriptor {
 
 	std::vector<VertexBindingDescriptorElement> Bindings;
 	std::vector<VertexDescriptorElement> Layout;
+	// bindings advanced once per vertex: the models of formats with only one share the buffers of the pool
+	int vertexBindings = 0;
+	GeometryPool pool;
  	
  	void init(BaseProject *bp, std::vector<VertexBindingDescriptorElement> B, std::vector<VertexDescriptorElement> E);
 	void cleanup();
@@ -158,19 +287,41 @@ enum ModelType {OBJ, GLTF, MGCG};
 class AssetFile;
 
 class Model {
+	friend class GeometryPool;
+	friend class Scene;
+	
 	BaseProject *BP;
 	
 	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
+	MemoryAllocation vertexBufferMemory;
 	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
+	MemoryAllocation indexBufferMemory;
+	// the buffers belong to the pool, when the model is in one
+	GeometryPool *pool = nullptr;
+	int poolPage = -1;
+
+	// dynamic vertex buffers hold one persistently mapped region per swap chain image
+	int dynamicRegions = 0;
+	VkDeviceSize dynamicRegionStride = 0;
+	unsigned char *dynamicMapped = nullptr;
 
 	public:
 	VertexDescriptor *VD;
 	size_t vertexBufferSize   = 0;
+	// meshes rebuilt at run time keep their buffers in host visible memory, written directly by the CPU.
+	// The others are copied into device local memory through the staging ring
+	bool hostVisible = false;
+	// where the model starts in the buffers it is bound with: to be passed to vkCmdDrawIndexed()
+	uint32_t firstIndex = 0;
+	int32_t vertexOffset = 0;
 	glm::mat4 Wm;
 	std::vector<unsigned char> vertices{};
 	std::vector<uint32_t> indices{};
+	// bounding sphere of the vertices in object space, computed when the model is loaded.
+	// A negative radius means that the vertex format has no position to compute it from
+	glm::vec3 boundsCenter = glm::vec3(0.0f);
+	float boundsRadius = -1.0f;
+	void computeBounds();
 	void loadModelOBJ(std::string file);
 	void makeOBJMesh(const tinyobj::shape_t *M, const tinyobj::attrib_t *A);
 	static void getGLTFnodeTransforms(const tinygltf::Node *N, glm::vec3 &T, glm::vec3 &S, glm::quat &Q);
@@ -179,14 +330,18 @@ class Model {
 	void loadModelGLTF(std::string file, bool encoded);
 	void createIndexBuffer();
 	void createVertexBuffer();
+	// places static models in the geometry pool of their vertex format, when they can share it
+	void createBuffers();
 	void updateVertexBuffer();
+	void updateVertexBuffer(int currentImage);
 	void initDynamicVertexBuffer(BaseProject *bp, size_t byteSize);
+	unsigned char *getDynamicVertexRegion(int currentImage);
 
 	void init(BaseProject *bp, VertexDescriptor *VD, std::string file, ModelType MT);
 	void initFromAsset(BaseProject *bp, VertexDescriptor *VD, AssetFile *AF, std::string AN, int Mid = 0, std::string NN = "");
 	void initMesh(BaseProject *bp, VertexDescriptor *VD, bool printDebug = true);
 	void cleanup();
-  	void bind(VkCommandBuffer commandBuffer);
+  	void bind(VkCommandBuffer commandBuffer, int currentImage = 0);
 };
 
 class AssetFile {
@@ -217,7 +372,7 @@ struct Texture {
 	BaseProject *BP;
 	uint32_t mipLevels;
 	VkImage textureImage;
-	VkDeviceMemory textureImageMemory;
+	MemoryAllocation textureImageMemory;
 	VkImageView textureImageView;
 	VkSampler textureSampler;
 	int imgs;
@@ -288,7 +443,7 @@ struct FrameBufferAttachment {
 	RenderPass *RP;
 	
 	VkImage image;
-	VkDeviceMemory mem;
+	MemoryAllocation mem;
 	VkImageView view;
 	AttachmentProperties *properties;
 	
@@ -345,7 +500,8 @@ struct RenderPass {
 
   	void init(BaseProject *bp, int w = -1, int h = -1, int _count = -1, std::vector <AttachmentProperties> *p = nullptr, std::vector<VkSubpassDependency> *d = nullptr, bool initSampler = false);
 	void create();
-	void begin(VkCommandBuffer commandBuffer, int currentImage);
+	// contents = VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS if the pass is drawn by secondary command buffers
+	void begin(VkCommandBuffer commandBuffer, int currentImage, VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
 	void end(VkCommandBuffer commandBuffer);
 	void cleanup();
 	void destroy();
@@ -392,15 +548,90 @@ struct Pipeline {
 	void cleanup();
 };
 
+// Persistently mapped buffer holding all the uniform blocks, with one region per swap chain image.
+// Every uniform block of a descriptor set gets the same offset in all the regions, and the region
+// of the current image is selected with a dynamic offset when the set is bound.
+// It lives as long as the descriptor pool, and is sized from DPSZs.
+struct UniformArena {
+	BaseProject *BP;
+	
+	VkBuffer buffer;
+	MemoryAllocation memory;
+	unsigned char *mapped;
+	VkDeviceSize alignment;
+	VkDeviceSize regionSize;
+	VkDeviceSize used;
+	int regions;
+
+	void init(BaseProject *bp, VkDeviceSize bytes);
+	// returns the offset of a new uniform block inside each region
+	VkDeviceSize allocate(VkDeviceSize size);
+	VkDeviceSize regionOffset(int currentImage) {
+		return regionSize * (currentImage % regions);
+	}
+	void cleanup();
+};
+
+// Host visible buffer through which the static meshes are copied into device local memory.
+// The copies are recorded in a single command buffer, submitted when the ring is full or when
+// flush() is called: loading a scene uploads all its meshes with a few submissions.
+// Uploads larger than the ring are split in chunks.
+struct StagingRing {
+	BaseProject *BP;
+	
+	VkBuffer buffer;
+	MemoryAllocation memory;
+	VkDeviceSize size;
+	VkDeviceSize used;
+	VkCommandBuffer commandBuffer;	// VK_NULL_HANDLE when no copy is pending
+	
+	// cumulative since init()
+	int submissions;
+	int copies;
+	VkDeviceSize uploadedBytes;
+
+	void init(BaseProject *bp, VkDeviceSize ringSize);
+	// the copy is complete, and visible to the vertex input, after the next flush()
+	void upload(VkBuffer dst, VkDeviceSize dstOffset, const void *src, VkDeviceSize bytes);
+	void flush();
+	void cleanup();
+};
+
+// VkPipelineCache shared by all the pipelines, loaded from file when the device is created and saved
+// by cleanup(). A file written by another GPU or driver is discarded: its header must match the vendor,
+// the device and the pipelineCacheUUID of the physical device, which changes with the driver build.
+struct PipelineCache {
+	BaseProject *BP;
+	
+	VkPipelineCache cache;
+	std::string file;
+	size_t loadedBytes;	// 0 if the cache started empty
+	
+	// cumulative since init(): pipelines created through the cache, and the time spent creating them
+	int pipelines;
+	double createSeconds;
+
+	void init(BaseProject *bp, std::string _file);
+	// adds the time of a vkCreate*Pipelines call, started at start
+	void addTiming(std::chrono::high_resolution_clock::time_point start);
+	void save();
+	void cleanup();
+	
+	private:
+	bool isValid(const std::vector<char> &data);
+};
+
 struct DescriptorSet {
 	BaseProject *BP;
 
-	std::vector<std::vector<VkBuffer>> uniformBuffers;
-	std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemory;
-	std::vector<VkDescriptorSet> descriptorSets;
+	// one descriptor set for all the swap chain images: the uniform blocks are dynamic,
+	// and their offsets in UniformArena are given at bind time
+	VkDescriptorSet descriptorSet;
+	std::vector<VkDeviceSize> uniformOffsets;	// for each binding, in the uniform arena regions
+	int uniformBlocks;
+	// the minimum value of maxDescriptorSetUniformBuffersDynamic guaranteed by Vulkan
+	static const int maxUniformBlocks = 8;
 	DescriptorSetLayout *Layout;
-	
-	std::vector<bool> toFree;
 
 	void init(BaseProject *bp, DescriptorSetLayout *L,
 						 std::vector<VkDescriptorImageInfo>VaSs);
@@ -412,6 +643,7 @@ struct DescriptorSet {
 
 struct PoolSizes {
 	int uniformBlocksInPool = 0;
+	int uniformBytesInPool = 0;	// sum of the sizes of the uniform blocks, to size UniformArena
 	int texturesInPool = 0;
 	int setsInPool = 0;
 };
@@ -438,6 +670,17 @@ struct NamedCommandBufferVersions {
 	std::vector<NamedCommandBuffer *>old;
 };
 
+// Command buffer recorded again every frame, for the passes whose draws change from frame to frame.
+// It has one command buffer for each frame in flight, allocated from the command pool of that frame
+struct FrameCommandBuffer {
+	std::string name;
+	int order;
+	pNCBfunc filler;
+	void *params;
+
+	std::vector<VkCommandBuffer> cb;
+};
+
 // MAIN ! 
 class BaseProject {
 	friend class VertexDescriptor;
@@ -448,6 +691,13 @@ class BaseProject {
 	friend class Pipeline;
 	friend class DescriptorSetLayout;
 	friend class DescriptorSet;
+	friend class UniformArena;
+	friend class StagingRing;
+	friend class PipelineCache;
+	friend class GeometryPool;
+	friend class DeviceMemoryAllocator;
+	friend class Scene;
+	friend class ImpostorAtlas;
 
 public:
 	virtual void setWindowParameters() = 0;
@@ -473,6 +723,9 @@ protected:
 	VkCommandPool commandPool;
 	
 	std::unordered_map<std::string, NamedCommandBufferVersions> namedCommandBuffers = {};
+	// one pool for each frame in flight, reset as a whole when the frame starts again
+	std::vector<VkCommandPool> frameCommandPools;
+	std::vector<FrameCommandBuffer> frameCommandBuffers = {};
 	
 	VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
 	
@@ -483,6 +736,10 @@ protected:
 	std::vector<VkImageView> swapChainImageViews;
 		
  	VkDescriptorPool descriptorPool;
+	UniformArena uniformArena;
+	DeviceMemoryAllocator memoryAllocator;
+	StagingRing stagingRing;
+	PipelineCache pipelineCache;
 
 	VkDebugUtilsMessengerEXT debugMessenger;
 
@@ -493,6 +750,12 @@ protected:
 	std::vector<VkSemaphore> renderFinishedSemaphores;
 	std::vector<VkFence> inFlightFences;
 	std::vector<VkFence> imagesInFlight;
+	// The buffers written by the host every frame (dynamic vertex buffers, instance buffers) have one region
+	// per image of the first swap chain, and image i uses region i % imageRegions. They are not resized when
+	// the swap chain is recreated: if the new one has more images, drawFrame() makes the images sharing
+	// a region wait for each other, through the fence of the last frame that used it
+	int imageRegions = 0;
+	std::vector<VkFence> regionsInFlight;
 	
     void initWindow();
 
@@ -560,7 +823,8 @@ protected:
 				 VkImageTiling tiling, VkImageUsageFlags usage,
 				 VkImageCreateFlags cflags,
 				 VkMemoryPropertyFlags properties, VkImage& image,
-				 VkDeviceMemory& imageMemory);	
+				 MemoryAllocation& imageMemory,
+				 MemoryStrategy strategy = MEMORY_LONG_LIVED);	
 	void generateMipmaps(VkImage image, VkFormat imageFormat,
 					 int32_t texWidth, int32_t texHeight,
 					 uint32_t mipLevels, int layerCount);
@@ -573,13 +837,16 @@ protected:
 	void endSingleTimeCommands(VkCommandBuffer commandBuffer);
 	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 				  VkMemoryPropertyFlags properties,
-				  VkBuffer& buffer, VkDeviceMemory& bufferMemory);
+				  VkBuffer& buffer, MemoryAllocation& bufferMemory,
+				  MemoryStrategy strategy = MEMORY_LONG_LIVED);
 	uint32_t findMemoryType(uint32_t typeFilter,
 						VkMemoryPropertyFlags properties);
 	void createDescriptorPool();
 						
 	public:
 	void submitCommandBuffer(std::string name, int order, pNCBfunc populateNewCommandBuffer, void *params, pNCBfree onErase = nullptr);
+	// populateCommandBuffer will be called every frame, instead of once per swap chain image
+	void submitFrameCommandBuffer(std::string name, int order, pNCBfunc populateCommandBuffer, void *params);
 
 	protected:
 	void removeBuffer(std::string name);
@@ -590,6 +857,7 @@ protected:
 	void createSyncObjects();
 	void mainLoop();
 	void createCommandBuffer(NamedCommandBuffer *ncb, int imageIndex);
+	void recordFrameCommandBuffer(FrameCommandBuffer &fcb, int imageIndex);
 	void updateCommandBuffers(std::vector<VkCommandBuffer> &buffers, int imageIndex);
 	void drawFrame();
 	
@@ -805,14 +1073,22 @@ void BaseProject::initVulkan() {
 	createSurface();				
 	pickPhysicalDevice();			
 	createLogicalDevice();			
+	memoryAllocator.init(this);
+	pipelineCache.init(this, "pipeline.cache");
 	createSwapChain();				
+	imageRegions = (int)swapChainImages.size();
 	createImageViews();				
 
 	createCommandPool();			
+	stagingRing.init(this, 8 << 20);
 	localInit();
+	stagingRing.flush();
 
 	createDescriptorPool();			
 	pipelinesAndDescriptorSetsInit();
+std::cout << "Pipelines: " << pipelineCache.pipelines << " created in " <<
+			 (int)(pipelineCache.createSeconds * 1000.0 + 0.5) << " ms, with a" <<
+			 ((pipelineCache.loadedBytes > 0) ? " warm" : " cold") << " pipeline cache\n";
 
 //		createCommandBuffers();			
 	createSyncObjects();			 
@@ -1370,6 +1646,17 @@ void BaseProject::createCommandPool() {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create command pool!");
 	}
+
+	// the command buffers recorded every frame are short lived
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	frameCommandPools.resize(MAX_FRAMES_IN_FLIGHT);
+	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+		result = vkCreateCommandPool(device, &poolInfo, nullptr, &frameCommandPools[i]);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create frame command pool!");
+		}
+	}
 }
 
 
@@ -1411,7 +1698,8 @@ void BaseProject::createImage(uint32_t width, uint32_t height,
 				 VkImageTiling tiling, VkImageUsageFlags usage,
 				 VkImageCreateFlags cflags,
 				 VkMemoryPropertyFlags properties, VkImage& image,
-				 VkDeviceMemory& imageMemory) {		
+				 MemoryAllocation& imageMemory,
+				 MemoryStrategy strategy) {		
 	VkImageCreateInfo imageInfo{};
 	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 	imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1437,17 +1725,10 @@ void BaseProject::createImage(uint32_t width, uint32_t height,
 	VkMemoryRequirements memRequirements;
 	vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits,
-										properties);
-	if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) !=
-							VK_SUCCESS) {
-		throw std::runtime_error("failed to allocate image memory!");
-	}
+	memoryAllocator.allocate(memRequirements, properties,
+							 tiling == VK_IMAGE_TILING_LINEAR, strategy, imageMemory);
 
-	vkBindImageMemory(device, image, imageMemory, 0);
+	vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
 }
 
 void BaseProject::generateMipmaps(VkImage image, VkFormat imageFormat,
@@ -1653,7 +1934,8 @@ void BaseProject::endSingleTimeCommands(VkCommandBuffer commandBuffer) {
 
 void BaseProject::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 				  VkMemoryPropertyFlags properties,
-				  VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+				  VkBuffer& buffer, MemoryAllocation& bufferMemory,
+				  MemoryStrategy strategy) {
 	VkBufferCreateInfo bufferInfo{};
 	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	bufferInfo.size = size;
@@ -1670,20 +1952,9 @@ void BaseProject::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 	VkMemoryRequirements memRequirements;
 	vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 	
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex =
-			findMemoryType(memRequirements.memoryTypeBits, properties);
-
-	result = vkAllocateMemory(device, &allocInfo, nullptr,
-			&bufferMemory);
-	if (result != VK_SUCCESS) {
-		PrintVkError(result);
-		throw std::runtime_error("failed to allocate vertex buffer memory!");
-	}
+	memoryAllocator.allocate(memRequirements, properties, true, strategy, bufferMemory);
 	
-	vkBindBufferMemory(device, buffer, bufferMemory, 0);
+	vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);
 }
 
 uint32_t BaseProject::findMemoryType(uint32_t typeFilter,
@@ -1702,18 +1973,294 @@ uint32_t BaseProject::findMemoryType(uint32_t typeFilter,
 	throw std::runtime_error("failed to find suitable memory type!");
 }
 
+void DeviceMemoryAllocator::init(BaseProject *bp) {
+	BP = bp;
+	vkGetPhysicalDeviceMemoryProperties(BP->physicalDevice, &memProperties);
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	maxAllocations = properties.limits.maxMemoryAllocationCount;
+
+	deviceAllocations = 0;
+	dedicated = 0;
+	dedicatedBytes = 0;
+	pools.clear();
+}
+
+int DeviceMemoryAllocator::findPool(uint32_t memoryType, MemoryStrategy strategy, bool linearResources) {
+	for(int i = 0; i < pools.size(); i++) {
+		if((pools[i].memoryType == memoryType) && (pools[i].strategy == strategy) &&
+		   (pools[i].linearResources == linearResources)) {
+			return i;
+		}
+	}
+	
+	Pool P;
+	P.memoryType = memoryType;
+	P.strategy = strategy;
+	P.linearResources = linearResources;
+	// at most an eighth of the heap, and always a power of two for the buddy allocator
+	VkDeviceSize heapSize = memProperties.memoryHeaps[memProperties.memoryTypes[memoryType].heapIndex].size;
+	P.blockSize = defaultBlockSize;
+	while((P.blockSize > minSize * 1024) && (P.blockSize > heapSize / 8)) {
+		P.blockSize /= 2;
+	}
+	P.orders = 1;
+	while((minSize << (P.orders - 1)) < P.blockSize) {
+		P.orders++;
+	}
+	pools.push_back(P);
+	return (int)pools.size() - 1;
+}
+
+VkDeviceMemory DeviceMemoryAllocator::allocateDeviceMemory(VkDeviceSize size, uint32_t memoryType,
+														   unsigned char **mapped) {
+	if(deviceAllocations >= maxAllocations) {
+		std::cout << "Device memory allocations exceeding maxMemoryAllocationCount (" << maxAllocations << ")\n";
+		throw std::runtime_error("too many device memory allocations!");
+	}
+	
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = size;
+	allocInfo.memoryTypeIndex = memoryType;
+
+	VkDeviceMemory memory;
+	VkResult result = vkAllocateMemory(BP->device, &allocInfo, nullptr, &memory);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate device memory!");
+	}
+	deviceAllocations++;
+
+	*mapped = nullptr;
+	if(memProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		result = vkMapMemory(BP->device, memory, 0, VK_WHOLE_SIZE, 0, (void **)mapped);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to map device memory!");
+		}
+	}
+	return memory;
+}
+
+int DeviceMemoryAllocator::newBlock(Pool &P) {
+	Block *B = new Block;
+	B->memory = allocateDeviceMemory(P.blockSize, P.memoryType, &B->mapped);
+	B->live = 0;
+	B->used = 0;
+	B->top = 0;
+	if(P.strategy == MEMORY_LONG_LIVED) {
+		B->freeParts.resize(P.orders);
+		B->freeParts[P.orders - 1].insert(0);
+	}
+
+	for(int i = 0; i < P.blocks.size(); i++) {
+		if(P.blocks[i] == nullptr) {
+			P.blocks[i] = B;
+			return i;
+		}
+	}
+	P.blocks.push_back(B);
+	return (int)P.blocks.size() - 1;
+}
+
+bool DeviceMemoryAllocator::allocateBuddy(Block *B, Pool &P, int order, VkDeviceSize &offset) {
+	int o = order;
+	while((o < P.orders) && B->freeParts[o].empty()) {
+		o++;
+	}
+	if(o == P.orders) {
+		return false;
+	}
+	
+	offset = *B->freeParts[o].begin();
+	B->freeParts[o].erase(B->freeParts[o].begin());
+	// splits the part, keeping the lower halves and freeing the upper ones
+	while(o > order) {
+		o--;
+		B->freeParts[o].insert(offset + (minSize << o));
+	}
+	return true;
+}
+
+void DeviceMemoryAllocator::allocate(const VkMemoryRequirements &req, VkMemoryPropertyFlags properties,
+				bool linearResource, MemoryStrategy strategy, MemoryAllocation &A) {
+	uint32_t memoryType = BP->findMemoryType(req.memoryTypeBits, properties);
+	int p = findPool(memoryType, strategy, linearResource);
+	Pool &P = pools[p];
+	
+	A.size = req.size;
+	if(req.size > P.blockSize / 2) {
+		A.memory = allocateDeviceMemory(req.size, memoryType, &A.mapped);
+		A.offset = 0;
+		A.pool = -1;
+		A.block = -1;
+		dedicated++;
+		dedicatedBytes += req.size;
+		return;
+	}
+
+	VkDeviceSize offset = 0;
+	int b = -1;
+	if(strategy == MEMORY_LONG_LIVED) {
+		// alignments are powers of two, and parts are aligned to their size
+		A.order = 0;
+		while((minSize << A.order) < std::max(req.size, req.alignment)) {
+			A.order++;
+		}
+		for(int i = 0; i < P.blocks.size(); i++) {
+			if((P.blocks[i] != nullptr) && allocateBuddy(P.blocks[i], P, A.order, offset)) {
+				b = i;
+				break;
+			}
+		}
+		if(b < 0) {
+			b = newBlock(P);
+			allocateBuddy(P.blocks[b], P, A.order, offset);
+		}
+	} else {
+		for(int i = 0; i < P.blocks.size(); i++) {
+			if(P.blocks[i] != nullptr) {
+				offset = (P.blocks[i]->top + req.alignment - 1) / req.alignment * req.alignment;
+				if(offset + req.size <= P.blockSize) {
+					b = i;
+					break;
+				}
+			}
+		}
+		if(b < 0) {
+			b = newBlock(P);
+			offset = 0;
+		}
+		P.blocks[b]->top = offset + req.size;
+	}
+
+	Block *B = P.blocks[b];
+	B->live++;
+	B->used += req.size;
+	A.memory = B->memory;
+	A.offset = offset;
+	A.mapped = B->mapped == nullptr ? nullptr : B->mapped + offset;
+	A.pool = p;
+	A.block = b;
+}
+
+void DeviceMemoryAllocator::freeBlock(Block *B) {
+	vkFreeMemory(BP->device, B->memory, nullptr);
+	deviceAllocations--;
+	delete B;
+}
+
+void DeviceMemoryAllocator::free(MemoryAllocation &A) {
+	if(A.memory == VK_NULL_HANDLE) {
+		return;
+	}
+	
+	if(A.pool < 0) {
+		vkFreeMemory(BP->device, A.memory, nullptr);
+		deviceAllocations--;
+		dedicated--;
+		dedicatedBytes -= A.size;
+	} else {
+		Pool &P = pools[A.pool];
+		Block *B = P.blocks[A.block];
+		B->live--;
+		B->used -= A.size;
+		
+		if(P.strategy == MEMORY_LONG_LIVED) {
+			// merges the part with its buddy, as long as the buddy is free as well
+			VkDeviceSize offset = A.offset;
+			int o = A.order;
+			while(o < P.orders - 1) {
+				VkDeviceSize buddy = offset ^ (minSize << o);
+				auto it = B->freeParts[o].find(buddy);
+				if(it == B->freeParts[o].end()) {
+					break;
+				}
+				B->freeParts[o].erase(it);
+				offset = std::min(offset, buddy);
+				o++;
+			}
+			B->freeParts[o].insert(offset);
+		} else if(B->live == 0) {
+			B->top = 0;
+		}
+		
+		// empty blocks are given back to the driver, but the last one of each pool is kept
+		if(B->live == 0) {
+			int blocks = 0;
+			for(int i = 0; i < P.blocks.size(); i++) {
+				blocks += (P.blocks[i] != nullptr) ? 1 : 0;
+			}
+			if(blocks > 1) {
+				freeBlock(B);
+				P.blocks[A.block] = nullptr;
+			}
+		}
+	}
+	A = MemoryAllocation();
+}
+
+MemoryStats DeviceMemoryAllocator::getStats() {
+	MemoryStats S;
+	S.dedicated = dedicated;
+	S.dedicatedBytes = dedicatedBytes;
+	S.allocations = dedicated;
+	S.bytesInUse = dedicatedBytes;
+	
+	for(Pool &P : pools) {
+		for(Block *B : P.blocks) {
+			if(B == nullptr) {
+				continue;
+			}
+			S.blocks++;
+			S.blockBytes += P.blockSize;
+			S.allocations += B->live;
+			S.bytesInUse += B->used;
+			if(P.strategy == MEMORY_LONG_LIVED) {
+				for(int o = 0; o < P.orders; o++) {
+					if(!B->freeParts[o].empty()) {
+						S.bytesFree += B->freeParts[o].size() * (minSize << o);
+						S.largestFree = std::max(S.largestFree, minSize << o);
+					}
+				}
+			} else {
+				S.bytesFree += P.blockSize - B->top;
+				S.largestFree = std::max(S.largestFree, P.blockSize - B->top);
+			}
+		}
+	}
+	return S;
+}
+
+void DeviceMemoryAllocator::cleanup() {
+	for(Pool &P : pools) {
+		for(Block *B : P.blocks) {
+			if(B != nullptr) {
+				freeBlock(B);
+			}
+		}
+	}
+	pools.clear();
+	if(deviceAllocations > 0) {
+		std::cout << "WARNING: " << deviceAllocations << " device memory allocations not freed\n";
+	}
+}
+
 void BaseProject::createDescriptorPool() {
+	// descriptor sets are shared by all the swap chain images
 	std::array<VkDescriptorPoolSize, 2> poolSizes{};
-	poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	poolSizes[0].descriptorCount = static_cast<uint32_t>(DPSZs.uniformBlocksInPool * swapChainImages.size());
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	poolSizes[0].descriptorCount = static_cast<uint32_t>(DPSZs.uniformBlocksInPool);
 	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-	poolSizes[1].descriptorCount = static_cast<uint32_t>(DPSZs.texturesInPool * swapChainImages.size());
+	poolSizes[1].descriptorCount = static_cast<uint32_t>(DPSZs.texturesInPool);
 														 
 	VkDescriptorPoolCreateInfo poolInfo{};
 	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());;
 	poolInfo.pPoolSizes = poolSizes.data();
-	poolInfo.maxSets = static_cast<uint32_t>(DPSZs.setsInPool * swapChainImages.size());
+	poolInfo.maxSets = static_cast<uint32_t>(DPSZs.setsInPool);
 	
 	VkResult result = vkCreateDescriptorPool(device, &poolInfo, nullptr,
 								&descriptorPool);
@@ -1721,6 +2268,8 @@ void BaseProject::createDescriptorPool() {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create descriptor pool!");
 	}
+
+	uniformArena.init(this, DPSZs.uniformBytesInPool);
 }
 
 void BaseProject::submitCommandBuffer(std::string name, int order, pNCBfunc populateNewCommandBuffer, void *params, pNCBfree onErase) {
@@ -1748,6 +2297,12 @@ void BaseProject::submitCommandBuffer(std::string name, int order, pNCBfunc popu
 	}
 }
 
+void BaseProject::submitFrameCommandBuffer(std::string name, int order, pNCBfunc populateCommandBuffer, void *params) {
+	FrameCommandBuffer fcb{name, order, populateCommandBuffer, params, {}};
+	fcb.cb.resize(MAX_FRAMES_IN_FLIGHT, VK_NULL_HANDLE);
+	frameCommandBuffers.push_back(fcb);
+}
+
 void BaseProject::removeBuffer(std::string name) {
 	auto found = namedCommandBuffers.find(name);
 	if(found != namedCommandBuffers.end()) {
@@ -1822,6 +2377,7 @@ void BaseProject::createSyncObjects() {
 	renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
 	inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
 	imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
+	regionsInFlight.resize(imageRegions, VK_NULL_HANDLE);
 			
 	VkSemaphoreCreateInfo semaphoreInfo{};
 	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -1910,9 +2466,47 @@ void BaseProject::createCommandBuffer(NamedCommandBuffer *ncb, int imageIndex) {
 	}
 }
 
+void BaseProject::recordFrameCommandBuffer(FrameCommandBuffer &fcb, int imageIndex) {
+	// the command buffer is allocated the first time, then it is reused after each reset of the pool
+	if(fcb.cb[currentFrame] == VK_NULL_HANDLE) {
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = frameCommandPools[currentFrame];
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = 1;
+		
+		VkResult result = vkAllocateCommandBuffers(device, &allocInfo, &fcb.cb[currentFrame]);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to allocate frame command buffer!");
+		}
+	}
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	beginInfo.pInheritanceInfo = nullptr;
+
+	if (vkBeginCommandBuffer(fcb.cb[currentFrame], &beginInfo) != VK_SUCCESS) {
+		throw std::runtime_error("failed to begin recording frame command buffer!");
+	}
+	fcb.filler(fcb.cb[currentFrame], imageIndex, fcb.params);
+	if (vkEndCommandBuffer(fcb.cb[currentFrame]) != VK_SUCCESS) {
+		throw std::runtime_error("failed to record frame command buffer!");
+	}
+}
+
 void BaseProject::updateCommandBuffers(std::vector<VkCommandBuffer> &buffers, int imageIndex) {
 	// Creation of newly submitted command buffers
 	std::map<int, VkCommandBuffer>sortedBuffer = {};
+
+	// The command buffers of the previous use of this frame are completed (its fence has been waited):
+	// the pool is reset, and they are recorded again
+	vkResetCommandPool(device, frameCommandPools[currentFrame], 0);
+	for(auto &fcb : frameCommandBuffers) {
+		recordFrameCommandBuffer(fcb, imageIndex);
+		sortedBuffer[fcb.order] = fcb.cb[currentFrame];
+	}
 	
 	for(auto &v : namedCommandBuffers) {
 //std::cout << "Considering buffer: " << v.first << "\n";
@@ -1987,8 +2581,15 @@ void BaseProject::drawFrame() {
 						VK_TRUE, UINT64_MAX);
 	}
 	imagesInFlight[imageIndex] = inFlightFences[currentFrame];
+	VkFence &regionFence = regionsInFlight[imageIndex % imageRegions];
+	if ((regionFence != VK_NULL_HANDLE) && (regionFence != inFlightFences[currentFrame])) {
+		vkWaitForFences(device, 1, &regionFence, VK_TRUE, UINT64_MAX);
+	}
+	regionFence = inFlightFences[currentFrame];
 	
 	updateUniformBuffer(imageIndex);
+	// meshes created while updating are uploaded before the frame uses them
+	stagingRing.flush();
 	
 	std::vector<VkCommandBuffer> buffers = {};
 	updateCommandBuffers(buffers, imageIndex);
@@ -2054,6 +2655,9 @@ void BaseProject::recreateSwapChain() {
 
 	createSwapChain();
 	createImageViews();
+	// the device is idle: no image and no region is in use
+	imagesInFlight.assign(swapChainImages.size(), VK_NULL_HANDLE);
+	regionsInFlight.assign(imageRegions, VK_NULL_HANDLE);
 
 	createDescriptorPool();			
 	pipelinesAndDescriptorSetsInit();
@@ -2073,6 +2677,7 @@ void BaseProject::cleanupSwapChain() {
 	vkDestroySwapchainKHR(device, swapChain, nullptr);
 
 	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+	uniformArena.cleanup();
 }
 	
 void BaseProject::cleanup() {
@@ -2087,7 +2692,13 @@ void BaseProject::cleanup() {
 	}
 	
 	vkDestroyCommandPool(device, commandPool, nullptr);
+	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+		vkDestroyCommandPool(device, frameCommandPools[i], nullptr);
+	}
 	
+	stagingRing.cleanup();
+	pipelineCache.cleanup();
+	memoryAllocator.cleanup();
 	vkDestroyDevice(device, nullptr);
 	
 	DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
@@ -2451,18 +3062,12 @@ void BaseProject::saveScreenshot(const char *filename, int currentBuffer) {
 	}
 	// Create memory to back up the image
 	VkMemoryRequirements memRequirements;
-	VkMemoryAllocateInfo memAllocInfo(vks_initializers_memoryAllocateInfo());
-	VkDeviceMemory dstImageMemory;
+	MemoryAllocation dstImageMemory;
 	vkGetImageMemoryRequirements(device, dstImage, &memRequirements);
-	memAllocInfo.allocationSize = memRequirements.size;
 	// Memory must be host visible to copy from
-	memAllocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-	result = vkAllocateMemory(device, &memAllocInfo, nullptr, &dstImageMemory);
-	if(result != VK_SUCCESS) {
-		PrintVkError(result);
-		throw std::runtime_error("failed to create screenshot!!");
-	}
-	result = vkBindImageMemory(device, dstImage, dstImageMemory, 0);
+	memoryAllocator.allocate(memRequirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+							 true, MEMORY_TRANSIENT, dstImageMemory);
+	result = vkBindImageMemory(device, dstImage, dstImageMemory.memory, dstImageMemory.offset);
 	if(result != VK_SUCCESS) {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create screenshot!!");
@@ -2573,8 +3178,7 @@ void BaseProject::saveScreenshot(const char *filename, int currentBuffer) {
 	vkGetImageSubresourceLayout(device, dstImage, &subResource, &subResourceLayout);
 
 	// Map image memory so we can start copying from it
-	const char* data;
-	vkMapMemory(device, dstImageMemory, 0, VK_WHOLE_SIZE, 0, (void**)&data);
+	const char* data = (const char *)dstImageMemory.mapped;
 	data += subResourceLayout.offset;
 
 	char *pixelArray;
@@ -2617,9 +3221,8 @@ void BaseProject::saveScreenshot(const char *filename, int currentBuffer) {
 	std::cout << "Screenshot saved to disk" << std::endl;
 
 	// Clean up resources
-	vkUnmapMemory(device, dstImageMemory);
-	vkFreeMemory(device, dstImageMemory, nullptr);
 	vkDestroyImage(device, dstImage, nullptr);
+	memoryAllocator.free(dstImageMemory);
 
 	screenshotSaved = true;
 }	
@@ -2641,7 +3244,15 @@ void VertexDescriptor::init(BaseProject *bp, std::vector<VertexBindingDescriptor
 	JointWeight.hasIt = false; JointWeight.offset = 0;
 	JointIndex.hasIt = false; JointIndex.offset = 0;
 	
-	if(B.size() <= 1) {	// for now, read models only with every vertex information in a single binding
+	// bindings advanced once per instance do not come from the models, and are not counted here
+	vertexBindings = 0;
+	for(int i = 0; i < B.size(); i++) {
+		if(B[i].inputRate == VK_VERTEX_INPUT_RATE_VERTEX) {
+			vertexBindings++;
+		}
+	}
+	
+	if(vertexBindings <= 1) {	// for now, read models only with every vertex information in a single binding
 		for(int i = 0; i < E.size(); i++) {
 			switch(E[i].usage) {
 			  case VertexDescriptorElementUsage::POSITION:
@@ -2745,11 +3356,12 @@ void VertexDescriptor::init(BaseProject *bp, std::vector<VertexBindingDescriptor
 			}
 		}
 	} else {
-		throw std::runtime_error("Vertex format with more than one binding is not supported yet\n");
+		throw std::runtime_error("Vertex format with more than one per vertex binding is not supported yet\n");
 	}
 }
 
 void VertexDescriptor::cleanup() {
+	pool.cleanup();
 }
 
 std::vector<VkVertexInputBindingDescription> VertexDescriptor::getBindingDescription() {
@@ -3290,60 +3902,91 @@ std::cout << model.nodes[0].scale.size() << "\n";
 	makeGLTFwm(&model.nodes[0]);
 }
 
+// A dynamic vertex buffer is written by the CPU every frame. It contains one region per swap chain
+// image (see BaseProject::imageRegions), and the command buffer of an image binds only its own region:
+// when updateUniformBuffer() runs for an image, the previous frame that used the same region has
+// completed, so it can be written in place without waiting for the GPU. The memory stays mapped for the whole
+// lifetime of the model.
 void Model::initDynamicVertexBuffer(BaseProject *bp, size_t byteSize) {
 	BP = bp;
 	vertexBufferSize = byteSize;
+	dynamicRegions = BP->imageRegions;
+	dynamicRegionStride = (byteSize + 255) & ~(VkDeviceSize)255;
 
 	// allocate once
 	BP->createBuffer(
-		vertexBufferSize,
+		dynamicRegionStride * dynamicRegions,
 		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 		vertexBuffer,
 		vertexBufferMemory
 	);
+	dynamicMapped = vertexBufferMemory.mapped;
 }
 
+unsigned char *Model::getDynamicVertexRegion(int currentImage) {
+	return dynamicMapped + dynamicRegionStride * (currentImage % dynamicRegions);
+}
+
+// copies the vertices into the regions of all the swap chain images
 void Model::updateVertexBuffer() {
-	// map & copy into the *existing* buffer
-	void* data = nullptr;
-	vkMapMemory(BP->device,
-				vertexBufferMemory,
-				0,
-				vertexBufferSize,
-				0,
-				&data);
-	memcpy(data, vertices.data(), vertexBufferSize);
-	vkUnmapMemory(BP->device, vertexBufferMemory);
+	for(int i = 0; i < dynamicRegions; i++) {
+		updateVertexBuffer(i);
+	}
+}
+
+void Model::updateVertexBuffer(int currentImage) {
+	memcpy(getDynamicVertexRegion(currentImage), vertices.data(), vertexBufferSize);
 }
 
 void Model::createVertexBuffer() {
 //	VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
 	VkDeviceSize bufferSize = vertices.size();
 
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
-						VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-						VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-						vertexBuffer, vertexBufferMemory);
+	if(hostVisible) {
+		BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
+							VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+							VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+							vertexBuffer, vertexBufferMemory);
 
-	void* data;
-	vkMapMemory(BP->device, vertexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, vertices.data(), (size_t) bufferSize);
-	vkUnmapMemory(BP->device, vertexBufferMemory);			
+		memcpy(vertexBufferMemory.mapped, vertices.data(), (size_t) bufferSize);
+	} else {
+		BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+							VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+							VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+							vertexBuffer, vertexBufferMemory);
+
+		BP->stagingRing.upload(vertexBuffer, 0, vertices.data(), bufferSize);
+	}
 }
 
 void Model::createIndexBuffer() {
 	VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
 
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-							 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-							 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-							 indexBuffer, indexBufferMemory);
+	if(hostVisible) {
+		BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+								 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+								 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+								 indexBuffer, indexBufferMemory);
 
-	void* data;
-	vkMapMemory(BP->device, indexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, indices.data(), (size_t) bufferSize);
-	vkUnmapMemory(BP->device, indexBufferMemory);
+		memcpy(indexBufferMemory.mapped, indices.data(), (size_t) bufferSize);
+	} else {
+		BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+								 VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+								 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+								 indexBuffer, indexBufferMemory);
+
+		BP->stagingRing.upload(indexBuffer, 0, indices.data(), bufferSize);
+	}
+}
+
+void Model::createBuffers() {
+	if(!hostVisible && (VD->vertexBindings == 1) && (VD->Bindings[0].inputRate == VK_VERTEX_INPUT_RATE_VERTEX)) {
+		VD->pool.add(BP, this, VD->Bindings[0].stride);
+	} else {
+		createVertexBuffer();
+		createIndexBuffer();
+	}
 }
 
 void Model::initMesh(BaseProject *bp, VertexDescriptor *vd, bool printDebug) {
@@ -3354,8 +3997,8 @@ void Model::initMesh(BaseProject *bp, VertexDescriptor *vd, bool printDebug) {
 		std::cout << "[Manual] Vertices: " << (vertices.size()/mainStride)
 				  << " Indices: " << indices.size() << "\n";
 	}
-	createVertexBuffer();
-	createIndexBuffer();
+	computeBounds();
+	createBuffers();
 	Wm = glm::mat4(1);
 }
 
@@ -3372,8 +4015,8 @@ void Model::init(BaseProject *bp, VertexDescriptor *vd, std::string file, ModelT
 		loadModelGLTF(file, true);
 	}
 	
-	createVertexBuffer();
-	createIndexBuffer();
+	computeBounds();
+	createBuffers();
 }
 
 void Model::initFromAsset(BaseProject *bp, VertexDescriptor *vd, AssetFile *AF, std::string AN, int Mid, std::string NN) {
@@ -3427,21 +4070,59 @@ void Model::initFromAsset(BaseProject *bp, VertexDescriptor *vd, AssetFile *AF,
 	    break;
 	}
 
-	createVertexBuffer();
-	createIndexBuffer();
+	computeBounds();
+	createBuffers();
+}
+
+// Sphere centered in the middle of the bounding box, with the radius of the farthest vertex
+void Model::computeBounds() {
+	int mainStride = VD->Bindings[0].stride;
+	int count = vertices.size() / mainStride;
+	if(!VD->Position.hasIt || (count == 0)) {
+		boundsCenter = glm::vec3(0.0f);
+		boundsRadius = -1.0f;
+		return;
+	}
+	
+	glm::vec3 bMin = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 bMax = glm::vec3(-std::numeric_limits<float>::max());
+	for(int i = 0; i < count; i++) {
+		glm::vec3 *pos = (glm::vec3 *)(&vertices[i * mainStride + VD->Position.offset]);
+		bMin = glm::min(bMin, *pos);
+		bMax = glm::max(bMax, *pos);
+	}
+	boundsCenter = (bMin + bMax) * 0.5f;
+	
+	float r2 = 0.0f;
+	for(int i = 0; i < count; i++) {
+		glm::vec3 *pos = (glm::vec3 *)(&vertices[i * mainStride + VD->Position.offset]);
+		glm::vec3 d = *pos - boundsCenter;
+		r2 = std::max(r2, glm::dot(d, d));
+	}
+	boundsRadius = std::sqrt(r2);
 }
 
 void Model::cleanup() {
+	if(pool != nullptr) {
+		pool->release(this);
+		pool = nullptr;
+		poolPage = -1;
+		firstIndex = 0;
+		vertexOffset = 0;
+		return;
+	}
    	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
-   	vkFreeMemory(BP->device, indexBufferMemory, nullptr);
+   	BP->memoryAllocator.free(indexBufferMemory);
+	dynamicMapped = nullptr;
 	vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
-   	vkFreeMemory(BP->device, vertexBufferMemory, nullptr);
+   	BP->memoryAllocator.free(vertexBufferMemory);
 }
 
-void Model::bind(VkCommandBuffer commandBuffer) {
+void Model::bind(VkCommandBuffer commandBuffer, int currentImage) {
 	VkBuffer vertexBuffers[] = {vertexBuffer};
 	// property .vertexBuffer of models, contains the VkBuffer handle to its vertex buffer
-	VkDeviceSize offsets[] = {0};
+	// (a dynamic vertex buffer is bound at the region of the current image)
+	VkDeviceSize offsets[] = {(dynamicRegions > 0) ? dynamicRegionStride * (currentImage % dynamicRegions) : 0};
 	vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
 	// property .indexBuffer of models, contains the VkBuffer handle to its index buffer
 	vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0,
@@ -3453,6 +4134,107 @@ void Model::bind(VkCommandBuffer commandBuffer) {
 
 
 
+void GeometryPool::createPage(Page &Pg, VkDeviceSize vertexBytes, VkDeviceSize indexCount) {
+	BP->createBuffer(vertexBytes, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+					 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, Pg.vertexBuffer, Pg.vertexMemory);
+	BP->createBuffer(indexCount * sizeof(uint32_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+					 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, Pg.indexBuffer, Pg.indexMemory);
+	Pg.vertexCapacity = vertexBytes;
+	Pg.vertexUsed = 0;
+	Pg.indexCapacity = indexCount;
+	Pg.indexUsed = 0;
+	Pg.models = 0;
+}
+
+void GeometryPool::destroyPage(Page &Pg) {
+	vkDestroyBuffer(BP->device, Pg.vertexBuffer, nullptr);
+	BP->memoryAllocator.free(Pg.vertexMemory);
+	vkDestroyBuffer(BP->device, Pg.indexBuffer, nullptr);
+	BP->memoryAllocator.free(Pg.indexMemory);
+	Pg = Page();
+}
+
+void GeometryPool::add(BaseProject *bp, Model *M, uint32_t stride) {
+	BP = bp;
+	VkDeviceSize vertexBytes = M->vertices.size();
+	VkDeviceSize indexCount = M->indices.size();
+	
+	// vertexOffset counts vertices: every model starts at a multiple of the stride
+	int p = -1;
+	VkDeviceSize vertexStart = 0;
+	for(int i = 0; i < pages.size(); i++) {
+		if(pages[i].vertexBuffer != VK_NULL_HANDLE) {
+			vertexStart = (pages[i].vertexUsed + stride - 1) / stride * stride;
+			if((vertexStart + vertexBytes <= pages[i].vertexCapacity) &&
+			   (pages[i].indexUsed + indexCount <= pages[i].indexCapacity)) {
+				p = i;
+				break;
+			}
+		}
+	}
+	if(p < 0) {
+		for(p = 0; (p < pages.size()) && (pages[p].vertexBuffer != VK_NULL_HANDLE); p++) {
+		}
+		if(p == pages.size()) {
+			pages.push_back(Page());
+		}
+		createPage(pages[p], std::max(pageVertexBytes, vertexBytes), std::max(pageIndices, indexCount));
+		vertexStart = 0;
+	}
+	
+	Page &Pg = pages[p];
+	BP->stagingRing.upload(Pg.vertexBuffer, vertexStart, M->vertices.data(), vertexBytes);
+	BP->stagingRing.upload(Pg.indexBuffer, Pg.indexUsed * sizeof(uint32_t), M->indices.data(),
+						   indexCount * sizeof(uint32_t));
+	
+	M->pool = this;
+	M->poolPage = p;
+	M->vertexBuffer = Pg.vertexBuffer;
+	M->indexBuffer = Pg.indexBuffer;
+	M->vertexOffset = (int32_t)(vertexStart / stride);
+	M->firstIndex = (uint32_t)Pg.indexUsed;
+	
+	Pg.vertexUsed = vertexStart + vertexBytes;
+	Pg.indexUsed += indexCount;
+	Pg.models++;
+}
+
+void GeometryPool::release(Model *M) {
+	if(M->poolPage >= pages.size()) {
+		return;
+	}
+	Page &Pg = pages[M->poolPage];
+	Pg.models--;
+	if(Pg.models == 0) {
+		destroyPage(Pg);
+	}
+}
+
+int GeometryPool::getPageCount() {
+	int count = 0;
+	for(int i = 0; i < pages.size(); i++) {
+		count += (pages[i].vertexBuffer != VK_NULL_HANDLE) ? 1 : 0;
+	}
+	return count;
+}
+
+int GeometryPool::getModelCount() {
+	int count = 0;
+	for(int i = 0; i < pages.size(); i++) {
+		count += pages[i].models;
+	}
+	return count;
+}
+
+void GeometryPool::cleanup() {
+	for(int i = 0; i < pages.size(); i++) {
+		if(pages[i].vertexBuffer != VK_NULL_HANDLE) {
+			destroyPage(pages[i]);
+		}
+	}
+	pages.clear();
+}
+
 void Texture::createTextureImage(std::vector<std::string>files, VkFormat Fmt) {
 	int texWidth, texHeight, texChannels;
 	int curWidth = -1, curHeight = -1, curChannels = -1;
@@ -3487,19 +4269,16 @@ void Texture::createTextureImage(std::vector<std::string>files, VkFormat Fmt) {
 					std::log2(std::max(texWidth, texHeight)))) + 1;
 	
 	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
+	MemoryAllocation stagingBufferMemory;
 	 
 	BP->createBuffer(totalImageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 	  						VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 	  						VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-	  						stagingBuffer, stagingBufferMemory);
-	void* data;
-	vkMapMemory(BP->device, stagingBufferMemory, 0, totalImageSize, 0, &data);
+	  						stagingBuffer, stagingBufferMemory, MEMORY_TRANSIENT);
 	for(int i = 0; i < imgs; i++) {
-		memcpy(static_cast<char *>(data) + imageSize * i, pixels[i], static_cast<size_t>(imageSize));
+		memcpy(stagingBufferMemory.mapped + imageSize * i, pixels[i], static_cast<size_t>(imageSize));
 		stbi_image_free(pixels[i]);
 	}
-	vkUnmapMemory(BP->device, stagingBufferMemory);
 	
 	
 	BP->createImage(texWidth, texHeight, mipLevels, imgs, VK_SAMPLE_COUNT_1_BIT, Fmt,
@@ -3518,7 +4297,7 @@ void Texture::createTextureImage(std::vector<std::string>files, VkFormat Fmt) {
 					texWidth, texHeight, mipLevels, imgs);
 
 	vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
-	vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
+	BP->memoryAllocator.free(stagingBufferMemory);
 }
 
 void Texture::createTextureImageView(VkFormat Fmt) {
@@ -3597,7 +4376,7 @@ void Texture::cleanup() {
    	vkDestroySampler(BP->device, textureSampler, nullptr);
    	vkDestroyImageView(BP->device, textureImageView, nullptr);
 	vkDestroyImage(BP->device, textureImage, nullptr);
-	vkFreeMemory(BP->device, textureImageMemory, nullptr);
+	BP->memoryAllocator.free(textureImageMemory);
 }
 
 
@@ -3714,7 +4493,7 @@ void FrameBufferAttachment::cleanup() {
 	if(!properties->swapChain) {
 		vkDestroyImageView(BP->device, view, nullptr);
 		vkDestroyImage(BP->device, image, nullptr);
-		vkFreeMemory(BP->device, mem, nullptr);
+		BP->memoryAllocator.free(mem);
 	}
 }
 
@@ -3775,10 +4554,18 @@ void RenderPass::createRenderPass() {
 		}
 	}
 	
+	// the references of the color attachments must be contiguous, in the order of the attachments
+	std::vector<VkAttachmentReference> colorRefs;
+	for(int j = 0; j < attachments.size(); j++) {
+		if(attachments[j].properties->type == COLOR_AT) {
+			colorRefs.push_back(attachments[j].ref);
+		}
+	}
+
 	VkSubpassDescription subpass{};
 	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
 	subpass.colorAttachmentCount = colorAttchementsCount;
-	subpass.pColorAttachments = &attachments[firstColorAttIdx].ref;
+	subpass.pColorAttachments = colorRefs.data();
 	if(depthAttIdx >= 0) {
 		subpass.pDepthStencilAttachment = &attachments[depthAttIdx].ref;
 	}
@@ -3853,7 +4640,7 @@ void RenderPass::create() {
 	createFramebuffers();
 }
 
-void RenderPass::begin(VkCommandBuffer commandBuffer, int currentImage) {
+void RenderPass::begin(VkCommandBuffer commandBuffer, int currentImage, VkSubpassContents contents) {
 	clearValues.resize(properties.size());
 	for(int i = 0; i < properties.size(); i++) {
 		clearValues[i] = properties[i].clearValue;
@@ -3870,8 +4657,7 @@ void RenderPass::begin(VkCommandBuffer commandBuffer, int currentImage) {
 					static_cast<uint32_t>(clearValues.size());
 	renderPassInfo.pClearValues = clearValues.data();
 	
-	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
-			VK_SUBPASS_CONTENTS_INLINE);
+	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, contents);
 }
 
 void RenderPass::end(VkCommandBuffer commandBuffer) {
@@ -4259,8 +5045,11 @@ void Pipeline::create(RenderPass *RP) {
 			VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
 	colorBlending.logicOpEnable = VK_FALSE;
 	colorBlending.logicOp = VK_LOGIC_OP_COPY; // Optional
-	colorBlending.attachmentCount = 1;
-	colorBlending.pAttachments = &colorBlendAttachment;
+	// all the color attachments of the pass are written the same way
+	std::vector<VkPipelineColorBlendAttachmentState> colorBlendAttachments(std::max(RP->colorAttchementsCount, 1),
+																		   colorBlendAttachment);
+	colorBlending.attachmentCount = static_cast<uint32_t>(colorBlendAttachments.size());
+	colorBlending.pAttachments = colorBlendAttachments.data();
 	colorBlending.blendConstants[0] = 0.0f; // Optional
 	colorBlending.blendConstants[1] = 0.0f; // Optional
 	colorBlending.blendConstants[2] = 0.0f; // Optional
@@ -4319,8 +5108,10 @@ void Pipeline::create(RenderPass *RP) {
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 	pipelineInfo.basePipelineIndex = -1; // Optional
 	
-	result = vkCreateGraphicsPipelines(BP->device, VK_NULL_HANDLE, 1,
+	auto start = std::chrono::high_resolution_clock::now();
+	result = vkCreateGraphicsPipelines(BP->device, BP->pipelineCache.cache, 1,
 			&pipelineInfo, nullptr, &graphicsPipeline);
+	BP->pipelineCache.addTiming(start);
 	if (result != VK_SUCCESS) {
 	 	PrintVkError(result);
 		throw std::runtime_error("failed to create graphics pipeline!");
@@ -4372,7 +5163,9 @@ void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutB
 	binds.resize(B.size());
 	for(int i = 0; i < B.size(); i++) {
 		binds[i].binding = B[i].binding;
-		binds[i].descriptorType = B[i].type;
+		// uniform blocks are always read from UniformArena
+		binds[i].descriptorType = (B[i].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) ?
+								  VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC : B[i].type;
 		binds[i].descriptorCount = B[i].count;
 		binds[i].stageFlags = B[i].flags;
 		binds[i].pImmutableSamplers = nullptr;
@@ -4407,126 +5200,301 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 	int imgInfoSize = DSL->imgInfoSize;
 //std::cout << "imgInfoSize: " << imgInfoSize << "(" << size << ")\n";
 	
-	uniformBuffers.resize(size);
-	uniformBuffersMemory.resize(size);
-	toFree.resize(size);
+	uniformOffsets.resize(size);
+	uniformBlocks = 0;
 
 	for (int j = 0; j < size; j++) {
-		uniformBuffers[j].resize(BP->swapChainImages.size());
-		uniformBuffersMemory[j].resize(BP->swapChainImages.size());
 //std::cout << j << " " << (DSL->Bindings[j].type) << "\n";
 		if(DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
 //std::cout << "Uniform size: " << DSL->Bindings[j].linkSize << "\n";
-			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-				VkDeviceSize bufferSize = DSL->Bindings[j].linkSize;
-				BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-									 	 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-									 	 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-									 	 uniformBuffers[j][i], uniformBuffersMemory[j][i]);
+			uniformOffsets[j] = BP->uniformArena.allocate(DSL->Bindings[j].linkSize);
+			if(++uniformBlocks > maxUniformBlocks) {
+				throw std::runtime_error("too many uniform blocks in a descriptor set!");
 			}
-			toFree[j] = true;
 		} else {
-			toFree[j] = false;
+			uniformOffsets[j] = 0;
 		}
 	}
 	
-	std::vector<VkDescriptorSetLayout> layouts(BP->swapChainImages.size(),
-											   DSL->descriptorSetLayout);
 	VkDescriptorSetAllocateInfo allocInfo{};
 	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 	allocInfo.descriptorPool = BP->descriptorPool;
-	allocInfo.descriptorSetCount = static_cast<uint32_t>(BP->swapChainImages.size());
-	allocInfo.pSetLayouts = layouts.data();
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &DSL->descriptorSetLayout;
 //std::cout << "Allocating\n";	
-	descriptorSets.resize(BP->swapChainImages.size());
 	
 	VkResult result = vkAllocateDescriptorSets(BP->device, &allocInfo,
-										descriptorSets.data());
+										&descriptorSet);
 	if (result != VK_SUCCESS) {
 		PrintVkError(result);
 		throw std::runtime_error("failed to allocate descriptor sets!");
 	}
 	
-	for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-//std::cout << "Consdering swap chain image " << i << "\n";	
-
-		std::vector<VkWriteDescriptorSet> descriptorWrites(size);
-		std::vector<VkDescriptorBufferInfo> bufferInfo(size);
-		std::vector<VkDescriptorImageInfo> imageInfo(imgInfoSize);
-		for (int j = 0; j < size; j++) {
+	std::vector<VkWriteDescriptorSet> descriptorWrites(size);
+	std::vector<VkDescriptorBufferInfo> bufferInfo(size);
+	std::vector<VkDescriptorImageInfo> imageInfo(imgInfoSize);
+	for (int j = 0; j < size; j++) {
 //std::cout << "Consdering binding " << j << "\n";	
-			if(DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+		if(DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
 //std::cout << "Writing uniform buffer " << j <<"\n";			
-				bufferInfo[j].buffer = uniformBuffers[j][i];
-				bufferInfo[j].offset = 0;
-				bufferInfo[j].range = DSL->Bindings[j].linkSize;
-				
-				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				descriptorWrites[j].dstSet = descriptorSets[i];
-				descriptorWrites[j].dstBinding = DSL->Bindings[j].binding;
-				descriptorWrites[j].dstArrayElement = 0;
-				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-				descriptorWrites[j].descriptorCount = DSL->Bindings[j].count;
-				descriptorWrites[j].pBufferInfo = &bufferInfo[j];
-			} else if(DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER) {
+			// the offset of the block is part of the dynamic offset
+			bufferInfo[j].buffer = BP->uniformArena.buffer;
+			bufferInfo[j].offset = 0;
+			bufferInfo[j].range = DSL->Bindings[j].linkSize;
+			
+			descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			descriptorWrites[j].dstSet = descriptorSet;
+			descriptorWrites[j].dstBinding = DSL->Bindings[j].binding;
+			descriptorWrites[j].dstArrayElement = 0;
+			descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+			descriptorWrites[j].descriptorCount = DSL->Bindings[j].count;
+			descriptorWrites[j].pBufferInfo = &bufferInfo[j];
+		} else if(DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER) {
 //std::cout << "Writing combined image sampler " << j << ", count " << DSL->Bindings[j].count << ", link " << DSL->Bindings[j].linkSize << "\n";
-				for(int k = 0; k < DSL->Bindings[j].count; k++) {
-					int h = DSL->Bindings[j].linkSize + k;
+			for(int k = 0; k < DSL->Bindings[j].count; k++) {
+				int h = DSL->Bindings[j].linkSize + k;
 //std::cout << k << " " << h << " " << (&VaSs[h]) << "\n";
-					VkDescriptorImageInfo VaS = VaSs[h];
-//std::cout << VaS.imageView << " " << VaS.sampler << "\n";
-					imageInfo[h] = VaS;
-/*					imageInfo[h].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-					imageInfo[h].imageView = VaS.textureImageView;
-					imageInfo[h].sampler = VaS.textureSampler;
-*/				}
-//std::cout << "Writing descriptor sets\n";			
-				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				descriptorWrites[j].dstSet = descriptorSets[i];
-				descriptorWrites[j].dstBinding = DSL->Bindings[j].binding;
-				descriptorWrites[j].dstArrayElement = 0;
-				descriptorWrites[j].descriptorType =
-											VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-				descriptorWrites[j].descriptorCount = DSL->Bindings[j].count;
-				descriptorWrites[j].pImageInfo = &imageInfo[DSL->Bindings[j].linkSize];
+				imageInfo[h] = VaSs[h];
 			}
-		}		
+//std::cout << "Writing descriptor sets\n";			
+			descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			descriptorWrites[j].dstSet = descriptorSet;
+			descriptorWrites[j].dstBinding = DSL->Bindings[j].binding;
+			descriptorWrites[j].dstArrayElement = 0;
+			descriptorWrites[j].descriptorType =
+										VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+			descriptorWrites[j].descriptorCount = DSL->Bindings[j].count;
+			descriptorWrites[j].pImageInfo = &imageInfo[DSL->Bindings[j].linkSize];
+		}
+	}		
 //std::cout << "Updating descriptor sets\n";	
-		vkUpdateDescriptorSets(BP->device,
-						static_cast<uint32_t>(descriptorWrites.size()),
-						descriptorWrites.data(), 0, nullptr);
-	}
+	vkUpdateDescriptorSets(BP->device,
+					static_cast<uint32_t>(descriptorWrites.size()),
+					descriptorWrites.data(), 0, nullptr);
 }
 
 void DescriptorSet::cleanup() {
-	for(int j = 0; j < uniformBuffers.size(); j++) {
-		if(toFree[j]) {
-			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-				vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
-				vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
-			}
-		}
-	}
+	// the descriptor set goes with the pool, and the uniform blocks with the arena
 }
 
 void DescriptorSet::bind(VkCommandBuffer commandBuffer, Pipeline &P, int setId,
 						 int currentImage) {
-//std::cout << "DS[ci]: " << &descriptorSets[currentImage] << "\n";
+	// dynamic offsets follow the binding order of the uniform blocks in the layout
+	uint32_t dynamicOffsets[maxUniformBlocks];
+	VkDeviceSize base = BP->uniformArena.regionOffset(currentImage);
+	int d = 0;
+	for(int j = 0; j < Layout->Bindings.size(); j++) {
+		if(Layout->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+			dynamicOffsets[d++] = static_cast<uint32_t>(base + uniformOffsets[j]);
+		}
+	}
 	vkCmdBindDescriptorSets(commandBuffer,
 					VK_PIPELINE_BIND_POINT_GRAPHICS,
-					P.pipelineLayout, setId, 1, &descriptorSets[currentImage],
-					0, nullptr);
+					P.pipelineLayout, setId, 1, &descriptorSet,
+					static_cast<uint32_t>(uniformBlocks), dynamicOffsets);
 }
 
 void DescriptorSet::map(int currentImage, void *src, int slot) {
-	void* data;
-
 	int size = Layout->Bindings[slot].linkSize;
 
-	vkMapMemory(BP->device, uniformBuffersMemory[slot][currentImage], 0,
-						size, 0, &data);
-	memcpy(data, src, size);
-	vkUnmapMemory(BP->device, uniformBuffersMemory[slot][currentImage]);	
+	memcpy(BP->uniformArena.mapped + BP->uniformArena.regionOffset(currentImage) + uniformOffsets[slot],
+		   src, size);
+}
+
+void StagingRing::init(BaseProject *bp, VkDeviceSize ringSize) {
+	BP = bp;
+	size = ringSize;
+	used = 0;
+	commandBuffer = VK_NULL_HANDLE;
+	submissions = 0;
+	copies = 0;
+	uploadedBytes = 0;
+
+	BP->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 buffer, memory);
+}
+
+void StagingRing::upload(VkBuffer dst, VkDeviceSize dstOffset, const void *src, VkDeviceSize bytes) {
+	const unsigned char *data = (const unsigned char *)src;
+	
+	while(bytes > 0) {
+		if(used == size) {
+			flush();
+		}
+		if(commandBuffer == VK_NULL_HANDLE) {
+			commandBuffer = BP->beginSingleTimeCommands();
+		}
+		
+		VkDeviceSize chunk = std::min(bytes, size - used);
+		memcpy(memory.mapped + used, data, (size_t)chunk);
+		
+		VkBufferCopy region{};
+		region.srcOffset = used;
+		region.dstOffset = dstOffset;
+		region.size = chunk;
+		vkCmdCopyBuffer(commandBuffer, buffer, dst, 1, &region);
+		
+		used += chunk;
+		data += chunk;
+		dstOffset += chunk;
+		bytes -= chunk;
+		uploadedBytes += chunk;
+		copies++;
+	}
+}
+
+void StagingRing::flush() {
+	if(commandBuffer == VK_NULL_HANDLE) {
+		return;
+	}
+	
+	VkMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+						 VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+						 1, &barrier, 0, nullptr, 0, nullptr);
+
+	// waits for the copies, so the ring can be filled again from the start
+	BP->endSingleTimeCommands(commandBuffer);
+	commandBuffer = VK_NULL_HANDLE;
+	used = 0;
+	submissions++;
+}
+
+void StagingRing::cleanup() {
+	flush();
+	vkDestroyBuffer(BP->device, buffer, nullptr);
+	BP->memoryAllocator.free(memory);
+}
+
+void PipelineCache::init(BaseProject *bp, std::string _file) {
+	BP = bp;
+	file = _file;
+	loadedBytes = 0;
+	pipelines = 0;
+	createSeconds = 0.0;
+
+	std::vector<char> data;
+	std::ifstream in(file, std::ios::ate | std::ios::binary);
+	if(in.is_open()) {
+		data.resize((size_t)in.tellg());
+		in.seekg(0);
+		in.read(data.data(), data.size());
+		if(!in || !isValid(data)) {
+std::cout << "Pipeline cache " << file << " discarded: it belongs to another device or driver\n";
+			data.clear();
+		}
+	}
+
+	VkPipelineCacheCreateInfo cacheInfo{};
+	cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	cacheInfo.initialDataSize = data.size();
+	cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+	VkResult result = vkCreatePipelineCache(BP->device, &cacheInfo, nullptr, &cache);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create pipeline cache!");
+	}
+	loadedBytes = data.size();
+std::cout << "Pipeline cache: " << loadedBytes << " bytes loaded from " << file << "\n";
+}
+
+// The header of the data, as defined by VkPipelineCacheHeaderVersionOne:
+// header size, header version, vendor ID and device ID (uint32), then the pipeline cache UUID
+bool PipelineCache::isValid(const std::vector<char> &data) {
+	const size_t headerSize = 4 * sizeof(uint32_t) + VK_UUID_SIZE;
+	if(data.size() < headerSize) {
+		return false;
+	}
+	uint32_t header[4];
+	memcpy(header, data.data(), sizeof(header));
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	return (header[0] >= headerSize) &&
+		   (header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE) &&
+		   (header[2] == properties.vendorID) &&
+		   (header[3] == properties.deviceID) &&
+		   (memcmp(data.data() + sizeof(header), properties.pipelineCacheUUID, VK_UUID_SIZE) == 0);
+}
+
+void PipelineCache::addTiming(std::chrono::high_resolution_clock::time_point start) {
+	auto end = std::chrono::high_resolution_clock::now();
+	createSeconds += std::chrono::duration<double>(end - start).count();
+	pipelines++;
+}
+
+// The file is written under a temporary name and then renamed, so that an interrupted
+// save never leaves a truncated cache behind. std::filesystem::rename replaces an existing
+// cache on every platform, std::rename fails on Windows when the target exists
+void PipelineCache::save() {
+	size_t size = 0;
+	VkResult result = vkGetPipelineCacheData(BP->device, cache, &size, nullptr);
+	std::vector<char> data(size);
+	if((result == VK_SUCCESS) && (size > 0)) {
+		result = vkGetPipelineCacheData(BP->device, cache, &size, data.data());
+	}
+	if((result != VK_SUCCESS) || (size == 0)) {
+		std::cout << "WARNING: pipeline cache not saved\n";
+		return;
+	}
+	
+	std::string tmp = file + ".tmp";
+	std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+	out.write(data.data(), size);
+	out.close();
+	std::error_code error;
+	if(out) {
+		std::filesystem::rename(tmp, file, error);
+	}
+	if(!out || error) {
+		std::remove(tmp.c_str());
+		std::cout << "WARNING: pipeline cache not saved to " << file << "\n";
+		return;
+	}
+std::cout << "Pipeline cache: " << size << " bytes saved to " << file << "\n";
+}
+
+void PipelineCache::cleanup() {
+	save();
+	vkDestroyPipelineCache(BP->device, cache, nullptr);
+}
+
+void UniformArena::init(BaseProject *bp, VkDeviceSize bytes) {
+	BP = bp;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	alignment = properties.limits.minUniformBufferOffsetAlignment;
+
+	// room for the padding of each block
+	regions = (int)BP->swapChainImages.size();
+	regionSize = bytes + BP->DPSZs.uniformBlocksInPool * alignment;
+	regionSize = (regionSize + alignment - 1) / alignment * alignment;
+	used = 0;
+
+	BP->createBuffer(std::max(regionSize * regions, (VkDeviceSize)alignment),
+					 VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 buffer, memory);
+	mapped = memory.mapped;
+}
+
+VkDeviceSize UniformArena::allocate(VkDeviceSize size) {
+	VkDeviceSize offset = used;
+	used = (used + size + alignment - 1) / alignment * alignment;
+	if(used > regionSize) {
+		throw std::runtime_error("uniform arena exhausted: more uniform blocks than counted in DPSZs!");
+	}
+	return offset;
+}
+
+void UniformArena::cleanup() {
+	vkDestroyBuffer(BP->device, buffer, nullptr);
+	BP->memoryAllocator.free(memory);
 }
 
 #endif
\ No newline at end of file
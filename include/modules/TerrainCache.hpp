@@ -0,0 +1,205 @@
+// World-space cache of terrain noise values.
+// The world is covered by a regular lattice with spacing "spacing": lattice point (gx, gz)
+// is at world (gx * spacing, gz * spacing). The lattice is split into square tiles of
+// TILE_SIZE x TILE_SIZE points, keyed by their integer tile coordinates, that are filled
+// lazily the first time they are touched and evicted in least recently used order.
+// Values are raw noise samples: noise->GetNoise(x * noiseScale, z * noiseScale)
+
+#include <FastNoise.h>
+#include <list>
+
+struct TerrainTile {
+	int tx, tz;
+	std::vector<float> h;
+	std::list<uint64_t>::iterator lruPos;
+} ;
+
+class TerrainHeightCache {
+	public:
+	static const int TILE_SIZE = 32;
+
+	// statistics, cumulative since init() or resetStats()
+	int tilesFilled = 0;
+	int tilesEvicted = 0;
+
+	void init(FastNoise *_noise, float _spacing, float _noiseScale, int _maxTiles = 256);
+	void cleanup();
+	void resetStats();
+
+	float getSpacing() const { return spacing; }
+	int getTileCount() const { return (int)tiles.size(); }
+
+	// Noise value at lattice point (gx, gz)
+	float at(int gx, int gz);
+	// Bilinear interpolation of the lattice values around world (x, z)
+	float sample(float x, float z);
+	// out[i] = at(gx[i] + offsetX, gz[i] + offsetZ)
+	// The tiles covering the points are looked up once per call instead of once per point
+	void gather(const int *gx, const int *gz, int count, int offsetX, int offsetZ, float *out);
+
+	private:
+	FastNoise *noise = nullptr;
+	float spacing = 1.0f;
+	float noiseScale = 1.0f;
+	int maxTiles = 256;
+
+	typedef std::unordered_map<uint64_t, TerrainTile> TileMap;
+	TileMap tiles;
+	std::list<uint64_t> lru;				// front = most recently used
+	std::vector<TerrainTile *> window;	// scratch for gather()
+	// free tiles, with their map and list nodes: init() allocates maxTiles + 1 of them (at() holds
+	// one tile more than maxTiles until it trims), and evicted tiles go back here, so fetching
+	// a new tile does not touch the heap
+	std::vector<TileMap::node_type> spare;
+	std::list<uint64_t> spareLru;
+
+	static uint64_t key(int tx, int tz) { return ((uint64_t)(uint32_t)tx << 32) | (uint32_t)tz; }
+	static int floorDiv(int a, int b) { return (a >= 0) ? a / b : -((-a + b - 1) / b); }
+	TerrainTile *fetch(int tx, int tz);
+	void trim();
+};
+
+#ifdef TERRAIN_CACHE_IMPLEMENTATION
+
+void TerrainHeightCache::init(FastNoise *_noise, float _spacing, float _noiseScale, int _maxTiles) {
+	noise = _noise;
+	spacing = _spacing;
+	noiseScale = _noiseScale;
+	maxTiles = _maxTiles;
+	cleanup();
+	resetStats();
+	// a call can go over maxTiles before trim(): room for twice as many avoids rehashing
+	tiles.reserve(2 * maxTiles);
+	spare.reserve(maxTiles + 1);
+	for(int i = 0; i <= maxTiles; i++) {
+		tiles[i].h.resize(TILE_SIZE * TILE_SIZE);
+		spare.push_back(tiles.extract(i));
+		spareLru.push_front(0);
+	}
+}
+
+void TerrainHeightCache::cleanup() {
+	tiles.clear();
+	lru.clear();
+	window.clear();
+	spare.clear();
+	spareLru.clear();
+}
+
+void TerrainHeightCache::resetStats() {
+	tilesFilled = 0;
+	tilesEvicted = 0;
+}
+
+TerrainTile *TerrainHeightCache::fetch(int tx, int tz) {
+	uint64_t k = key(tx, tz);
+	auto it = tiles.find(k);
+	if(it != tiles.end()) {
+		// mark as most recently used
+		lru.splice(lru.begin(), lru, it->second.lruPos);
+		return &it->second;
+	}
+
+	TerrainTile *T;
+	if(spare.empty()) {
+		T = &tiles[k];
+		T->h.resize(TILE_SIZE * TILE_SIZE);
+		lru.push_front(k);
+	} else {
+		TileMap::node_type node = std::move(spare.back());
+		spare.pop_back();
+		node.key() = k;
+		T = &tiles.insert(std::move(node)).position->second;
+		lru.splice(lru.begin(), spareLru, spareLru.begin());
+		lru.front() = k;
+	}
+	T->tx = tx;
+	T->tz = tz;
+	float x0 = (float)(tx * TILE_SIZE) * spacing;
+	float z0 = (float)(tz * TILE_SIZE) * spacing;
+	noise->FillNoiseGrid(T->h.data(), TILE_SIZE, TILE_SIZE,
+						 x0 * noiseScale, z0 * noiseScale,
+						 spacing * noiseScale, spacing * noiseScale);
+	T->lruPos = lru.begin();
+	tilesFilled++;
+	return T;
+}
+
+// Eviction is done only at the end of a public call, so tile pointers stay valid while a call is running
+void TerrainHeightCache::trim() {
+	while((int)tiles.size() > maxTiles) {
+		TileMap::node_type node = tiles.extract(lru.back());
+		if((int)spare.size() <= maxTiles) {
+			spare.push_back(std::move(node));
+			spareLru.splice(spareLru.begin(), lru, std::prev(lru.end()));
+		} else {
+			lru.pop_back();
+		}
+		tilesEvicted++;
+	}
+}
+
+float TerrainHeightCache::at(int gx, int gz) {
+	int tx = floorDiv(gx, TILE_SIZE);
+	int tz = floorDiv(gz, TILE_SIZE);
+	TerrainTile *T = fetch(tx, tz);
+	float v = T->h[(gz - tz * TILE_SIZE) * TILE_SIZE + (gx - tx * TILE_SIZE)];
+	trim();
+	return v;
+}
+
+float TerrainHeightCache::sample(float x, float z) {
+	float fx = x / spacing;
+	float fz = z / spacing;
+	int gx = (int)std::floor(fx);
+	int gz = (int)std::floor(fz);
+	float ax = fx - (float)gx;
+	float az = fz - (float)gz;
+
+	float h00 = at(gx,     gz);
+	float h10 = at(gx + 1, gz);
+	float h01 = at(gx,     gz + 1);
+	float h11 = at(gx + 1, gz + 1);
+
+	float h0 = h00 + (h10 - h00) * ax;
+	float h1 = h01 + (h11 - h01) * ax;
+	return h0 + (h1 - h0) * az;
+}
+
+void TerrainHeightCache::gather(const int *gx, const int *gz, int count, int offsetX, int offsetZ, float *out) {
+	if(count <= 0) return;
+
+	// bounds of the points, in tiles
+	int minX = gx[0], maxX = gx[0], minZ = gz[0], maxZ = gz[0];
+	for(int i = 1; i < count; i++) {
+		minX = std::min(minX, gx[i]); maxX = std::max(maxX, gx[i]);
+		minZ = std::min(minZ, gz[i]); maxZ = std::max(maxZ, gz[i]);
+	}
+	int tx0 = floorDiv(minX + offsetX, TILE_SIZE), tx1 = floorDiv(maxX + offsetX, TILE_SIZE);
+	int tz0 = floorDiv(minZ + offsetZ, TILE_SIZE), tz1 = floorDiv(maxZ + offsetZ, TILE_SIZE);
+	int wx = tx1 - tx0 + 1;
+	int wz = tz1 - tz0 + 1;
+
+	window.resize(wx * wz);
+	for(int tz = tz0; tz <= tz1; tz++) {
+		for(int tx = tx0; tx <= tx1; tx++) {
+			window[(tz - tz0) * wx + (tx - tx0)] = fetch(tx, tz);
+		}
+	}
+
+	// the window base is a multiple of TILE_SIZE, so a point's tile and its position inside it are plain divisions
+	int baseX = tx0 * TILE_SIZE - offsetX;
+	int baseZ = tz0 * TILE_SIZE - offsetZ;
+	for(int i = 0; i < count; i++) {
+		int lx = gx[i] - baseX;
+		int lz = gz[i] - baseZ;
+		const TerrainTile *T = window[(lz / TILE_SIZE) * wx + (lx / TILE_SIZE)];
+		out[i] = T->h[(lz % TILE_SIZE) * TILE_SIZE + (lx % TILE_SIZE)];
+	}
+
+	// the tiles of the current window must never be evicted by the next call
+	maxTiles = std::max(maxTiles, 2 * wx * wz);
+	trim();
+}
+
+#endif
@@ -0,0 +1,38 @@
+// Parameters of the terrain, shared by the game (main.cpp) and the terrain benchmark (bench/TerrainBench.cpp),
+// so that the benchmark always measures the terrain the game draws.
+// Heights are the ground noise times HEIGHT_SCALE, in the units of the ground mesh, that the scene
+// scales by GROUND_SCALE.
+
+#include <FastNoise.h>
+
+// The ground is a clipmap: CLIPMAP_LEVELS nested grids of the same resolution, the finest one
+// with spacing CLIPMAP_SPACING in world units, each of the others with twice the spacing of the previous
+const int CLIPMAP_LEVELS = 6;
+const int CLIPMAP_HALF_SIZE = 32;
+const float CLIPMAP_SPACING = 2.0f;
+
+// scale of the ground mesh in assets/models/scene.json
+const float GROUND_SCALE = 500.0f;
+
+// ODE heightfield around the airplane
+const int HF_ROWS = 256;
+const int HF_COLS = 256;
+const float CELL_SIZE = 0.1f;			// world-space spacing between samples
+
+const float NOISE_SCALE = 0.004f;		// noise frequency
+const float HEIGHT_SCALE = 0.05f;		// noise amplitude
+
+// The water is flat WATER_FLOOR_DEPTH below WATER_LEVEL, and blends into the terrain over
+// WATER_BLEND_WIDTH around it (world units)
+const float WATER_LEVEL = -2.5f;
+const float WATER_FLOOR_DEPTH = 0.2f;
+const float WATER_BLEND_WIDTH = 0.5f;
+
+// the noise generator of the ground heights
+inline void initGroundNoise(FastNoise &noise) {
+	noise.SetSeed(1356);
+	noise.SetFrequency(2.f);
+	noise.SetNoiseType(FastNoise::Perlin);
+	noise.SetFractalOctaves(2);
+	noise.SetFractalGain(0.8f);
+}
@@ -2698,6 +2698,8 @@ void TextMaker::makeVertex(TextVertex *V, Font &Fnt, int px, int py, int tx, int
 
 void TextMaker::createTextMesh() {
 	M = new Model();
+	// rebuilt every time the text changes
+	M->hostVisible = true;
 	Font fnt = mainFont;
 	int totLen = 0;
 	
@@ -0,0 +1,344 @@
+// Vegetation placed on a grid of world cells, in a square window of cells centered on a moving point.
+// Cell (cx, cz) covers [cx * cellSize, (cx + 1) * cellSize) x [cz * cellSize, (cz + 1) * cellSize) and is
+// stamped with one of tileCount tiles, chosen by hashing the seed and the cell: a cell always gets the same
+// trees, whenever it enters the window. The tiles are generated once by init(): each of them is a Poisson disk
+// point set (no two points closer than minDistance) on the unit square, with distances measured across its
+// borders, so it tiles with itself. Where two different tiles meet, a point closer than minDistance to a point
+// of the cell before it (in z, then x order) is dropped, so the distance holds across the cells too.
+// Every point has its tree variant and scale.
+// Points lower than minHeight (in the water) or on ground steeper than maxSlope are discarded,
+// without looking for another place.
+// The trees are stored in a fixed number of slots, one for each instance that can draw them: slot s
+// draws variant s / (slotCount / variants). A cell takes slots when it enters the window, and gives
+// them back when it leaves it, so only the cells crossed by the window are sampled. The window should
+// hold fewer trees than slots: when all the slots of a variant are taken, trees get another variant.
+// The cells of the window are stored in a ring buffer, like the samples of HeightfieldRing.
+
+#include <functional>
+#include <random>
+
+class VegetationGrid {
+	public:
+	// statistics, cumulative since init() or resetStats()
+	int64_t cellsPopulated = 0;
+	int64_t treesDropped = 0;		// points on dry land without any free slot
+	int64_t variantFallbacks = 0;	// trees drawn with another variant, since theirs had no free slot
+	// trees are scaled by a random factor in [minScale, maxScale], set before init()
+	float minScale = 0.8f;
+	float maxScale = 1.25f;
+
+	// height(x, z) is the height of the ground, maxSlope the largest rise over run of the ground under a tree
+	void init(int _slotCount, int _variants, float _cellSize, int _radius, float minDistance, int tileCount, uint32_t _seed,
+			  float _minHeight, float _maxSlope, std::function<float(float, float)> _height);
+	void cleanup();
+	void resetStats() { cellsPopulated = 0; treesDropped = 0; variantFallbacks = 0; }
+
+	// Centers the window on the cell of world (worldX, worldZ), with radius cells on each side.
+	// Returns true if some trees have been added or removed
+	bool recenter(float worldX, float worldZ);
+
+	int getSlotCount() const { return (int)slotUsed.size(); }
+	bool isUsed(int slot) const { return slotUsed[slot] != 0; }
+	// position of the base of the tree in slot, valid only if the slot is used
+	const glm::vec3 &getPosition(int slot) const { return slotPos[slot]; }
+	float getScale(int slot) const { return slotScale[slot]; }
+	int getMaxPointsPerCell() const { return maxTilePoints; }
+
+	private:
+	struct Cell {
+		int cx, cz;
+		bool valid;
+	};
+	struct TilePoint {
+		float u, v;		// position in the cell, from 0 to 1
+		int variant;
+		float scale;
+	};
+
+	float cellSize = 1.0f;
+	int radius = 0;
+	int side = 0;			// cells on each side of the window
+	int variants = 1;
+	int slotsPerVariant = 0;
+	uint32_t seed = 0;
+	float minHeight = 0.0f;
+	float maxSlope = 1.0f;
+	std::function<float(float, float)> height;
+
+	std::vector<std::vector<TilePoint>> tiles;
+	int maxTilePoints = 0;
+	float tileDistance = 0.0f;		// minDistance in cell units
+
+	std::vector<glm::vec3> slotPos;
+	std::vector<float> slotScale;
+	std::vector<char> slotUsed;
+	std::vector<std::vector<int>> freeSlots;	// one list for each variant
+	std::vector<Cell> cells;
+	std::vector<int> cellSlots;		// maxTilePoints slots for each cell of the ring, -1 if not used
+	std::vector<int> entering;		// ring entries of the cells entering the window, used by recenter()
+	int centerX = 0, centerZ = 0;
+	bool valid = false;
+
+	static int wrapIndex(int i, int n) {
+		int r = i % n;
+		return (r < 0) ? r + n : r;
+	}
+	static uint32_t hash(uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+	void generateTile(std::vector<TilePoint> &tile, float r, std::mt19937 &rng);
+	const std::vector<TilePoint> &tileOf(int cx, int cz) const {
+		return tiles[hash(seed, (uint32_t)cx, (uint32_t)cz, 0) % tiles.size()];
+	}
+	bool yields(int cx, int cz, const TilePoint &P) const;
+	void populate(int ring, int cx, int cz);
+	void release(int ring);
+};
+
+#ifdef VEGETATION_GRID_IMPLEMENTATION
+
+void VegetationGrid::init(int _slotCount, int _variants, float _cellSize, int _radius, float minDistance, int tileCount, uint32_t _seed,
+						  float _minHeight, float _maxSlope, std::function<float(float, float)> _height) {
+	cellSize = _cellSize;
+	radius = _radius;
+	side = 2 * radius + 1;
+	variants = std::max(1, _variants);
+	slotsPerVariant = _slotCount / variants;
+	seed = _seed;
+	minHeight = _minHeight;
+	maxSlope = _maxSlope;
+	height = _height;
+
+	std::mt19937 rng(seed);
+	tiles.assign(std::max(1, tileCount), {});
+	maxTilePoints = 0;
+	tileDistance = minDistance / cellSize;
+	for(auto &tile : tiles) {
+		generateTile(tile, tileDistance, rng);
+		maxTilePoints = std::max(maxTilePoints, (int)tile.size());
+	}
+
+	slotPos.assign(_slotCount, glm::vec3(0.0f));
+	slotScale.assign(_slotCount, 1.0f);
+	slotUsed.assign(_slotCount, 0);
+	// the lowest slots are taken first
+	freeSlots.assign(variants, {});
+	for(int v = 0; v < variants; v++) {
+		for(int s = (v + 1) * slotsPerVariant - 1; s >= v * slotsPerVariant; s--) {
+			freeSlots[v].push_back(s);
+		}
+	}
+	cells.assign(side * side, {0, 0, false});
+	cellSlots.assign(side * side * maxTilePoints, -1);
+	valid = false;
+	resetStats();
+}
+
+void VegetationGrid::cleanup() {
+	tiles.clear();
+	slotPos.clear();
+	slotScale.clear();
+	slotUsed.clear();
+	freeSlots.clear();
+	cells.clear();
+	cellSlots.clear();
+	valid = false;
+}
+
+// Integer hash of the seed, the cell and the candidate (from the finalizer of MurmurHash3)
+uint32_t VegetationGrid::hash(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+	uint32_t h = a;
+	for(uint32_t k : {b, c, d}) {
+		h ^= k * 0xcc9e2d51u;
+		h = (h << 13) | (h >> 19);
+		h = h * 5 + 0xe6546b64u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+// Bridson's dart throwing on the unit torus: new points are tried around the active ones,
+// and accepted if no point is closer than r, along the shortest way across the borders.
+// Each cell of the background grid is smaller than r / sqrt(2), so it holds at most one point,
+// and the points closer than r are at most ceil(r * n) cells away
+void VegetationGrid::generateTile(std::vector<TilePoint> &tile, float r, std::mt19937 &rng) {
+	const int attempts = 30;
+	int n = std::max(1, (int)std::ceil(std::sqrt(2.0f) / r));
+	int reach = (int)std::ceil(r * n);
+	std::vector<int> grid(n * n, -1);
+	std::vector<int> active;
+	// the engine is the same on every platform, the standard distributions are not
+	auto unit = [](std::mt19937 &g) { return (float)(g() >> 8) / 16777216.0f; };
+
+	auto wrap = [](float a) { return a - std::floor(a); };
+	auto fits = [&](float u, float v) {
+		int gu = std::min(n - 1, (int)(u * n));
+		int gv = std::min(n - 1, (int)(v * n));
+		for(int dv = -reach; dv <= reach; dv++) {
+			for(int du = -reach; du <= reach; du++) {
+				int p = grid[wrapIndex(gv + dv, n) * n + wrapIndex(gu + du, n)];
+				if(p < 0) continue;
+				float ddu = std::fabs(tile[p].u - u);
+				float ddv = std::fabs(tile[p].v - v);
+				ddu = std::min(ddu, 1.0f - ddu);
+				ddv = std::min(ddv, 1.0f - ddv);
+				if(ddu * ddu + ddv * ddv < r * r) return false;
+			}
+		}
+		return true;
+	};
+	auto add = [&](float u, float v) {
+		int p = tile.size();
+		tile.push_back({u, v, (int)(rng() % variants), minScale + (maxScale - minScale) * unit(rng)});
+		grid[std::min(n - 1, (int)(v * n)) * n + std::min(n - 1, (int)(u * n))] = p;
+		active.push_back(p);
+	};
+
+	tile.clear();
+	add(unit(rng), unit(rng));
+	while(!active.empty()) {
+		int a = rng() % active.size();
+		bool found = false;
+		for(int k = 0; k < attempts && !found; k++) {
+			// uniform in the ring between r and 2r around the active point
+			float angle = 6.2831853f * unit(rng);
+			float dist = r * std::sqrt(1.0f + 3.0f * unit(rng));
+			float u = wrap(tile[active[a]].u + dist * std::cos(angle));
+			float v = wrap(tile[active[a]].v + dist * std::sin(angle));
+			if(fits(u, v)) {
+				add(u, v);
+				found = true;
+			}
+		}
+		if(!found) {
+			active[a] = active.back();
+			active.pop_back();
+		}
+	}
+}
+
+// True if P, of cell (cx, cz), is too close to a point of one of the cells coming before it, up to
+// ceil(minDistance / cellSize) cells away.
+// The neighbours decide in the same way, whatever cells are in the window: no two trees are closer than
+// minDistance (a point can be dropped for a point dropped in turn, it only makes the trees a bit sparser)
+bool VegetationGrid::yields(int cx, int cz, const TilePoint &P) const {
+	float r = tileDistance;
+	if(P.u >= r && P.u <= 1.0f - r && P.v >= r && P.v <= 1.0f - r) {
+		return false;
+	}
+	int reach = (int)std::ceil(r);
+	for(int dz = -reach; dz <= 0; dz++) {
+		for(int dx = -reach; dx <= reach; dx++) {
+			if((dz == 0) && (dx >= 0)) {
+				continue;
+			}
+			for(const TilePoint &Q : tileOf(cx + dx, cz + dz)) {
+				float du = Q.u + dx - P.u;
+				float dv = Q.v + dz - P.v;
+				if(du * du + dv * dv < r * r) {
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+void VegetationGrid::populate(int ring, int cx, int cz) {
+	const std::vector<TilePoint> &tile = tileOf(cx, cz);
+	// the slope is measured with forward differences over a tenth of the cell
+	const float step = cellSize * 0.1f;
+	for(int i = 0; i < maxTilePoints; i++) {
+		int &slot = cellSlots[ring * maxTilePoints + i];
+		slot = -1;
+		if(i >= tile.size()) {
+			continue;
+		}
+
+		const TilePoint &P = tile[i];
+		if(yields(cx, cz, P)) {
+			continue;
+		}
+		float x = ((float)cx + P.u) * cellSize;
+		float z = ((float)cz + P.v) * cellSize;
+		float y = height(x, z);
+		if(y < minHeight) {
+			continue;
+		}
+		float dx = height(x + step, z) - y;
+		float dz = height(x, z + step) - y;
+		if(dx * dx + dz * dz > maxSlope * maxSlope * step * step) {
+			continue;
+		}
+		// when the slots of its variant are over, the tree takes the first following variant with a free slot
+		int v = P.variant;
+		for(int k = 1; k < variants && freeSlots[v].empty(); k++) {
+			v = (P.variant + k) % variants;
+		}
+		if(freeSlots[v].empty()) {
+			treesDropped++;
+			continue;
+		}
+		variantFallbacks += (v != P.variant) ? 1 : 0;
+		slot = freeSlots[v].back();
+		freeSlots[v].pop_back();
+		slotPos[slot] = glm::vec3(x, y, z);
+		slotScale[slot] = P.scale;
+		slotUsed[slot] = 1;
+	}
+	cells[ring] = {cx, cz, true};
+	cellsPopulated++;
+}
+
+void VegetationGrid::release(int ring) {
+	for(int i = 0; i < maxTilePoints; i++) {
+		int &slot = cellSlots[ring * maxTilePoints + i];
+		if(slot >= 0) {
+			slotUsed[slot] = 0;
+			freeSlots[slot / slotsPerVariant].push_back(slot);
+			slot = -1;
+		}
+	}
+	cells[ring].valid = false;
+}
+
+bool VegetationGrid::recenter(float worldX, float worldZ) {
+	int newCenterX = (int)std::floor(worldX / cellSize);
+	int newCenterZ = (int)std::floor(worldZ / cellSize);
+	if(valid && newCenterX == centerX && newCenterZ == centerZ) {
+		return false;
+	}
+
+	// two cells of the window never share a ring entry: an entry holding another cell
+	// holds one that has left the window. The cells leaving are released before any cell
+	// entering takes their slots
+	entering.clear();
+	for(int cz = newCenterZ - radius; cz <= newCenterZ + radius; cz++) {
+		for(int cx = newCenterX - radius; cx <= newCenterX + radius; cx++) {
+			int ring = wrapIndex(cz, side) * side + wrapIndex(cx, side);
+			Cell &C = cells[ring];
+			if(C.valid && C.cx == cx && C.cz == cz) {
+				continue;
+			}
+			if(C.valid) {
+				release(ring);
+			}
+			entering.push_back(ring);
+		}
+	}
+	bool changed = !entering.empty();
+	for(int ring : entering) {
+		int cz = newCenterZ - radius + wrapIndex(ring / side - (newCenterZ - radius), side);
+		int cx = newCenterX - radius + wrapIndex(ring % side - (newCenterX - radius), side);
+		populate(ring, cx, cz);
+	}
+
+	centerX = newCenterX;
+	centerZ = newCenterZ;
+	valid = true;
+	return changed;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+// CookTorrance.frag on the impostor atlases: the albedo, the normal and the roughness are
+// the ones of the model in the view, and the pixels it does not cover are discarded
+layout(location = 0) in vec3 fragPos;
+layout(location = 1) in vec2 fragUV;
+layout(location = 2) flat in mat3 fragNMat;
+
+layout(location = 0) out vec4 outColor;
+
+layout(binding = 1, set = 1) uniform sampler2D albedoAtlas;
+layout(binding = 2, set = 1) uniform sampler2D normalAtlas;
+
+layout(binding = 0, set = 0) uniform GlobalUniformBufferObject {
+	vec3 lightDir;
+	vec4 lightColor;
+	vec3 eyePos;
+} gubo;
+
+const float PI = 3.14159265359;
+
+vec3 Fresnel(float cosTheta, vec3 F0) {
+	return F0 + (1.0 - F0) * pow(1.0 - cosTheta, 5.0);
+}
+
+float DistributionGGX(vec3 N, vec3 H, float roughness) {
+	float a = roughness * roughness;
+	float a2 = a * a;
+	float NdotH = max(dot(N, H), 0.0001f);
+	float NdotH2 = NdotH * NdotH;
+	float denom = (NdotH2 * (a2 - 1.0) + 1.0);
+	return a2 / (PI * denom * denom);
+}
+
+float GeometryGGX(float NdotV, float roughness) {
+	float r = (roughness + 1.0);
+	float k = (r * r) / 8.0;
+	return NdotV / (NdotV * (1.0 - k) + k);
+}
+
+float Geometry(vec3 N, vec3 V, vec3 L, float roughness) {
+	return GeometryGGX(max(dot(N, V), 0.0001f), roughness) *
+		   GeometryGGX(max(dot(N, L), 0.0001f), roughness);
+}
+
+void main() {
+	vec4 albedoA = texture(albedoAtlas, fragUV);
+	if(albedoA.a < 0.5) {
+		discard;
+	}
+	vec4 normalR = texture(normalAtlas, fragUV);
+	vec3 albedo = albedoA.rgb / albedoA.a;
+	float roughness = normalR.a;
+
+	vec3 N = normalize(fragNMat * (normalR.xyz * 2.0 - 1.0));
+	vec3 V = normalize(gubo.eyePos - fragPos);
+	vec3 L = normalize(gubo.lightDir);
+	vec3 radiance = gubo.lightColor.rgb;
+
+	vec3 H = normalize(V + L);
+	vec3 F0 = mix(vec3(0.04), albedo, 0.1);
+	float NDF = DistributionGGX(N, H, roughness);
+	float G   = Geometry(N, V, L, roughness);
+	vec3 F    = Fresnel(max(dot(H, V), 0.0), F0);
+	vec3 specular = (NDF * G * F) /
+		max(4.0 * max(dot(N, V), 0.0001f) * max(dot(N, L), 0.0), 0.0001f);
+	vec3 kS = F;
+	vec3 kD = vec3(1.0) - kS;
+	kD *= 1.0 - 0.1;
+	float NdotL = max(dot(N, L), 0.0);
+	vec3 Lo = (kD * albedo / PI + specular) * radiance * NdotL;
+
+	// the ambient light of CookTorrance.frag
+	const float scaling = 0.1f;
+	const vec3 cxp = vec3(0.24,0.0,0.91) * scaling;
+	const vec3 cxn = vec3(0.2,0.7,1.0) * scaling;
+	const vec3 cyp = vec3(0.2,0.7,1.0) * scaling;
+	const vec3 cyn = vec3(0.34,0.76,0.4) * scaling;
+	const vec3 czp = vec3(0.2,0.7,1.0) * scaling;
+	const vec3 czn = vec3(0.24,0.0,0.91) * scaling;
+	vec3 Ambient =((N.x > 0 ? cxp : cxn) * (N.x * N.x) +
+				   (N.y > 0 ? cyp : cyn) * (N.y * N.y) +
+				   (N.z > 0 ? czp : czn) * (N.z * N.z)) * albedo;
+
+	outColor = vec4(Lo + Ambient, 1.0f);
+}
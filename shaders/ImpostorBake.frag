@@ -0,0 +1,19 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+// Writes the material of the model as CookTorrance.frag computes it: the albedo in the first atlas,
+// the object space normal and the roughness in the second one
+layout(location = 0) in vec3 fragNorm;
+layout(location = 1) in vec2 fragUV;
+
+layout(location = 0) out vec4 outAlbedo;
+layout(location = 1) out vec4 outNormal;
+
+layout(binding = 0, set = 0) uniform sampler2D tex;
+layout(binding = 1, set = 0) uniform sampler2D detail;
+
+void main() {
+	vec3 albedo = texture(tex, fragUV).rgb * (3.0 + texture(detail, fragUV)).rgb / 4.0;
+	vec3 N = normalize(gl_FrontFacing ? fragNorm : -fragNorm);
+	outAlbedo = vec4(albedo, 1.0);
+	outNormal = vec4(N * 0.5 + 0.5, texture(detail, fragUV).r);
+}
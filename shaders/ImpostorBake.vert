@@ -0,0 +1,19 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+// Draws a model in one view of the impostor atlas: viewMat maps its bounding sphere to the rectangle
+// of the view, with the depth growing away from the camera
+layout(push_constant) uniform PushConstants {
+	mat4 viewMat;
+} pc;
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNorm;
+layout(location = 2) in vec2 inUV;
+
+layout(location = 0) out vec3 fragNorm;
+layout(location = 1) out vec2 fragUV;
+void main() {
+	gl_Position = pc.viewMat * vec4(inPosition, 1.0);
+	fragNorm = inNorm;
+	fragUV = inUV;
+}
@@ -0,0 +1,59 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+// Billboards of the impostors (see Impostors.hpp), instanced as ModelSimpleInstanced.vert.
+// The quad faces the camera, and shows the view of the atlas taken from the closest direction around
+// the vertical axis of the instance: seen from above, it leans back instead of disappearing edge-on.
+// The billboard models store the center of the bounding
+// sphere in the normal, and the offset of each corner from it in the xy of the position
+const int VIEWS = 8;	// ImpostorAtlas::views
+const float PI = 3.14159265359;
+
+layout(binding = 0, set = 0) uniform GlobalUniformBufferObject {
+	vec3 lightDir;
+	vec4 lightColor;
+	vec3 eyePos;
+} gubo;
+
+layout(binding = 0, set = 1) uniform UniformBufferObject {
+	mat4 mvpMat;
+	mat4 mMat;
+	mat4 nMat;
+} ubo;
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNorm;
+layout(location = 2) in vec2 inUV;
+
+// InstanceTransform, one per instance (binding 1)
+layout(location = 3) in mat4 instMMat;
+layout(location = 7) in mat4 instNMat;
+
+layout(location = 0) out vec3 fragPos;
+layout(location = 1) out vec2 fragUV;
+// from the object space of the atlas normals to world space
+layout(location = 2) flat out mat3 fragNMat;
+void main() {
+	vec3 center = inNorm;
+	vec2 offset = inPosition.xy - inNorm.xy;
+
+	// camera in object space: the instances are rotated, uniformly scaled and translated
+	mat4 W = ubo.mMat * instMMat;
+	mat3 R = mat3(W);
+	vec3 eye = transpose(R) * (gubo.eyePos - W[3].xyz) / dot(R[0], R[0]);
+	vec3 toEye = eye - center;
+	vec2 d = toEye.xz;
+	d = (dot(d, d) > 1e-8) ? normalize(d) : vec2(0.0, 1.0);
+	toEye = (dot(toEye, toEye) > 1e-8) ? normalize(toEye) : vec3(d.x, 0.0, d.y);
+
+	// view k is taken from azimuth 2 * pi * k / VIEWS, measured from +z towards +x
+	float view = round(atan(d.x, d.y) * VIEWS / (2.0 * PI));
+	view = mod(view, float(VIEWS));
+
+	vec3 right = vec3(d.y, 0.0, -d.x);
+	vec3 up = cross(toEye, right);
+	vec4 pos = instMMat * vec4(center + right * offset.x + up * offset.y, 1.0);
+	gl_Position = ubo.mvpMat * pos;
+	fragPos = (ubo.mMat * pos).xyz;
+	fragUV = vec2((view + inUV.x) / VIEWS, inUV.y);
+	fragNMat = mat3(ubo.nMat * instNMat);
+}
@@ -0,0 +1,28 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+// ModelSimple.vert for instanced draws: the uniforms are shared by all the instances of the draw call,
+// and are applied after the world matrix of each instance
+layout(binding = 0, set = 1) uniform UniformBufferObject {
+	mat4 mvpMat;
+	mat4 mMat;
+	mat4 nMat;
+} ubo;
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNorm;
+layout(location = 2) in vec2 inUV;
+
+// InstanceTransform, one per instance (binding 1)
+layout(location = 3) in mat4 instMMat;
+layout(location = 7) in mat4 instNMat;
+
+layout(location = 0) out vec3 fragPos;
+layout(location = 1) out vec3 fragNorm;
+layout(location = 2) out vec2 fragUV;
+void main() {
+	vec4 pos = instMMat * vec4(inPosition, 1.0);
+	gl_Position = ubo.mvpMat * pos;
+	fragPos = (ubo.mMat * pos).xyz;
+	fragNorm = (ubo.nMat * instNMat * vec4(inNorm, 0.0)).xyz;
+	fragUV = inUV;
+}
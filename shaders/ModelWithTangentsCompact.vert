@@ -0,0 +1,48 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Variant of ModelWithTangents.vert for the ground written with the compact VertexTerrain format:
+// quantized position, octahedral normal and tangent, and UVs derived from XZ
+
+layout(binding = 1, set = 0) uniform GroundDisplacementUniform {
+	vec4 position;
+	vec4 noise;
+	vec4 grid;
+	vec4 quantization;	// object space size of a unit of XZ and of Y
+	uvec4 perm[64];
+} gd;
+
+layout(binding = 0, set = 1) uniform UniformBufferObject {
+	mat4 mvpMat;
+	mat4 mMat;
+	mat4 nMat;
+} ubo;
+
+layout(location = 0) in vec4 inPosition;	// x, y, z, handedness of the tangent frame
+layout(location = 1) in vec4 inFrame;		// octahedral normal (xy) and tangent (zw)
+
+layout(location = 0) out vec3 fragPos;
+layout(location = 1) out vec3 fragNorm;
+layout(location = 2) out vec2 fragUV;
+layout(location = 3) out vec4 fragTan;
+
+// inverse of octEncode() in main.cpp
+vec3 octDecode(vec2 e) {
+	vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if(v.z < 0.0) {
+		v.xy = (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+	}
+	return normalize(v);
+}
+
+void main() {
+	vec3 pos = inPosition.xyz * gd.quantization.xyx;
+	vec3 norm = octDecode(inFrame.xy);
+	vec3 tangent = octDecode(inFrame.zw);
+
+	gl_Position = ubo.mvpMat * vec4(pos, 1.0);
+	fragPos = (ubo.mMat * vec4(pos, 1.0)).xyz;
+	fragNorm = normalize((ubo.nMat * vec4(norm, 0.0)).xyz);
+	fragUV = pos.xz * 0.5 + 0.5;
+	fragTan = vec4(normalize(mat3(ubo.mMat) * tangent), inPosition.w >= 0.0 ? 1.0 : -1.0);
+}
@@ -0,0 +1,139 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Variant of ModelWithTangents.vert for the ground: the flat clipmap grid is displaced here, evaluating the
+// same Perlin noise as the CPU path (noiseGround), and the normals are computed from the displaced neighbours
+
+layout(binding = 1, set = 0) uniform GroundDisplacementUniform {
+	vec4 position;	// XZ offset of the mesh in world space, XZ scale of the mesh, water noise time
+	vec4 noise;		// noise frequency in world units, height scale, water floor, water blend width
+	vec4 grid;		// clipmap: spacing of level 0 in object space, half size of a level in vertices, number of levels
+	vec4 quantization;	// not used here, see ModelWithTangentsCompact.vert
+	uvec4 perm[64];	// permutation table of the noise
+} gd;
+
+layout(binding = 0, set = 1) uniform UniformBufferObject {
+	mat4 mvpMat;
+	mat4 mMat;
+	mat4 nMat;
+} ubo;
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNorm;
+layout(location = 2) in vec2 inUV;
+layout(location = 3) in vec4 inTangent;
+
+layout(location = 0) out vec3 fragPos;
+layout(location = 1) out vec3 fragNorm;
+layout(location = 2) out vec2 fragUV;
+layout(location = 3) out vec4 fragTan;
+
+const float GRAD_X[12] = float[](1, -1, 1, -1, 1, -1, 1, -1, 0, 0, 0, 0);
+const float GRAD_Y[12] = float[](1, 1, -1, -1, 0, 0, 0, 0, 1, -1, 1, -1);
+const float GRAD_Z[12] = float[](0, 0, 0, 0, 1, 1, -1, -1, 1, 1, -1, -1);
+
+int perm(int i) {
+	i &= 255;
+	return int(gd.perm[i >> 2][i & 3]);
+}
+
+// same rounding as FastNoise::FastFloor
+int fastFloor(float f) {
+	return (f >= 0.0) ? int(f) : int(f) - 1;
+}
+
+float quintic(float t) {
+	return t * t * t * (t * (t * 6.0 - 15.0) + 10.0);
+}
+
+float gradCoord2D(int x, int y, float xd, float yd) {
+	int lut = perm((x & 255) + perm(y)) % 12;
+	return xd * GRAD_X[lut] + yd * GRAD_Y[lut];
+}
+
+float gradCoord3D(int x, int y, int z, float xd, float yd, float zd) {
+	int lut = perm((x & 255) + perm((y & 255) + perm(z))) % 12;
+	return xd * GRAD_X[lut] + yd * GRAD_Y[lut] + zd * GRAD_Z[lut];
+}
+
+float perlin2D(vec2 p) {
+	int x0 = fastFloor(p.x), y0 = fastFloor(p.y);
+	float xd0 = p.x - float(x0), yd0 = p.y - float(y0);
+	float xs = quintic(xd0), ys = quintic(yd0);
+
+	float xf0 = mix(gradCoord2D(x0, y0,     xd0, yd0),       gradCoord2D(x0 + 1, y0,     xd0 - 1.0, yd0),       xs);
+	float xf1 = mix(gradCoord2D(x0, y0 + 1, xd0, yd0 - 1.0), gradCoord2D(x0 + 1, y0 + 1, xd0 - 1.0, yd0 - 1.0), xs);
+	return mix(xf0, xf1, ys);
+}
+
+float perlin3D(vec3 p) {
+	int x0 = fastFloor(p.x), y0 = fastFloor(p.y), z0 = fastFloor(p.z);
+	float xd0 = p.x - float(x0), yd0 = p.y - float(y0), zd0 = p.z - float(z0);
+	float xd1 = xd0 - 1.0, yd1 = yd0 - 1.0, zd1 = zd0 - 1.0;
+	float xs = quintic(xd0), ys = quintic(yd0), zs = quintic(zd0);
+
+	float xf00 = mix(gradCoord3D(x0, y0,     z0,     xd0, yd0, zd0), gradCoord3D(x0 + 1, y0,     z0,     xd1, yd0, zd0), xs);
+	float xf10 = mix(gradCoord3D(x0, y0 + 1, z0,     xd0, yd1, zd0), gradCoord3D(x0 + 1, y0 + 1, z0,     xd1, yd1, zd0), xs);
+	float xf01 = mix(gradCoord3D(x0, y0,     z0 + 1, xd0, yd0, zd1), gradCoord3D(x0 + 1, y0,     z0 + 1, xd1, yd0, zd1), xs);
+	float xf11 = mix(gradCoord3D(x0, y0 + 1, z0 + 1, xd0, yd1, zd1), gradCoord3D(x0 + 1, y0 + 1, z0 + 1, xd1, yd1, zd1), xs);
+
+	return mix(mix(xf00, xf10, ys), mix(xf01, xf11, ys), zs);
+}
+
+// height in object space of the ground point at object coordinates xz, with the water animation
+float groundHeight(vec2 xz) {
+	vec2 p = (xz * gd.position.z + gd.position.xy) * gd.noise.x;
+	float h = perlin2D(p) * gd.noise.y;
+
+	float floorY = gd.noise.z;
+	float blendWidth = gd.noise.w;
+	if(h < floorY + blendWidth) {
+		float t = smoothstep(floorY - blendWidth, floorY + blendWidth, h);
+		float flatH = floorY - abs(perlin3D(vec3(p, gd.position.w)) * 0.001);
+		h = mix(flatH, h, t);
+	}
+	return h;
+}
+
+void main() {
+	// level of the vertex in the clipmap: the first one whose square contains it
+	float e0 = gd.grid.x;
+	int halfSize = int(gd.grid.y);
+	int levels = int(gd.grid.z);
+	ivec2 g = ivec2(round(inPosition.xz / e0));
+	int cheb = max(abs(g.x), abs(g.y));
+	int level = 0;
+	while(level < levels - 1 && cheb > (halfSize << level)) level++;
+	float e = e0 * float(1 << level);
+
+	float h = groundHeight(inPosition.xz);
+	// the odd vertices of the outer border of a level lie halfway along an edge of the next level:
+	// they take the average height of the two ends of the edge, so there are no cracks between levels
+	if(level < levels - 1 && cheb == (halfSize << level)) {
+		bool alongZ = (abs(g.x) == cheb);
+		int along = (alongZ ? g.y : g.x) >> level;
+		if((along & 1) != 0) {
+			vec2 dir = alongZ ? vec2(0.0, e) : vec2(e, 0.0);
+			h = 0.5 * (groundHeight(inPosition.xz - dir) + groundHeight(inPosition.xz + dir));
+		}
+	}
+	vec3 pos = vec3(inPosition.x, h, inPosition.z);
+
+	// normal from the central differences of the neighbours on the same level
+	float hL = groundHeight(inPosition.xz - vec2(e, 0.0));
+	float hR = groundHeight(inPosition.xz + vec2(e, 0.0));
+	float hD = groundHeight(inPosition.xz - vec2(0.0, e));
+	float hU = groundHeight(inPosition.xz + vec2(0.0, e));
+	vec3 ex = vec3(2.0 * e, hR - hL, 0.0);
+	vec3 ez = vec3(0.0, hU - hD, 2.0 * e);
+	vec3 norm = normalize(cross(ez, ex));
+
+	// Gram-Schmidt tangent, from the tangent of the flat grid
+	vec3 tan = normalize(inTangent.xyz - norm * dot(norm, inTangent.xyz));
+
+	gl_Position = ubo.mvpMat * vec4(pos, 1.0);
+	fragPos = (ubo.mMat * vec4(pos, 1.0)).xyz;
+	fragNorm = normalize((ubo.nMat * vec4(norm, 0.0)).xyz);
+	fragUV = inUV;
+	fragTan = vec4(normalize(mat3(ubo.mMat) * tan), inTangent.w);
+}
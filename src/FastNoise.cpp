@@ -34,6 +34,18 @@
 #include <algorithm>
 #include <random>
 
+// The batch functions have SSE2/AVX2 paths on x86, every other target (or FN_USE_DOUBLES) uses the scalar path
+#if !defined(FN_USE_DOUBLES) && (defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define FN_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define FN_TARGET_AVX2
+#else
+#define FN_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
 const FN_DECIMAL GRAD_X[] =
 {
 	1, -1, 1, -1,
@@ -2248,3 +2260,493 @@ void FastNoise::SingleGradientPerturb(unsigned char offset, FN_DECIMAL warpAmp,
 	x += Lerp(lx0x, lx1x, ys) * warpAmp;
 	y += Lerp(ly0x, ly1x, ys) * warpAmp;
 }
+
+// Batch
+
+// Number of points handed to the SIMD kernels at once, one AVX2 register or two SSE2 registers
+#define FN_BATCH_WIDTH 8
+
+static FastNoise::SIMDLevel DetectSIMDLevel()
+{
+#ifdef FN_SIMD_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] >= 7)
+	{
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+		if (osxsave && avx && (_xgetbv(0) & 6) == 6)
+		{
+			__cpuidex(info, 7, 0);
+			if (info[1] & (1 << 5))
+				return FastNoise::SIMD_AVX2;
+		}
+	}
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return FastNoise::SIMD_AVX2;
+#endif
+	return FastNoise::SIMD_SSE2;
+#else
+	return FastNoise::SIMD_Scalar;
+#endif
+}
+
+FastNoise::SIMDLevel FastNoise::GetSupportedSIMDLevel()
+{
+	static const SIMDLevel supported = DetectSIMDLevel();
+	return supported;
+}
+
+FastNoise::SIMDLevel FastNoise::ActiveSIMDLevel() const
+{
+	if (m_noiseType != Perlin && m_noiseType != PerlinFractal)
+		return SIMD_Scalar;
+
+	return std::min(m_maxSIMDLevel, GetSupportedSIMDLevel());
+}
+
+#ifdef FN_SIMD_X86
+
+// Gradient of the corner (x + dx, y + dy) for every lane, same hashing as GradCoord2D
+static inline void GradLanes2D(const unsigned char* perm, const unsigned char* perm12, unsigned char offset, int lanes,
+                               const int* xi, const int* yi, int dx, int dy, float* gx, float* gy)
+{
+	for (int l = 0; l < lanes; l++)
+	{
+		unsigned char lutPos = perm12[((xi[l] + dx) & 0xff) + perm[((yi[l] + dy) & 0xff) + offset]];
+		gx[l] = GRAD_X[lutPos];
+		gy[l] = GRAD_Y[lutPos];
+	}
+}
+
+// Gradient of the corner (x + dx, y + dy, z + dz) for every lane, same hashing as GradCoord3D
+static inline void GradLanes3D(const unsigned char* perm, const unsigned char* perm12, unsigned char offset, int lanes,
+                               const int* xi, const int* yi, const int* zi, int dx, int dy, int dz, float* gx, float* gy, float* gz)
+{
+	for (int l = 0; l < lanes; l++)
+	{
+		unsigned char lutPos = perm12[((xi[l] + dx) & 0xff) + perm[((yi[l] + dy) & 0xff) + perm[((zi[l] + dz) & 0xff) + offset]]];
+		gx[l] = GRAD_X[lutPos];
+		gy[l] = GRAD_Y[lutPos];
+		gz[l] = GRAD_Z[lutPos];
+	}
+}
+
+// SSE2, 4 points per call
+// Every operation mirrors the scalar code in the same order so the results match SinglePerlin(...)
+
+static inline __m128i FloorSSE2(__m128 f)
+{
+	// FastFloor: truncate, then subtract 1 from negative inputs
+	return _mm_add_epi32(_mm_cvttps_epi32(f), _mm_castps_si128(_mm_cmplt_ps(f, _mm_setzero_ps())));
+}
+
+static inline __m128 LerpSSE2(__m128 a, __m128 b, __m128 t)
+{
+	return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+}
+
+static inline __m128 InterpSSE2(int interp, __m128 t)
+{
+	switch (interp)
+	{
+	case FastNoise::Hermite:
+		return _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(_mm_set1_ps(3), _mm_mul_ps(_mm_set1_ps(2), t)));
+	case FastNoise::Quintic:
+		return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t),
+		                  _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6)), _mm_set1_ps(15))), _mm_set1_ps(10)));
+	default:
+		return t;
+	}
+}
+
+static inline __m128 GradDotSSE2(const float* gx, const float* gy, __m128 xd, __m128 yd)
+{
+	return _mm_add_ps(_mm_mul_ps(xd, _mm_loadu_ps(gx)), _mm_mul_ps(yd, _mm_loadu_ps(gy)));
+}
+
+static inline __m128 GradDotSSE2(const float* gx, const float* gy, const float* gz, __m128 xd, __m128 yd, __m128 zd)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(xd, _mm_loadu_ps(gx)), _mm_mul_ps(yd, _mm_loadu_ps(gy))), _mm_mul_ps(zd, _mm_loadu_ps(gz)));
+}
+
+static void SinglePerlinSSE2(const unsigned char* perm, const unsigned char* perm12, unsigned char offset, int interp,
+                             const float* x, const float* y, float* out)
+{
+	__m128 vx = _mm_loadu_ps(x);
+	__m128 vy = _mm_loadu_ps(y);
+	__m128i x0 = FloorSSE2(vx);
+	__m128i y0 = FloorSSE2(vy);
+
+	__m128 one = _mm_set1_ps(1);
+	__m128 xd0 = _mm_sub_ps(vx, _mm_cvtepi32_ps(x0));
+	__m128 yd0 = _mm_sub_ps(vy, _mm_cvtepi32_ps(y0));
+	__m128 xd1 = _mm_sub_ps(xd0, one);
+	__m128 yd1 = _mm_sub_ps(yd0, one);
+	__m128 xs = InterpSSE2(interp, xd0);
+	__m128 ys = InterpSSE2(interp, yd0);
+
+	alignas(16) int xi[4], yi[4];
+	_mm_store_si128((__m128i*)xi, x0);
+	_mm_store_si128((__m128i*)yi, y0);
+
+	alignas(16) float gx[4][4], gy[4][4];
+	GradLanes2D(perm, perm12, offset, 4, xi, yi, 0, 0, gx[0], gy[0]);
+	GradLanes2D(perm, perm12, offset, 4, xi, yi, 1, 0, gx[1], gy[1]);
+	GradLanes2D(perm, perm12, offset, 4, xi, yi, 0, 1, gx[2], gy[2]);
+	GradLanes2D(perm, perm12, offset, 4, xi, yi, 1, 1, gx[3], gy[3]);
+
+	__m128 xf0 = LerpSSE2(GradDotSSE2(gx[0], gy[0], xd0, yd0), GradDotSSE2(gx[1], gy[1], xd1, yd0), xs);
+	__m128 xf1 = LerpSSE2(GradDotSSE2(gx[2], gy[2], xd0, yd1), GradDotSSE2(gx[3], gy[3], xd1, yd1), xs);
+
+	_mm_storeu_ps(out, LerpSSE2(xf0, xf1, ys));
+}
+
+static void SinglePerlinSSE2(const unsigned char* perm, const unsigned char* perm12, unsigned char offset, int interp,
+                             const float* x, const float* y, const float* z, float* out)
+{
+	__m128 vx = _mm_loadu_ps(x);
+	__m128 vy = _mm_loadu_ps(y);
+	__m128 vz = _mm_loadu_ps(z);
+	__m128i x0 = FloorSSE2(vx);
+	__m128i y0 = FloorSSE2(vy);
+	__m128i z0 = FloorSSE2(vz);
+
+	__m128 one = _mm_set1_ps(1);
+	__m128 xd0 = _mm_sub_ps(vx, _mm_cvtepi32_ps(x0));
+	__m128 yd0 = _mm_sub_ps(vy, _mm_cvtepi32_ps(y0));
+	__m128 zd0 = _mm_sub_ps(vz, _mm_cvtepi32_ps(z0));
+	__m128 xd1 = _mm_sub_ps(xd0, one);
+	__m128 yd1 = _mm_sub_ps(yd0, one);
+	__m128 zd1 = _mm_sub_ps(zd0, one);
+	__m128 xs = InterpSSE2(interp, xd0);
+	__m128 ys = InterpSSE2(interp, yd0);
+	__m128 zs = InterpSSE2(interp, zd0);
+
+	alignas(16) int xi[4], yi[4], zi[4];
+	_mm_store_si128((__m128i*)xi, x0);
+	_mm_store_si128((__m128i*)yi, y0);
+	_mm_store_si128((__m128i*)zi, z0);
+
+	// corner c = dx + 2 * dy + 4 * dz
+	alignas(16) float gx[8][4], gy[8][4], gz[8][4];
+	for (int c = 0; c < 8; c++)
+		GradLanes3D(perm, perm12, offset, 4, xi, yi, zi, c & 1, (c >> 1) & 1, c >> 2, gx[c], gy[c], gz[c]);
+
+	__m128 xf00 = LerpSSE2(GradDotSSE2(gx[0], gy[0], gz[0], xd0, yd0, zd0), GradDotSSE2(gx[1], gy[1], gz[1], xd1, yd0, zd0), xs);
+	__m128 xf10 = LerpSSE2(GradDotSSE2(gx[2], gy[2], gz[2], xd0, yd1, zd0), GradDotSSE2(gx[3], gy[3], gz[3], xd1, yd1, zd0), xs);
+	__m128 xf01 = LerpSSE2(GradDotSSE2(gx[4], gy[4], gz[4], xd0, yd0, zd1), GradDotSSE2(gx[5], gy[5], gz[5], xd1, yd0, zd1), xs);
+	__m128 xf11 = LerpSSE2(GradDotSSE2(gx[6], gy[6], gz[6], xd0, yd1, zd1), GradDotSSE2(gx[7], gy[7], gz[7], xd1, yd1, zd1), xs);
+
+	__m128 yf0 = LerpSSE2(xf00, xf10, ys);
+	__m128 yf1 = LerpSSE2(xf01, xf11, ys);
+
+	_mm_storeu_ps(out, LerpSSE2(yf0, yf1, zs));
+}
+
+// AVX2, 8 points per call, the gradient components are gathered from the LUTs
+
+FN_TARGET_AVX2 static inline __m256i FloorAVX2(__m256 f)
+{
+	return _mm256_add_epi32(_mm256_cvttps_epi32(f), _mm256_castps_si256(_mm256_cmp_ps(f, _mm256_setzero_ps(), _CMP_LT_OQ)));
+}
+
+FN_TARGET_AVX2 static inline __m256 LerpAVX2(__m256 a, __m256 b, __m256 t)
+{
+	return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+}
+
+FN_TARGET_AVX2 static inline __m256 InterpAVX2(int interp, __m256 t)
+{
+	switch (interp)
+	{
+	case FastNoise::Hermite:
+		return _mm256_mul_ps(_mm256_mul_ps(t, t), _mm256_sub_ps(_mm256_set1_ps(3), _mm256_mul_ps(_mm256_set1_ps(2), t)));
+	case FastNoise::Quintic:
+		return _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(t, t), t),
+		                     _mm256_add_ps(_mm256_mul_ps(t, _mm256_sub_ps(_mm256_mul_ps(t, _mm256_set1_ps(6)), _mm256_set1_ps(15))), _mm256_set1_ps(10)));
+	default:
+		return t;
+	}
+}
+
+FN_TARGET_AVX2 static inline __m256 GradDotAVX2(const int* lut, __m256 xd, __m256 yd)
+{
+	__m256i idx = _mm256_load_si256((const __m256i*)lut);
+	return _mm256_add_ps(_mm256_mul_ps(xd, _mm256_i32gather_ps(GRAD_X, idx, 4)),
+	                     _mm256_mul_ps(yd, _mm256_i32gather_ps(GRAD_Y, idx, 4)));
+}
+
+FN_TARGET_AVX2 static inline __m256 GradDotAVX2(const int* lut, __m256 xd, __m256 yd, __m256 zd)
+{
+	__m256i idx = _mm256_load_si256((const __m256i*)lut);
+	return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(xd, _mm256_i32gather_ps(GRAD_X, idx, 4)),
+	                                   _mm256_mul_ps(yd, _mm256_i32gather_ps(GRAD_Y, idx, 4))),
+	                     _mm256_mul_ps(zd, _mm256_i32gather_ps(GRAD_Z, idx, 4)));
+}
+
+FN_TARGET_AVX2 static void SinglePerlinAVX2(const unsigned char* perm, const unsigned char* perm12, unsigned char offset, int interp,
+                                            const float* x, const float* y, float* out)
+{
+	__m256 vx = _mm256_loadu_ps(x);
+	__m256 vy = _mm256_loadu_ps(y);
+	__m256i x0 = FloorAVX2(vx);
+	__m256i y0 = FloorAVX2(vy);
+
+	__m256 one = _mm256_set1_ps(1);
+	__m256 xd0 = _mm256_sub_ps(vx, _mm256_cvtepi32_ps(x0));
+	__m256 yd0 = _mm256_sub_ps(vy, _mm256_cvtepi32_ps(y0));
+	__m256 xd1 = _mm256_sub_ps(xd0, one);
+	__m256 yd1 = _mm256_sub_ps(yd0, one);
+	__m256 xs = InterpAVX2(interp, xd0);
+	__m256 ys = InterpAVX2(interp, yd0);
+
+	alignas(32) int xi[8], yi[8];
+	_mm256_store_si256((__m256i*)xi, x0);
+	_mm256_store_si256((__m256i*)yi, y0);
+
+	// The permutation tables are bytes, so the hashing stays scalar and only the gradients are gathered
+	alignas(32) int lut[4][8];
+	for (int l = 0; l < 8; l++)
+	{
+		int xa = xi[l] & 0xff, xb = (xi[l] + 1) & 0xff;
+		int ya = yi[l] & 0xff, yb = (yi[l] + 1) & 0xff;
+		lut[0][l] = perm12[xa + perm[ya + offset]];
+		lut[1][l] = perm12[xb + perm[ya + offset]];
+		lut[2][l] = perm12[xa + perm[yb + offset]];
+		lut[3][l] = perm12[xb + perm[yb + offset]];
+	}
+
+	__m256 xf0 = LerpAVX2(GradDotAVX2(lut[0], xd0, yd0), GradDotAVX2(lut[1], xd1, yd0), xs);
+	__m256 xf1 = LerpAVX2(GradDotAVX2(lut[2], xd0, yd1), GradDotAVX2(lut[3], xd1, yd1), xs);
+
+	_mm256_storeu_ps(out, LerpAVX2(xf0, xf1, ys));
+}
+
+FN_TARGET_AVX2 static void SinglePerlinAVX2(const unsigned char* perm, const unsigned char* perm12, unsigned char offset, int interp,
+                                            const float* x, const float* y, const float* z, float* out)
+{
+	__m256 vx = _mm256_loadu_ps(x);
+	__m256 vy = _mm256_loadu_ps(y);
+	__m256 vz = _mm256_loadu_ps(z);
+	__m256i x0 = FloorAVX2(vx);
+	__m256i y0 = FloorAVX2(vy);
+	__m256i z0 = FloorAVX2(vz);
+
+	__m256 one = _mm256_set1_ps(1);
+	__m256 xd0 = _mm256_sub_ps(vx, _mm256_cvtepi32_ps(x0));
+	__m256 yd0 = _mm256_sub_ps(vy, _mm256_cvtepi32_ps(y0));
+	__m256 zd0 = _mm256_sub_ps(vz, _mm256_cvtepi32_ps(z0));
+	__m256 xd1 = _mm256_sub_ps(xd0, one);
+	__m256 yd1 = _mm256_sub_ps(yd0, one);
+	__m256 zd1 = _mm256_sub_ps(zd0, one);
+	__m256 xs = InterpAVX2(interp, xd0);
+	__m256 ys = InterpAVX2(interp, yd0);
+	__m256 zs = InterpAVX2(interp, zd0);
+
+	alignas(32) int xi[8], yi[8], zi[8];
+	_mm256_store_si256((__m256i*)xi, x0);
+	_mm256_store_si256((__m256i*)yi, y0);
+	_mm256_store_si256((__m256i*)zi, z0);
+
+	// corner c = dx + 2 * dy + 4 * dz
+	alignas(32) int lut[8][8];
+	for (int l = 0; l < 8; l++)
+	{
+		for (int c = 0; c < 8; c++)
+		{
+			int xc = (xi[l] + (c & 1)) & 0xff;
+			int yc = (yi[l] + ((c >> 1) & 1)) & 0xff;
+			int zc = (zi[l] + (c >> 2)) & 0xff;
+			lut[c][l] = perm12[xc + perm[yc + perm[zc + offset]]];
+		}
+	}
+
+	__m256 xf00 = LerpAVX2(GradDotAVX2(lut[0], xd0, yd0, zd0), GradDotAVX2(lut[1], xd1, yd0, zd0), xs);
+	__m256 xf10 = LerpAVX2(GradDotAVX2(lut[2], xd0, yd1, zd0), GradDotAVX2(lut[3], xd1, yd1, zd0), xs);
+	__m256 xf01 = LerpAVX2(GradDotAVX2(lut[4], xd0, yd0, zd1), GradDotAVX2(lut[5], xd1, yd0, zd1), xs);
+	__m256 xf11 = LerpAVX2(GradDotAVX2(lut[6], xd0, yd1, zd1), GradDotAVX2(lut[7], xd1, yd1, zd1), xs);
+
+	__m256 yf0 = LerpAVX2(xf00, xf10, ys);
+	__m256 yf1 = LerpAVX2(xf01, xf11, ys);
+
+	_mm256_storeu_ps(out, LerpAVX2(yf0, yf1, zs));
+}
+
+// Evaluates one octave on FN_BATCH_WIDTH points, z == nullptr selects 2D
+static void SinglePerlinBatch(FastNoise::SIMDLevel simdLevel, const unsigned char* perm, const unsigned char* perm12, unsigned char offset, int interp,
+                              const float* x, const float* y, const float* z, float* out)
+{
+	if (simdLevel == FastNoise::SIMD_AVX2)
+	{
+		if (z) SinglePerlinAVX2(perm, perm12, offset, interp, x, y, z, out);
+		else SinglePerlinAVX2(perm, perm12, offset, interp, x, y, out);
+		return;
+	}
+
+	for (int i = 0; i < FN_BATCH_WIDTH; i += 4)
+	{
+		if (z) SinglePerlinSSE2(perm, perm12, offset, interp, x + i, y + i, z + i, out + i);
+		else SinglePerlinSSE2(perm, perm12, offset, interp, x + i, y + i, out + i);
+	}
+}
+
+#endif
+
+// Evaluates GetNoise(...) on FN_BATCH_WIDTH points, z == nullptr selects 2D
+void FastNoise::PerlinBatch(SIMDLevel simdLevel, const FN_DECIMAL* x, const FN_DECIMAL* y, const FN_DECIMAL* z, FN_DECIMAL* out) const
+{
+#ifdef FN_SIMD_X86
+	FN_DECIMAL xf[FN_BATCH_WIDTH], yf[FN_BATCH_WIDTH], zf[FN_BATCH_WIDTH], octave[FN_BATCH_WIDTH];
+	FN_DECIMAL* zp = z ? zf : nullptr;
+
+	for (int j = 0; j < FN_BATCH_WIDTH; j++)
+	{
+		xf[j] = x[j] * m_frequency;
+		yf[j] = y[j] * m_frequency;
+		zf[j] = z ? z[j] * m_frequency : 0;
+	}
+
+	if (m_noiseType == Perlin)
+	{
+		SinglePerlinBatch(simdLevel, m_perm, m_perm12, 0, m_interp, xf, yf, zp, out);
+		return;
+	}
+
+	// PerlinFractal, same accumulation as SinglePerlinFractal{FBM,Billow,RigidMulti}
+	SinglePerlinBatch(simdLevel, m_perm, m_perm12, m_perm[0], m_interp, xf, yf, zp, octave);
+	for (int j = 0; j < FN_BATCH_WIDTH; j++)
+	{
+		switch (m_fractalType)
+		{
+		case FBM:        out[j] = octave[j]; break;
+		case Billow:     out[j] = FastAbs(octave[j]) * 2 - 1; break;
+		case RigidMulti: out[j] = 1 - FastAbs(octave[j]); break;
+		}
+	}
+
+	FN_DECIMAL amp = 1;
+	int i = 0;
+
+	while (++i < m_octaves)
+	{
+		for (int j = 0; j < FN_BATCH_WIDTH; j++)
+		{
+			xf[j] *= m_lacunarity;
+			yf[j] *= m_lacunarity;
+			zf[j] *= m_lacunarity;
+		}
+
+		amp *= m_gain;
+		SinglePerlinBatch(simdLevel, m_perm, m_perm12, m_perm[i], m_interp, xf, yf, zp, octave);
+		for (int j = 0; j < FN_BATCH_WIDTH; j++)
+		{
+			switch (m_fractalType)
+			{
+			case FBM:        out[j] += octave[j] * amp; break;
+			case Billow:     out[j] += (FastAbs(octave[j]) * 2 - 1) * amp; break;
+			case RigidMulti: out[j] -= (1 - FastAbs(octave[j])) * amp; break;
+			}
+		}
+	}
+
+	if (m_fractalType != RigidMulti)
+	{
+		for (int j = 0; j < FN_BATCH_WIDTH; j++)
+			out[j] *= m_fractalBounding;
+	}
+#else
+	(void)simdLevel;
+	for (int j = 0; j < FN_BATCH_WIDTH; j++)
+		out[j] = z ? GetNoise(x[j], y[j], z[j]) : GetNoise(x[j], y[j]);
+#endif
+}
+
+void FastNoise::GetNoiseSet(const FN_DECIMAL* x, const FN_DECIMAL* y, FN_DECIMAL* out, int count) const
+{
+	SIMDLevel simdLevel = ActiveSIMDLevel();
+	int i = 0;
+
+	if (simdLevel != SIMD_Scalar)
+	{
+		for (; i + FN_BATCH_WIDTH <= count; i += FN_BATCH_WIDTH)
+			PerlinBatch(simdLevel, x + i, y + i, nullptr, out + i);
+	}
+
+	for (; i < count; i++)
+		out[i] = GetNoise(x[i], y[i]);
+}
+
+void FastNoise::GetNoiseSet(const FN_DECIMAL* x, const FN_DECIMAL* y, const FN_DECIMAL* z, FN_DECIMAL* out, int count) const
+{
+	SIMDLevel simdLevel = ActiveSIMDLevel();
+	int i = 0;
+
+	if (simdLevel != SIMD_Scalar)
+	{
+		for (; i + FN_BATCH_WIDTH <= count; i += FN_BATCH_WIDTH)
+			PerlinBatch(simdLevel, x + i, y + i, z + i, out + i);
+	}
+
+	for (; i < count; i++)
+		out[i] = GetNoise(x[i], y[i], z[i]);
+}
+
+void FastNoise::FillNoiseGrid(FN_DECIMAL* out, int sizeX, int sizeY,
+                              FN_DECIMAL startX, FN_DECIMAL startY, FN_DECIMAL stepX, FN_DECIMAL stepY, int rowStride) const
+{
+	if (rowStride <= 0)
+		rowStride = sizeX;
+
+	// Coordinates are generated in small blocks so no heap memory is needed
+	const int BLOCK = 64;
+	FN_DECIMAL xs[BLOCK], ys[BLOCK];
+
+	for (int row = 0; row < sizeY; row++)
+	{
+		FN_DECIMAL y = startY + row * stepY;
+		for (int col = 0; col < sizeX; col += BLOCK)
+		{
+			int n = std::min(BLOCK, sizeX - col);
+			for (int j = 0; j < n; j++)
+			{
+				xs[j] = startX + (col + j) * stepX;
+				ys[j] = y;
+			}
+			GetNoiseSet(xs, ys, out + (size_t)row * rowStride + col, n);
+		}
+	}
+}
+
+void FastNoise::FillNoiseGrid(FN_DECIMAL* out, int sizeX, int sizeY, int sizeZ,
+                              FN_DECIMAL startX, FN_DECIMAL startY, FN_DECIMAL startZ,
+                              FN_DECIMAL stepX, FN_DECIMAL stepY, FN_DECIMAL stepZ) const
+{
+	const int BLOCK = 64;
+	FN_DECIMAL xs[BLOCK], ys[BLOCK], zs[BLOCK];
+
+	for (int k = 0; k < sizeZ; k++)
+	{
+		FN_DECIMAL z = startZ + k * stepZ;
+		for (int row = 0; row < sizeY; row++)
+		{
+			FN_DECIMAL y = startY + row * stepY;
+			FN_DECIMAL* dst = out + ((size_t)k * sizeY + row) * sizeX;
+			for (int col = 0; col < sizeX; col += BLOCK)
+			{
+				int n = std::min(BLOCK, sizeX - col);
+				for (int j = 0; j < n; j++)
+				{
+					xs[j] = startX + (col + j) * stepX;
+					ys[j] = y;
+					zs[j] = z;
+				}
+				GetNoiseSet(xs, ys, zs, dst + col, n);
+			}
+		}
+	}
+}
@@ -3,11 +3,32 @@
 #define  STARTER_IMPLEMENTATION
 #include "modules/Starter.hpp"
 
+#define JOB_SYSTEM_IMPLEMENTATION
+#include "modules/JobSystem.hpp"
+
 #define  TEXTMAKER_IMPLEMENTATION
 #include "modules/TextMaker.hpp"
 
+#define IMPOSTORS_IMPLEMENTATION
+#include "modules/Impostors.hpp"
+
 #define  SCENE_IMPLEMENTATION
 #include "modules/Scene.hpp"
 
 #define ANIMATIONS_IMPLEMENTATION
 #include "modules/Animations.hpp"
+
+#define TERRAIN_CACHE_IMPLEMENTATION
+#include "modules/TerrainCache.hpp"
+
+#define CLIPMAP_IMPLEMENTATION
+#include "modules/Clipmap.hpp"
+
+#define GROUND_MESH_IMPLEMENTATION
+#include "modules/GroundMesh.hpp"
+
+#define HEIGHTFIELD_RING_IMPLEMENTATION
+#include "modules/HeightfieldRing.hpp"
+
+#define VEGETATION_GRID_IMPLEMENTATION
+#include "modules/VegetationGrid.hpp"
@@ -4,9 +4,17 @@
 #include <json.hpp>
 
 #include "modules/Starter.hpp"
+#include "modules/JobSystem.hpp"
 #include "modules/TextMaker.hpp"
+#include "modules/Impostors.hpp"
 #include "modules/Scene.hpp"
 #include "modules/Animations.hpp"
+#include "modules/TerrainCache.hpp"
+#include "modules/Clipmap.hpp"
+#include "modules/GroundMesh.hpp"
+#include "modules/HeightfieldRing.hpp"
+#include "modules/VegetationGrid.hpp"
+#include "modules/TerrainParameters.hpp"
 #include <random>
 
 #include <AL/al.h>
@@ -22,6 +30,7 @@
 #include <fstream>
 #include <vector>
 #include <cstdint>
+#include <limits>
 
 struct VertexSimp
 {
@@ -35,14 +44,6 @@ struct skyBoxVertex
     glm::vec3 pos;
 };
 
-struct VertexTan
-{
-    glm::vec3 pos;
-    glm::vec3 norm;
-    glm::vec2 UV;
-    glm::vec4 tan;
-};
-
 struct GlobalUniformBufferObject
 {
     alignas(16) glm::vec3 lightDir;
@@ -59,6 +60,16 @@ struct GlobalUniformBufferGround
     alignas(16) glm::vec4 otherParams;
 };
 
+// Parameters of the ground displacement done in ModelWithTangentsGPU.vert
+struct GroundDisplacementUniform
+{
+    alignas(16) glm::vec4 position;     // XZ offset of the mesh in world space, XZ scale of the mesh, water noise time
+    alignas(16) glm::vec4 noise;        // noise frequency in world units, height scale, water floor, water blend width
+    alignas(16) glm::vec4 grid;         // finite difference step, in object space
+    alignas(16) glm::vec4 quantization; // VertexTerrain: object space size of a unit of XZ and of Y
+    alignas(16) glm::uvec4 perm[64];    // permutation table of noiseGround, 4 entries per element
+};
+
 struct UniformBufferObjectSimp
 {
     alignas(16) glm::mat4 mvpMat;
@@ -83,6 +94,24 @@ protected:
     float orthoZoom = 20.0f;
 
     bool changeTangents = true;
+    // ground normals from the grid neighbours (true) or accumulated over the triangles (false)
+    bool gridNormals = true;
+
+    // threads of the job system, that update the ground mesh and record the secondary command buffers of the scene pass:
+    // 0 = one per hardware thread, 1 = render thread only
+    int jobThreadCount = 0;
+    JobSystem jobs;
+
+    // ground displaced on the CPU (shift2Dplane) or in the vertex shader, chosen at startup
+    bool groundOnGPU = false;
+    // CPU ground written with VertexTerrain instead of VertexTan, to cut the bytes written every frame
+    bool groundCompact = false;
+    // trees and impostors culled, and their level of detail chosen, by a compute shader
+    bool gpuCulling = false;
+    GroundDisplacementUniform groundDisplacement{};
+
+    // the memory and geometry statistics are printed once, not at every resize of the window
+    bool statsPrinted = false;
 
     CameraMode currentCameraMode = THIRD_PERSON;
     // Here you list all the Vulkan objects you need:
@@ -92,10 +121,13 @@ protected:
 
     // Vertex formants, Pipelines [Shader couples] and Render passes
     VertexDescriptor VDsimp;
+    // VDsimp followed by the InstanceTransform of each instance, for the instanced techniques
+    VertexDescriptor VDsimpInst;
     VertexDescriptor VDskyBox;
     VertexDescriptor VDtan;
+    VertexDescriptor VDterrain;
     RenderPass RP;
-    Pipeline PsimpObj, PskyBox, P_PBR, Pgem;
+    Pipeline PsimpObj, PsimpInst, Pimpostor, PskyBox, P_PBR, Pgem;
 
     // Models, textures and Descriptors (values assigned to the uniforms)
     Scene SC;
@@ -149,7 +181,18 @@ protected:
     float boostFovIncrease = glm::radians(15.0f);
     float currentFov = 0.f;
     FastNoise noise, noiseGround;
-    std::vector<unsigned char> rawVB_original = {};
+    // the clipmap and the heights of the ground are in TerrainParameters.hpp
+    // far plane of the perspective projections, it reaches the border of the clipmap
+    float farPlane = 500.f;
+    // ground mesh displaced on the CPU, its cache of level 0 is also read by sampleHeight()
+    GroundMesh groundMesh;
+    // XZ position of the ground mesh, it follows the airplane in steps of the coarsest spacing, so every
+    // vertex stays on the lattice of its level
+    glm::vec3 groundSnapPosition = glm::vec3(0.0f);
+    float groundWaterTime = 0.0f;
+    // the ground state changes at every update, and each swap chain image records the state of its region
+    int64_t groundStamp = 0;
+    std::vector<int64_t> groundRegionStamp;
     float noiseOffset = 0.0f;
     float shakeIntensity = 0.2f;
     float shakeSpeed = 100.0f;
@@ -159,8 +202,19 @@ protected:
     std::uniform_real_distribution<float> distY;
     std::uniform_real_distribution<float> distZ;
 
-    std::uniform_real_distribution<float> treeX;
-    std::uniform_real_distribution<float> treeZ;
+    // The trees live in the cells of a grid around the airplane: TREE_INSTANCES instances of the tree technique,
+    // TREE_INSTANCES / TREE_VARIANTS consecutive ones for each tree model of scene.json.
+    // The density depends only on TREE_MIN_DISTANCE: more trees need more instances in scene.json
+    VegetationGrid vegetation;
+    const int TREE_INSTANCES = 1000;
+    const int TREE_VARIANTS = 20;
+    const float TREE_CELL_SIZE = 111.0f;
+    const int TREE_CELL_RADIUS = 4;         // cells on each side of the one of the airplane
+    const float TREE_MIN_DISTANCE = 30.0f;
+    const int TREE_TILES = 8;
+    const uint32_t TREE_SEED = 2024;
+    const float TREE_MIN_HEIGHT = -0.5f;    // lower ground is under water
+    const float TREE_MAX_SLOPE = 1.0f;
 
     // Airplane indexes
     int airplaneTechIdx = -1;
@@ -186,7 +240,7 @@ protected:
     bool hardImpact = false;
     bool isBoosting = false;
     bool inWater = false;
-    float waterLevel = -2.5f;
+    float waterLevel = WATER_LEVEL;
     float grassLevel = -1.5f;
     float rockLevel = 15.f;
 
@@ -198,39 +252,40 @@ protected:
     dMass odeAirplaneMass = {};
     dJointGroupID contactgroup = nullptr;
 
-    const int HF_ROWS = 256;
-    const int HF_COLS = 256;
-    const float CELL_SIZE = 0.1f;           // world‑space spacing between samples
-    const float NOISE_SCALE = 0.004f;       // noise frequency
-    const float HEIGHT_SCALE = 0.05f;       // noise amplitude
-    std::vector<float> heightSamples;
+    // heights of the ODE heightfield, around the airplane
+    HeightfieldRing heightRing;
 
     // Where ODE will store the heightfield data
     dHeightfieldDataID hfData = dGeomHeightfieldDataCreate();
     dGeomID            groundHF = nullptr;
 
+    // ODE reads the heights through this callback: (x, z) are sample indices relative to the current origin
+    static dReal heightfieldCallback(void* userData, int x, int z) {
+        CG_Exam* app = static_cast<CG_Exam*>(userData);
+        return app->heightRing.at(app->heightRing.getOriginX() + x, app->heightRing.getOriginZ() + z);
+    }
+
     // Noise generator for the ground heightfield, this will update the height of ODE ground geometry
     void rebuildHeightSamples(float worldX, float worldZ, float scale){
-        // center the grid on the coordinates passed
-        float startX = worldX - HF_COLS/2 * CELL_SIZE;
-        float startZ = worldZ - HF_ROWS/2 * CELL_SIZE;
-        // loop over the grid and sample the noise
-        for(int rz = 0; rz < HF_ROWS; ++rz){
-            for(int cx = 0; cx < HF_COLS; ++cx){
-                float wx = startX + cx * CELL_SIZE;
-                float wz = startZ + rz * CELL_SIZE;
-                float h  = noiseGround.GetNoise(wx * NOISE_SCALE,
-                                                wz * NOISE_SCALE)
-                           * HEIGHT_SCALE;
-                heightSamples[rz*HF_COLS + cx] = h * scale;
-                // std::cout << "Sample at (" << wx << ", " << wz << ") = " << h << "\n";
-            }
+        // center the grid on the coordinates passed, only the samples entering it are computed
+        if (heightRing.recenter(worldX, worldZ, scale)) {
+            // the Perlin noise is in [-1, 1]
+            dGeomHeightfieldDataSetBounds(hfData, -HEIGHT_SCALE * scale, HEIGHT_SCALE * scale);
         }
+
         // Set the ground height to the sample at the center of the grid (airplane position)
-        groundY = heightSamples[HF_ROWS/2 * HF_COLS + HF_COLS/2];
-        // std::cout << "Sample at airplane position: " << heightSamples[HF_ROWS/2 * HF_COLS + HF_COLS/2] << "\n";
+        groundY = heightRing.at(heightRing.getOriginX() + HF_COLS/2, heightRing.getOriginZ() + HF_ROWS/2);
+        // std::cout << "Sample at airplane position: " << groundY << "\n";
     };
 
+    // Places the ODE heightfield so that its samples lie on the lattice points of the ring buffer
+    void placeGroundHeightfield() {
+        dGeomSetPosition(groundHF,
+                         (heightRing.getOriginX() + (HF_COLS - 1) * 0.5f) * CELL_SIZE,
+                         0.0f,
+                         (heightRing.getOriginZ() + (HF_ROWS - 1) * 0.5f) * CELL_SIZE);
+    }
+
     // Audio parameters
     ALCdevice* device = nullptr;
     ALCcontext* context = nullptr;
@@ -295,23 +350,8 @@ protected:
         // refill the sample array around the current airplane XZ
         rebuildHeightSamples( airplanePosition.x, airplanePosition.z, scale);
 
-        // rebuild the ODE ground geometry
-        dGeomHeightfieldDataBuildSingle(
-          hfData,
-          heightSamples.data(),
-          false,
-          HF_COLS * CELL_SIZE,
-          HF_ROWS * CELL_SIZE,
-          HF_COLS,
-          HF_ROWS,
-          1.0, 0.0, 1.0, false
-        );
-
-        // reposition the geom so it stays centered under the airplane
-        dGeomSetPosition(groundHF,
-                         airplanePosition.x,
-                         0.0f,
-                         airplanePosition.z);
+        // ODE reads the ring buffer through the callback, so the geometry only has to follow the new origin
+        placeGroundHeightfield();
     }
 
     // Here you load and setup all your Vulkan Models and Texutures.
@@ -320,6 +360,8 @@ protected:
     {
         currentFov = baseFov;
 
+        jobs.init(jobThreadCount);
+
         glfwSetWindowUserPointer(window, this);
         glfwSetScrollCallback(window, scroll_callback);
 
@@ -345,6 +387,10 @@ protected:
                                  {
                                      0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS,
                                      sizeof(GlobalUniformBufferGround), 1
+                                 },
+                                 {
+                                     1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT,
+                                     sizeof(GroundDisplacementUniform), 1
                                  }
                              });
 
@@ -406,6 +452,33 @@ protected:
                         }
                     });
 
+        VDsimpInst.init(this, {
+                            {0, sizeof(VertexSimp), VK_VERTEX_INPUT_RATE_VERTEX},
+                            {1, sizeof(InstanceTransform), VK_VERTEX_INPUT_RATE_INSTANCE}
+                        }, {
+                            {
+                                0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(VertexSimp, pos),
+                                sizeof(glm::vec3), POSITION
+                            },
+                            {
+                                0, 1, VK_FORMAT_R32G32B32_SFLOAT, offsetof(VertexSimp, norm),
+                                sizeof(glm::vec3), NORMAL
+                            },
+                            {
+                                0, 2, VK_FORMAT_R32G32_SFLOAT, offsetof(VertexSimp, UV),
+                                sizeof(glm::vec2), UV
+                            },
+                            // a mat4 attribute takes one location per column
+                            {1, 3, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(InstanceTransform, mMat) + 0 * sizeof(glm::vec4), sizeof(glm::vec4), OTHER},
+                            {1, 4, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(InstanceTransform, mMat) + 1 * sizeof(glm::vec4), sizeof(glm::vec4), OTHER},
+                            {1, 5, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(InstanceTransform, mMat) + 2 * sizeof(glm::vec4), sizeof(glm::vec4), OTHER},
+                            {1, 6, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(InstanceTransform, mMat) + 3 * sizeof(glm::vec4), sizeof(glm::vec4), OTHER},
+                            {1, 7, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(InstanceTransform, nMat) + 0 * sizeof(glm::vec4), sizeof(glm::vec4), OTHER},
+                            {1, 8, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(InstanceTransform, nMat) + 1 * sizeof(glm::vec4), sizeof(glm::vec4), OTHER},
+                            {1, 9, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(InstanceTransform, nMat) + 2 * sizeof(glm::vec4), sizeof(glm::vec4), OTHER},
+                            {1, 10, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(InstanceTransform, nMat) + 3 * sizeof(glm::vec4), sizeof(glm::vec4), OTHER}
+                        });
+
         VDskyBox.init(this, {
                           {0, sizeof(skyBoxVertex), VK_VERTEX_INPUT_RATE_VERTEX}
                       }, {
@@ -436,6 +509,19 @@ protected:
                        }
                    });
 
+        VDterrain.init(this, {
+                           {0, sizeof(VertexTerrain), VK_VERTEX_INPUT_RATE_VERTEX}
+                       }, {
+                           {
+                               0, 0, VK_FORMAT_R16G16B16A16_SNORM, offsetof(VertexTerrain, pos),
+                               sizeof(VertexTerrain::pos), OTHER
+                           },
+                           {
+                               0, 1, VK_FORMAT_R8G8B8A8_SNORM, offsetof(VertexTerrain, frame),
+                               sizeof(VertexTerrain::frame), OTHER
+                           }
+                       });
+
         VDRs.resize(3);
         VDRs[0].init("VDsimp", &VDsimp);
         VDRs[1].init("VDskybox", &VDskyBox);
@@ -456,15 +542,31 @@ protected:
                       {&DSLglobal, &DSLlocalSimp});
         Pgem.init(this, &VDsimp, "shaders/ModelSimple.vert.spv", "shaders/CookTorranceGem.frag.spv",
                   {&DSLglobal, &DSLlocalSimp});
+        // trees: one draw call for all the instances of the same model
+        PsimpInst.init(this, &VDsimpInst, "shaders/ModelSimpleInstanced.vert.spv", "shaders/CookTorrance.frag.spv",
+                       {&DSLglobal, &DSLlocalSimp});
+        // far trees: the billboards of their impostors, with the same uniforms and one draw call per model
+        Pimpostor.init(this, &VDsimpInst, "shaders/ImpostorInstanced.vert.spv", "shaders/Impostor.frag.spv",
+                       {&DSLglobal, &DSLlocalSimp});
 
         PskyBox.init(this, &VDskyBox, "shaders/SkyBoxShader.vert.spv", "shaders/SkyBoxShader.frag.spv", {&DSLskyBox});
         // Here we assure that the skybox is rendered before the other objects, where there is nothing else
         PskyBox.setCompareOp(VK_COMPARE_OP_LESS_OR_EQUAL);
 
-        P_PBR.init(this, &VDtan, "shaders/ModelWithTangents.vert.spv", "shaders/PBR.frag.spv",
-                   {&DSLglobalGround, &DSLlocalPBR});
+        // the GPU variant of the vertex shader displaces the flat ground grid by itself,
+        // the compact one decodes the quantized vertices written by shift2Dplane
+        if (groundOnGPU) {
+            P_PBR.init(this, &VDtan, "shaders/ModelWithTangentsGPU.vert.spv", "shaders/PBR.frag.spv",
+                       {&DSLglobalGround, &DSLlocalPBR});
+        } else if (groundCompact) {
+            P_PBR.init(this, &VDterrain, "shaders/ModelWithTangentsCompact.vert.spv", "shaders/PBR.frag.spv",
+                       {&DSLglobalGround, &DSLlocalPBR});
+        } else {
+            P_PBR.init(this, &VDtan, "shaders/ModelWithTangents.vert.spv", "shaders/PBR.frag.spv",
+                       {&DSLglobalGround, &DSLlocalPBR});
+        }
 
-        PRs.resize(4);
+        PRs.resize(6);
 
         PRs[0].init("CookTorranceNoiseSimp", {
                         {
@@ -477,7 +579,7 @@ protected:
                                 }
                             }
                         }
-                    }, /*TotalNtextures*/2, &VDsimp);
+                    }, /*TotalNtextures*/2, &VDsimp, /*instanced*/false, /*culled*/true);
         PRs[1].init("CookTorranceGem", {
                         {
                             &Pgem, {
@@ -489,7 +591,7 @@ protected:
                                 }
                             }
                         }
-                    }, /*TotalNtextures*/2, &VDsimp);
+                    }, /*TotalNtextures*/2, &VDsimp, /*instanced*/false, /*culled*/true);
         PRs[2].init("SkyBox", {
                         {
                             &PskyBox, {
@@ -517,6 +619,30 @@ protected:
                             }
                         }
                     }, /*TotalNtextures*/7, &VDtan);
+        PRs[4].init("CookTorranceNoiseSimpInstanced", {
+                        {
+                            &PsimpInst, {
+                                //Pipeline and DSL for the first pass
+                                /*DSLglobal*/{},
+                                /*DSLlocalSimp*/{
+                                    /*t0*/{true, 0, {}}, // index 0 of the "texture" field in the json file
+                                    /*t1*/{true, 1, {}} // index 1 of the "texture" field in the json file
+                                }
+                            }
+                        }
+                    }, /*TotalNtextures*/2, &VDsimp, /*instanced*/true, /*culled*/true);
+        PRs[5].init("ImpostorInstanced", {
+                        {
+                            &Pimpostor, {
+                                //Pipeline and DSL for the first pass
+                                /*DSLglobal*/{},
+                                /*DSLlocalSimp*/{
+                                    /*t0*/{true, 0, {}}, // albedo atlas
+                                    /*t1*/{true, 1, {}} // normal atlas
+                                }
+                            }
+                        }
+                    }, /*TotalNtextures*/2, &VDsimp, /*instanced*/true, /*culled*/true);
 
         // Models, textures and Descriptors (values assigned to the uniforms)
 
@@ -526,11 +652,26 @@ protected:
         DPSZs.setsInPool = 10;
 
         std::cout << "\nLoading the scene\n\n";
-        if (SC.init(this, /*Npasses*/1, VDRs, PRs, "assets/models/scene.json") != 0)
+        // set 0 of the airplane, trees and gems (DSLglobal) is the same for all of them
+        if (SC.init(this, /*Npasses*/1, VDRs, PRs, "assets/models/scene.json", {&DSLglobal}) != 0)
         {
             std::cout << "ERROR LOADING THE SCENE\n";
             exit(0);
         }
+        if (gpuCulling) SC.initGpuCulling();
+        SC.initParallelRecording(&jobs);
+
+        // the noise generators must be configured before the ground heightfield is first sampled
+        noise.SetSeed(1337);
+        noise.SetNoiseType(FastNoise::Perlin);
+
+        initGroundNoise(noiseGround);
+
+        // the vertex shader of the GPU ground evaluates the same noise
+        const unsigned char* perm = noiseGround.GetPermutationTable();
+        for (int i = 0; i < 256; i++) {
+            groundDisplacement.perm[i / 4][i % 4] = perm[i];
+        }
 
         // Finding index of airplain and rotor
         for (int i = 0; i < PRs.size(); i++)
@@ -562,15 +703,15 @@ protected:
             dWorldSetGravity(odeWorld, 0, -9.81, 0); // Imposta la gravità!
             contactgroup = dJointGroupCreate(0);
 
-            // build the heightfield data once
-            heightSamples = std::vector<float>(HF_ROWS * HF_COLS);
+            // build the heightfield data once, its heights are read from the ring buffer through the callback
+            heightRing.init(&noiseGround, HF_COLS, HF_ROWS, CELL_SIZE, NOISE_SCALE, HEIGHT_SCALE);
             rebuildHeightSamples( airplanePosition.x, airplanePosition.z, 100.f);
-            dGeomHeightfieldDataBuildSingle(
+            dGeomHeightfieldDataBuildCallback(
               hfData,
-              heightSamples.data(),           // pointer to your float array
-              /*bCopyHeightData=*/false,      // keep our array alive, no internal copy
-              /*width=*/ HF_COLS * CELL_SIZE, // X‑extent in world units
-              /*depth=*/ HF_ROWS * CELL_SIZE, // Z‑extent in world units
+              this,                           // user data passed to the callback
+              heightfieldCallback,
+              /*width=*/ (HF_COLS - 1) * CELL_SIZE, // X‑extent in world units
+              /*depth=*/ (HF_ROWS - 1) * CELL_SIZE, // Z‑extent in world units
               /*widthSamples=*/  HF_COLS,
               /*depthSamples=*/  HF_ROWS,
               /*scale=*/ 1.0f,                // scale the raw height values
@@ -578,13 +719,13 @@ protected:
               /*thickness=*/ 1.0f,            // thickness under the lowest sample
               /*bWrap=*/ false                // do not tile
             );
+            // callback heightfields have no bounds by default
+            dGeomHeightfieldDataSetBounds(hfData, -HEIGHT_SCALE * heightRing.getScale(),
+                                          HEIGHT_SCALE * heightRing.getScale());
 
             // ODE ground creation
             groundHF = dCreateHeightfield(odeSpace, hfData, /*bPlaceable=*/true);
-            dGeomSetPosition(groundHF,
-                             airplanePosition.x,
-                             0.0f,
-                             airplanePosition.z);
+            placeGroundHeightfield();
             // create rigid body of airplane
             odeAirplaneBody = dBodyCreate(odeWorld);
             dBodySetPosition(odeAirplaneBody, airplanePosition.x, airplanePosition.y, airplanePosition.z);
@@ -604,8 +745,9 @@ protected:
         // initializes the textual output
         txt.init(this, windowWidth, windowHeight);
 
-        // submits the main command buffer
-        submitCommandBuffer("main", 0, populateCommandBufferAccess, this);
+        // the main command buffer is recorded every frame, since the visible instances change;
+        // the text overlay keeps its own cached command buffer
+        submitFrameCommandBuffer("main", 0, populateCommandBufferAccess, this);
 
         // Prepares for showing the FPS count
         txt.print(1.0f, 1.0f, "FPS:", FPS, "CO", false, false, true, TAL_RIGHT, TRH_RIGHT, TRV_BOTTOM,
@@ -619,18 +761,6 @@ protected:
         distY = std::uniform_real_distribution<float>(10.0f, 80.0f);
         distZ = std::uniform_real_distribution<float>(-100.0f, 100.0f);
 
-        treeX = std::uniform_real_distribution<float>(-500.0f, 500.0f);
-        treeZ = std::uniform_real_distribution<float>(-500.0f, 500.0f);
-
-        noise.SetSeed(1337);
-        noise.SetNoiseType(FastNoise::Perlin);
-
-        noiseGround.SetSeed(1356);
-        noiseGround.SetFrequency(2.f);
-        noiseGround.SetNoiseType(FastNoise::Perlin);
-        noiseGround.SetFractalOctaves(2);
-        noiseGround.SetFractalGain(0.8f);
-
         // init the gems position randomly but will have no scale
         gemWorlds.resize(10);
         for (auto& M : gemWorlds)
@@ -682,27 +812,45 @@ protected:
             // initialize dynamically the ground
             std::cout << "Ground mesh '2DplaneTan' found with ID: " << groundMeshId << "\n";
             ground = SC.M[ groundMeshId ];
-            rawVB_original = ground->vertices;
-            // right after you fill `ground->vertices` for the very first time:
-            size_t byteSize = ground->vertices.size();  // bytes of your interleaved array
-            ground->initDynamicVertexBuffer(this /* your BaseProject ptr */, byteSize);
-            ground->updateVertexBuffer();
+
+            // The ground mesh of the scene is replaced by a clipmap generated here
+            float scaleXZ = glm::length(glm::vec3(groundBaseWm[0]));
+            groundMesh.init(&jobs, &noiseGround, CLIPMAP_LEVELS, CLIPMAP_HALF_SIZE, CLIPMAP_SPACING, scaleXZ,
+                            NOISE_SCALE, HEIGHT_SCALE, groundCompact);
+            float extent = CLIPMAP_HALF_SIZE * CLIPMAP_SPACING * (float)(1 << (CLIPMAP_LEVELS - 1));
+            farPlane = std::max(farPlane, extent);
+            std::cout << "Ground clipmap: " << CLIPMAP_LEVELS << " levels, " << groundMesh.getVertexCount()
+                      << " vertices, spacing " << CLIPMAP_SPACING << ", extent " << extent << "\n";
+
+            ground->cleanup();
+            ground->vertices = groundMesh.vertices;
+            ground->indices = groundMesh.indices;
+            if (groundCompact) {
+                ground->VD = &VDterrain;
+                groundDisplacement.quantization = groundMesh.getQuantization();
+                std::cout << "Ground vertices: VertexTerrain, " << sizeof(VertexTerrain) << " bytes\n";
+            }
+
+            ground->createIndexBuffer();
+            if (groundOnGPU) {
+                // the flat grid is displaced by the vertex shader
+                std::cout << "Ground displaced on the GPU\n";
+                ground->createVertexBuffer();
+            } else {
+                // one persistently mapped region per swap chain image, all starting from the original vertices
+                size_t byteSize = ground->vertices.size();  // bytes of your interleaved array
+                ground->initDynamicVertexBuffer(this /* your BaseProject ptr */, byteSize);
+                ground->updateVertexBuffer();
+                groundRegionStamp.assign(imageRegions, -1);
+            }
         }
         // initialize the trees
-        treeWorld.resize(400);
-        for (auto& M : treeWorld)
-        {
-            float X, Z;
-            float Y = -100.f;
-            do {
-                X = treeX(rng);
-                Z = treeZ(rng);
-                Y = noiseGround.GetNoise(X * 0.004f, Z * 0.004f) * 0.05f * 500;
-            }while (Y < -0.5f);
-            M =
-                glm::translate(glm::mat4(1.0f),
-                               glm::vec3(X, Y, Z));
-        }
+        treeWorld.assign(TREE_INSTANCES, glm::mat4(1.0f));
+        vegetation.init(TREE_INSTANCES, TREE_VARIANTS, TREE_CELL_SIZE, TREE_CELL_RADIUS, TREE_MIN_DISTANCE, TREE_TILES,
+                        TREE_SEED, TREE_MIN_HEIGHT, TREE_MAX_SLOPE, [this](float x, float z) { return sampleHeight(x, z); });
+        std::cout << "Vegetation: " << TREE_TILES << " Poisson disk tiles, up to " << vegetation.getMaxPointsPerCell()
+                  << " trees per cell\n";
+        updateTreePositions();
 
         assert(groundTechIdx >= 0 && groundInstIdx >= 0);
 
@@ -739,18 +887,37 @@ protected:
 
         // This creates a new pipeline (with the current surface), using its shaders for the provided render pass
         PsimpObj.create(&RP);
+        PsimpInst.create(&RP);
+        Pimpostor.create(&RP);
         PskyBox.create(&RP);
         P_PBR.create(&RP);
         Pgem.create(&RP);
 
         SC.pipelinesAndDescriptorSetsInit();
         txt.pipelinesAndDescriptorSetsInit();
+
+        if (!statsPrinted) {
+            MemoryStats ms = memoryAllocator.getStats();
+            std::cout << "Device memory: " << ms.blocks << " blocks (" << (ms.blockBytes >> 20) << " MB) + "
+                      << ms.dedicated << " dedicated (" << (ms.dedicatedBytes >> 20) << " MB), " << ms.allocations
+                      << " allocations, " << (ms.bytesInUse >> 10) << " KB in use, fragmentation "
+                      << (int)(ms.fragmentation() * 100.0f + 0.5f) << "%\n";
+            std::cout << "Static meshes: " << (stagingRing.uploadedBytes >> 10) << " KB uploaded to device local memory in "
+                      << stagingRing.copies << " copies, " << stagingRing.submissions << " submissions\n";
+            std::cout << "Geometry pools: VDsimp " << VDsimp.pool.getModelCount() << " models in "
+                      << VDsimp.pool.getPageCount() << " pages, VDtan " << VDtan.pool.getModelCount() << " in "
+                      << VDtan.pool.getPageCount() << ", VDskybox " << VDskyBox.pool.getModelCount() << " in "
+                      << VDskyBox.pool.getPageCount() << "\n";
+            statsPrinted = true;
+        }
     }
 
     // Here you destroy your pipelines and Descriptor Sets!
     void pipelinesAndDescriptorSetsCleanup()
     {
         PsimpObj.cleanup();
+        PsimpInst.cleanup();
+        Pimpostor.cleanup();
         PskyBox.cleanup();
         P_PBR.cleanup();
         RP.cleanup();
@@ -781,6 +948,8 @@ protected:
         DSLglobal.cleanup();
 
         PsimpObj.destroy();
+        PsimpInst.destroy();
+        Pimpostor.destroy();
         PskyBox.destroy();
         P_PBR.destroy();
         Pgem.destroy();
@@ -789,6 +958,10 @@ protected:
 
         SC.localCleanup();
         txt.localCleanup();
+        groundMesh.cleanup();
+        heightRing.cleanup();
+        vegetation.cleanup();
+        jobs.cleanup();
 
         audioCleanUp();
 
@@ -804,7 +977,6 @@ protected:
     {
         // Simple trick to avoid having always 'T->'
         // in che code that populates the command buffer!
-        std::cout << "Populating command buffer for " << currentImage << "\n";
         CG_Exam* T = (CG_Exam*)Params;
         T->populateCommandBuffer(commandBuffer, currentImage);
     }
@@ -812,151 +984,50 @@ protected:
     // This is the real place where the Command Buffer is written
     void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage)
     {
-        std::cout << "Let's command buffer!";
-        // begin standard pass
-        RP.begin(commandBuffer, currentImage);
+        // the GPU driven instances must be culled before the pass begins
+        SC.recordGpuCulling(commandBuffer, currentImage);
 
-        SC.populateCommandBuffer(commandBuffer, 0, currentImage);
+        // begin standard pass: the scene is drawn by secondary command buffers, recorded by the job system
+        RP.begin(commandBuffer, currentImage, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+        SC.populateCommandBufferParallel(commandBuffer, &RP, 0, currentImage);
 
         RP.end(commandBuffer);
     }
 
-    // This is called every frame, to update the 2Dplane
-    void shift2Dplane() {
+    // This is called every frame, to update the 2Dplane.
+    // The mesh is written in place in the vertex buffer region of the current swap chain image: x, z and
+    // UVs of the regions never change after init, so only the heights, normals and tangents are written
+    void shift2Dplane(uint32_t currentImage) {
         if (gameState != GAME_OVER) {
-            // Retreving raw bytes of the ground mesh
-            ground->vertices = rawVB_original;
-            std::vector<unsigned char>& rawVB = ground->vertices;
-
-            // Stride is the size of a single vertex in bytes
-            size_t stride    = ground->VD->Bindings[0].stride;
-            // Get the position offset in the vertex structure (therefore lower than stride)
-            size_t posOffset = ground->VD->Position.offset;
-
-            glm::vec3 worldOffset = airplanePosition;
-            glm::vec3 scale;
-            scale.x = glm::length(glm::vec3(groundBaseWm[0]));
-            scale.y = glm::length(glm::vec3(groundBaseWm[1]));
-            scale.z = glm::length(glm::vec3(groundBaseWm[2]));
-
-            const float NOISE_SCALE  = 0.004f;
-            const float HEIGHT_SCALE = 0.05f;
-
-            float lx = 0.f, lz = 0.f, wx = 0.f, wz = 0.f, h = 0.f;
-            // for each vertex in the ground mesh
-            for (size_t i = 0; i < rawVB.size(); i += stride) {
-                glm::vec3* p =
-                    reinterpret_cast<glm::vec3*>(&rawVB[i + posOffset]);
-
-                // local XZ
-                lx = p->x * scale.x , lz = p->z * scale.z;
-                // world XZ
-                wx = lx + worldOffset.x;
-                wz = lz + worldOffset.z;
-
-                // computing height of that vertex
-                float rawH    = noiseGround.GetNoise(wx * NOISE_SCALE,
-                                                     wz * NOISE_SCALE)
-                              * HEIGHT_SCALE;
-
-                // water level
-                const float floorY      = (waterLevel - 0.2f) / 500.f;
-
-                // how wide (in world‑units) the blend region is around floorY
-                const float blendWidth  = 0.5f / 500.f;
-
-                // blend factor t that goes 0 to 1 as rawH goes from (floorY - blendWidth) up to (floorY + blendWidth)
-                float t = glm::smoothstep(floorY - blendWidth,
-                                          floorY + blendWidth,
-                                          rawH);
-
-                // small animation of water level
-                float flatH = floorY
-                            - std::abs(noiseGround.GetNoise(wx * NOISE_SCALE,
-                                                            wz * NOISE_SCALE,
-                                                            counterGlobal * 0.3f)
-                                       * 0.001f);
-
-                // mix between the two:
-                h = glm::mix(flatH, rawH, t);
-
-                // write back
-                p->y = h;
-
-            }
-            // ------- Normal, tangent and bi-tanget modification -------
-            if (changeTangents) {
-                // Allocate accumulators
-                size_t vertexCount = rawVB.size() / stride;
-                std::vector<glm::vec3> nAccum(vertexCount, glm::vec3(0.0f));
-                std::vector<glm::vec3> tAccum(vertexCount, glm::vec3(0.0f));
-                std::vector<glm::vec3> bAccum(vertexCount, glm::vec3(0.0f));
-
-                // Loop over every triangle to accumulate normals & tangents
-                for (size_t tri = 0; tri < ground->indices.size(); tri += 3) {
-                    uint32_t i0 = ground->indices[tri + 0];
-                    uint32_t i1 = ground->indices[tri + 1];
-                    uint32_t i2 = ground->indices[tri + 2];
-
-                    // read positions
-                    auto p0 = reinterpret_cast<glm::vec3*>(&rawVB[i0*stride + posOffset]);
-                    auto p1 = reinterpret_cast<glm::vec3*>(&rawVB[i1*stride + posOffset]);
-                    auto p2 = reinterpret_cast<glm::vec3*>(&rawVB[i2*stride + posOffset]);
-
-                    glm::vec3 P0 = *p0, P1 = *p1, P2 = *p2;
-
-                    // read UVs
-                    auto uv0 = reinterpret_cast<glm::vec2*>(&rawVB[i0*stride + ground->VD->UV.offset]);
-                    auto uv1 = reinterpret_cast<glm::vec2*>(&rawVB[i1*stride + ground->VD->UV.offset]);
-                    auto uv2 = reinterpret_cast<glm::vec2*>(&rawVB[i2*stride + ground->VD->UV.offset]);
-
-                    glm::vec2 UV0 = *uv0, UV1 = *uv1, UV2 = *uv2;
-
-                    // face normal
-                    glm::vec3 edge1 = P1 - P0;
-                    glm::vec3 edge2 = P2 - P0;
-                    glm::vec3 faceN = glm::normalize(glm::cross(edge1, edge2));
-
-                    // accumulate
-                    nAccum[i0] += faceN;
-                    nAccum[i1] += faceN;
-                    nAccum[i2] += faceN;
-
-                    // compute tangent & bitangent
-                    glm::vec2 dUV1 = UV1 - UV0;
-                    glm::vec2 dUV2 = UV2 - UV0;
-                    float r = 1.0f / (dUV1.x * dUV2.y - dUV2.x * dUV1.y);
-                    glm::vec3 tangent = (edge1 * dUV2.y - edge2 * dUV1.y) * r;
-                    glm::vec3 bitan   = (edge2 * dUV1.x - edge1 * dUV2.x) * r;
-
-                    tAccum[i0] += tangent;  bAccum[i0] += bitan;
-                    tAccum[i1] += tangent;  bAccum[i1] += bitan;
-                    tAccum[i2] += tangent;  bAccum[i2] += bitan;
-                }
-
-                // Orthonormalize per-vertex and write back into rawVB
-                for (size_t vi = 0; vi < vertexCount; ++vi) {
-                    // normalize accumulated normal
-                    glm::vec3 n = glm::normalize(nAccum[vi]);
-
-                    // Gram‑Schmidt tangent
-                    glm::vec3 t = tAccum[vi];
-                    t = glm::normalize(t - n * glm::dot(n, t));
-
-                    // handedness
-                    float h = (glm::dot(glm::cross(n, t), bAccum[vi]) < 0.0f) ? -1.0f : +1.0f;
-
-                    // write back
-                    auto dstN = reinterpret_cast<glm::vec3*>(&rawVB[vi*stride + ground->VD->Normal.offset]);
-                    *dstN = n;
-
-                    auto dstT = reinterpret_cast<glm::vec4*>(&rawVB[vi*stride + ground->VD->Tangent.offset]);
-                    *dstT = glm::vec4(t, h);
-                }
-
+            // The mesh follows the airplane in steps of the coarsest spacing, so every vertex lies on a sample
+            // of the height cache of its level: only the tiles that become visible need new noise evaluations
+            groundSnapPosition = groundMesh.follow(airplanePosition.x, airplanePosition.z);
+            groundWaterTime = counterGlobal * 0.3f;
+            groundStamp++;
+        }
+        if (groundOnGPU) {
+            // only the parameters of the displacement change, the mesh is never touched
+            const float spacing = groundMesh.getSpacing(0);
+            const float scaleXZ = glm::length(glm::vec3(groundBaseWm[0]));
+            const float frequency = noiseGround.GetFrequency();
+            groundDisplacement.position = glm::vec4(groundSnapPosition.x, groundSnapPosition.z, scaleXZ,
+                                                    groundWaterTime * frequency);
+            groundDisplacement.noise = glm::vec4(NOISE_SCALE * frequency, HEIGHT_SCALE,
+                                                 (waterLevel - WATER_FLOOR_DEPTH) / GROUND_SCALE,
+                                                 WATER_BLEND_WIDTH / GROUND_SCALE);
+            groundDisplacement.grid = glm::vec4(spacing / scaleXZ, CLIPMAP_HALF_SIZE, CLIPMAP_LEVELS, 0.0f);
+        } else {
+            // while the game is over the ground is frozen, but the regions of the other images may still be behind
+            int64_t& regionStamp = groundRegionStamp[currentImage % groundRegionStamp.size()];
+            if (regionStamp != groundStamp) {
+                // water level, and how wide (in world‑units) the blend region is around it
+                const float floorY     = (waterLevel - WATER_FLOOR_DEPTH) / GROUND_SCALE;
+                const float blendWidth = WATER_BLEND_WIDTH / GROUND_SCALE;
+                groundMesh.write(ground->getDynamicVertexRegion(currentImage), groundWaterTime, floorY, blendWidth,
+                                 changeTangents, gridNormals);
+                regionStamp = groundStamp;
             }
-            // ---------------------------------------------------
-            ground->updateVertexBuffer();
         }
         // Update the ground heightfield of ODE
         updateGroundHeightfield(glm::length(glm::vec3(groundBaseWm[1])));
@@ -1062,6 +1133,10 @@ protected:
         {
             changeTangents = !changeTangents;
         }
+        if (handleDebouncedKeyPress(GLFW_KEY_G))
+        {
+            gridNormals = !gridNormals;
+        }
         isBoosting = false;
         if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS) {
             isBoosting = true;
@@ -1090,8 +1165,9 @@ protected:
     // --- Update all uniform buffers ---
     void updateUniforms(uint32_t currentImage, float deltaT)
     {
-        shift2Dplane();
-        const int SIMP_TECH_INDEX = 0, GEM_TECH_INDEX = 1, SKY_TECH_INDEX = 2, PBR_TECH_INDEX = 3;
+        shift2Dplane(currentImage);
+        const int SIMP_TECH_INDEX = 0, GEM_TECH_INDEX = 1, SKY_TECH_INDEX = 2, PBR_TECH_INDEX = 3, TREE_TECH_INDEX = 4,
+                  IMPOSTOR_TECH_INDEX = 5;
 
         // Setting uniform buffers
         const glm::mat4 lightView = glm::rotate(glm::mat4(1), glm::radians(-30.0f), glm::vec3(0.0f, 1.0f, 0.0f)) *
@@ -1107,19 +1183,40 @@ protected:
         guboground.referencePosition = gameState != GAME_OVER ? airplanePosition : cameraPos;
         guboground.otherParams = glm::vec4(groundY, waterLevel, grassLevel, rockLevel);
 
+        // written once, for all the pipelines using DSLglobal
+        SC.getSharedSet(&DSLglobal)->map(currentImage, &gubo, 0);
+
         UniformBufferObjectSimp ubos{};
         for (int inst_idx = 0; inst_idx < SC.TI[SIMP_TECH_INDEX].InstanceCount; ++inst_idx)
         {
-            // check if the instance is the airplane and rotor (index 0 and 1) or the trees (index 2 and above)
-            if (inst_idx <= 1) ubos.mMat = SC.TI[SIMP_TECH_INDEX].I[inst_idx].Wm;
-            else ubos.mMat = treeWorld[inst_idx - 2];
-
+            // the airplane and its rotor
+            ubos.mMat = SC.TI[SIMP_TECH_INDEX].I[inst_idx].Wm;
             ubos.mvpMat = ViewPrj * ubos.mMat;
             ubos.nMat = glm::inverse(glm::transpose(ubos.mMat));
-            SC.TI[SIMP_TECH_INDEX].I[inst_idx].DS[0][0]->map(currentImage, &gubo, 0);
             SC.TI[SIMP_TECH_INDEX].I[inst_idx].DS[0][1]->map(currentImage, &ubos, 0);
         }
 
+        // the trees: the world matrices go in the instance buffer, the uniforms of each batch
+        // only hold the view-projection. The far ones are drawn by their impostors, that take their
+        // world matrices in SC.selectLods()
+        for (int inst_idx = 0; inst_idx < SC.TI[TREE_TECH_INDEX].InstanceCount; ++inst_idx)
+        {
+            SC.TI[TREE_TECH_INDEX].I[inst_idx].Wm = treeWorld[inst_idx];
+            SC.TI[TREE_TECH_INDEX].I[inst_idx].enabled = vegetation.isUsed(inst_idx);
+        }
+        UniformBufferObjectSimp uboTrees{};
+        uboTrees.mvpMat = ViewPrj;
+        uboTrees.mMat = glm::mat4(1.0f);
+        uboTrees.nMat = glm::mat4(1.0f);
+        for (int tech : {TREE_TECH_INDEX, IMPOSTOR_TECH_INDEX})
+        {
+            for (int b = 0; b < SC.TI[tech].BatchCount; ++b)
+            {
+                Instance& leader = SC.TI[tech].I[SC.TI[tech].B[b].leader];
+                leader.DS[0][1]->map(currentImage, &uboTrees, 0);
+            }
+        }
+
         if (SC.TI[PBR_TECH_INDEX].InstanceCount > 0)
         {
             UniformBufferObjectSimp ubogpbr{};
@@ -1130,6 +1227,7 @@ protected:
             // Here we set the ground position in local coordinates
             // ubogpbr.worldMat = groundBaseWm;
             SC.TI[PBR_TECH_INDEX].I[0].DS[0][0]->map(currentImage, &guboground, 0);
+            if (groundOnGPU || groundCompact) SC.TI[PBR_TECH_INDEX].I[0].DS[0][0]->map(currentImage, &groundDisplacement, 1);
             SC.TI[PBR_TECH_INDEX].I[0].DS[0][1]->map(currentImage, &ubogpbr, 0);
         }
 
@@ -1143,10 +1241,18 @@ protected:
                 glm::mat4(1.0f), glm::vec3(gemScale));
             uboGem.mvpMat = ViewPrj * uboGem.mMat;
             uboGem.nMat = glm::inverse(glm::transpose(uboGem.mMat));
-            SC.TI[GEM_TECH_INDEX].I[inst_idx].DS[0][0]->map(currentImage, &gubo, 0);
             SC.TI[GEM_TECH_INDEX].I[inst_idx].DS[0][1]->map(currentImage, &uboGem, 0);
+            SC.TI[GEM_TECH_INDEX].I[inst_idx].Wm = uboGem.mMat;
         }
 
+        // all the world matrices are up to date: only the visible trees go in the instance buffer,
+        // and only the visible instances are drawn, sorted to bind as little state as possible
+        SC.selectLods(cameraPos);
+        SC.cull(ViewPrj);
+        SC.updateGpuCulling(ViewPrj, cameraPos, currentImage);
+        SC.updateInstances(currentImage);
+        SC.sortDraws(ViewPrj);
+
 
         if (SC.TI[SKY_TECH_INDEX].InstanceCount > 0)
         {
@@ -1167,7 +1273,11 @@ protected:
         {
             float fps = (float)countedFrames / elapsedT;
             std::ostringstream oss;
-            oss << "FPS: " << std::fixed << std::setprecision(1) << fps;
+            oss << "FPS: " << std::fixed << std::setprecision(1) << fps
+                << "  Visible: " << SC.cullStats.visible << "/" << SC.cullStats.tested
+                << "  Draws: " << SC.bindStats.draws << "  Binds P/DS/B: " << SC.bindStats.pipelines
+                << "/" << SC.bindStats.descriptorSets << "/" << SC.bindStats.buffers
+                << "  Trees near/far: " << SC.lodStats.near << "/" << SC.lodStats.far;
             txt.print(1.0f, 1.0f, oss.str(), FPS, "CO", false, false, true, TAL_RIGHT, TRH_RIGHT, TRV_BOTTOM,
                       {1.0f, 0.0f, 0.0f, 1.0f}, {0.8f, 0.8f, 0.0f, 1.0f}, {0, 0, 0, 1});
             elapsedT = 0.0f;
@@ -1209,7 +1319,7 @@ protected:
             );
             cameraPos = airplanePosition + cameraOffset;
             cameraLookAt = airplanePosition;
-            glm::mat4 projectionMatrix = glm::perspective(currentFov, Ar, 1.f, 500.f);
+            glm::mat4 projectionMatrix = glm::perspective(currentFov, Ar, 1.f, farPlane);
             projectionMatrix[1][1] *= -1;
             viewMatrix = glm::lookAt(cameraPos, cameraLookAt, glm::vec3(0.0f, 1.0f, 0.0f));
 
@@ -1620,7 +1730,7 @@ protected:
                 default:
                     {
                         // Here we use the currentFov for perspective projection
-                        projectionMatrix = glm::perspective(currentFov, Ar, 1.f, 500.f);
+                        projectionMatrix = glm::perspective(currentFov, Ar, 1.f, farPlane);
                         break;
                     }
                 }
@@ -1687,7 +1797,7 @@ protected:
             if (airplaneInitialized)
             {
                 // The camera will stay fixed in the last position, wil not follow the airplane
-                glm::mat4 projectionMatrix = glm::perspective(currentFov, Ar, 1.f, 500.f);
+                glm::mat4 projectionMatrix = glm::perspective(currentFov, Ar, 1.f, farPlane);
                 projectionMatrix[1][1] *= -1;
                 viewMatrix = glm::lookAt(cameraPos, cameraLookAt, glm::vec3(0.0f, 1.0f, 0.0f));
                 ViewPrj = projectionMatrix * viewMatrix;
@@ -1790,10 +1900,10 @@ protected:
         alListenerfv(AL_ORIENTATION, ori);
 
 
-        // move the ground plane to follow the airplane (not in game over)
+        // move the ground plane to follow the airplane (not in game over), snapped to the height cache lattice
         glm::mat4 groundXzFollow = glm::translate(
             glm::mat4(1.0f),
-            glm::vec3(airplanePosition.x, 0, airplanePosition.z)
+            glm::vec3(groundSnapPosition.x, 0, groundSnapPosition.z)
         );
 
         if (groundTechIdx >= 0 && groundInstIdx >= 0 && gameState != GAME_OVER)
@@ -1967,52 +2077,25 @@ protected:
 
     float sampleHeight(float x, float z)
     {
-        // Sample the terrain height at (x, z) using the noise function
-        return noiseGround.GetNoise(x * 0.004f, z * 0.004f) * 0.05f * 500;
+        // Sample the terrain height at (x, z) from the cached ground noise
+        return groundMesh.sampleNoise(x, z) * HEIGHT_SCALE * GROUND_SCALE;
     }
 
+    // The cells of the grid entering the range of the airplane get their trees, the ones leaving it free them:
+    // the noise is sampled only when the airplane moves to another cell
     void updateTreePositions()
     {
-        float distance = 500.f;
-        for (auto & M : treeWorld)
+        if (!vegetation.recenter(airplanePosition.x, airplanePosition.z))
         {
-            // extract translation from the matrix
-            float x = M[3][0];
-            float z = M[3][2];
-            bool movedX = false;
-            bool movedZ = false;
-
-            if (x < airplanePosition.x - distance) {
-                x += distance * 2.f;
-                movedX = true;
-            }
-            if (x > airplanePosition.x + distance) {
-                x -= distance * 2.f;
-                movedX = true;
-            }
-            if (z < airplanePosition.z - distance) {
-                z += distance * 2.f;
-                movedZ = true;
-            }
-            if (z > airplanePosition.z + distance) {
-                z -= distance * 2.f;
-                movedZ = true;
-            }
-
-            float yNew = sampleHeight(x, z);
-            while (yNew < -0.5f)
+            return;
+        }
+        for (int i = 0; i < vegetation.getSlotCount(); i++)
+        {
+            if (vegetation.isUsed(i))
             {
-                if (movedX && !movedZ) {
-                    z = airplanePosition.z + treeZ(rng);
-                } else if (!movedX && movedZ) {
-                    x = airplanePosition.x + treeX(rng);
-                } else {
-                    x = airplanePosition.x + treeX(rng);
-                    z = airplanePosition.z + treeZ(rng);
-                }
-                yNew = sampleHeight(x, z);
+                treeWorld[i] = glm::translate(glm::mat4(1.0f), vegetation.getPosition(i)) *
+                               glm::scale(glm::mat4(1.0f), glm::vec3(vegetation.getScale(i)));
             }
-            M = glm::translate(glm::mat4(1.0f), {x, yNew, z});
         }
     }
 
@@ -2087,6 +2170,27 @@ protected:
         }
     }
 
+public:
+    // Startup options, they must be parsed before run()
+    //   --ground=cpu|compact|gpu   ground displaced by shift2Dplane (with VertexTan or VertexTerrain vertices)
+    //                              or by the vertex shader
+    //   --threads=N                threads of the job system (0 = one per hardware thread)
+    //   --culling=cpu|gpu          trees and impostors culled on the CPU, or by a compute shader and drawn indirectly
+    void parseArguments(int argc, char* argv[])
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (arg == "--ground=cpu") { groundOnGPU = false; groundCompact = false; }
+            else if (arg == "--ground=compact") { groundOnGPU = false; groundCompact = true; }
+            else if (arg == "--ground=gpu") { groundOnGPU = true; groundCompact = false; }
+            else if (arg == "--culling=cpu") gpuCulling = false;
+            else if (arg == "--culling=gpu") gpuCulling = true;
+            else if (arg.rfind("--threads=", 0) == 0) jobThreadCount = std::max(0, std::atoi(arg.c_str() + 10));
+            else std::cout << "WARNING: unknown option " << arg << "\n";
+        }
+    }
+
 private:
     static void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
     {
@@ -2099,9 +2203,10 @@ private:
 };
 
 // This is the main: probably you do not need to touch this!
-int main()
+int main(int argc, char* argv[])
 {
     CG_Exam app;
+    app.parseArguments(argc, argv);
 
     try
     {